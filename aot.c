@@ -0,0 +1,421 @@
+// AOT compiler: writes the bytecode of a program as a C function with a
+// block of code per instruction. The blocks call the same runtime as
+// execute() does; instructions without a block of their own, and the
+// error paths of the ones with, are run by the VM one at a time.
+// Function entries and return addresses are only known at run time, so
+// calls and returns go through a switch over them.
+#include <stdlib.h>
+#include <string.h>
+
+#include "aquario.h"
+
+static const char *aot_prelude =
+    "// generated by aquario -AOT; do not edit.\n"
+    "#include \"aquario.h\"\n"
+    "#include \"gc/base.h\"\n"
+    "\n"
+    "#define TOP (stack[stack_top - 1])\n"
+    "#define NEXT (stack[stack_top - 2])\n"
+    "\n"
+    "// the VM runs [p, n), which reports the error.\n"
+    "#define FAIL(p, n)       \\\n"
+    "  {                      \\\n"
+    "    pc = (p);            \\\n"
+    "    vm_run(buf, &pc, n); \\\n"
+    "    goto aot_exit;       \\\n"
+    "  }\n"
+    "\n"
+    "// the VM runs [p, n).\n"
+    "#define STEP(p, n)       \\\n"
+    "  {                      \\\n"
+    "    pc = (p);            \\\n"
+    "    vm_run(buf, &pc, n); \\\n"
+    "    if (is_error())      \\\n"
+    "    {                    \\\n"
+    "      goto aot_exit;     \\\n"
+    "    }                    \\\n"
+    "  }\n"
+    "\n"
+    "#define CALL(p)                          \\\n"
+    "  {                                      \\\n"
+    "    pc = enter_function(buf, (p), -1);   \\\n"
+    "    if (pc < 0)                          \\\n"
+    "    {                                    \\\n"
+    "      goto aot_exit;                     \\\n"
+    "    }                                    \\\n"
+    "    goto aot_dispatch;                   \\\n"
+    "  }\n"
+    "\n";
+
+static const char *comparison_operator(aq_opcode op)
+{
+  switch (op)
+  {
+  case OP_EQUAL:
+  case OP_JNEQUAL:
+  case OP_JNEQUAL_LL:
+  case OP_JNEQUAL_LI:
+  case OP_EQUAL_R:
+  case OP_JNEQUAL_R:
+    return "==";
+  case OP_LT:
+  case OP_JNLT:
+  case OP_JNLT_LL:
+  case OP_JNLT_LI:
+  case OP_LT_R:
+  case OP_JNLT_R:
+    return "<";
+  case OP_LTE:
+  case OP_JNLTE:
+  case OP_JNLTE_LL:
+  case OP_JNLTE_LI:
+  case OP_LTE_R:
+  case OP_JNLTE_R:
+    return "<=";
+  case OP_GT:
+  case OP_JNGT:
+  case OP_JNGT_LL:
+  case OP_JNGT_LI:
+  case OP_GT_R:
+  case OP_JNGT_R:
+    return ">";
+  default:
+    return ">=";
+  }
+}
+
+// the address an instruction jumps to, or -1.
+static int jump_target(char *buf, int pc)
+{
+  switch ((unsigned char)buf[pc])
+  {
+  case OP_JNEQ:
+  case OP_JMP:
+  case OP_JNEQUAL:
+  case OP_JNLT:
+  case OP_JNLTE:
+  case OP_JNGT:
+  case OP_JNGTE:
+  case OP_FUND:
+  case OP_FUNDD:
+    return get_operand(buf, pc + 1);
+  case OP_JNEQUAL_LL:
+  case OP_JNLT_LL:
+  case OP_JNLTE_LL:
+  case OP_JNGT_LL:
+  case OP_JNGTE_LL:
+  case OP_JNEQUAL_LI:
+  case OP_JNLT_LI:
+  case OP_JNLTE_LI:
+  case OP_JNGT_LI:
+  case OP_JNGTE_LI:
+  case OP_JNEQUAL_R:
+  case OP_JNLT_R:
+  case OP_JNLTE_R:
+  case OP_JNGT_R:
+  case OP_JNGTE_R:
+    return get_operand(buf, pc + 1 + sizeof(Cell) * 2);
+  case OP_JNEQ_R:
+    return get_operand(buf, pc + 1 + sizeof(Cell));
+  default:
+    return -1;
+  }
+}
+
+// whether the VM may jump to pc from somewhere else than the instruction
+// before it: such instructions get a label.
+static void mark_labels(char *buf, int size, char *labels, char *entries)
+{
+  for (int pc = 0; pc < size; pc += get_inst_size(buf, pc))
+  {
+    aq_opcode op = (unsigned char)buf[pc];
+    int target = jump_target(buf, pc);
+    if (target >= 0 && target <= size)
+    {
+      labels[target] = TRUE;
+    }
+    int next = pc + get_inst_size(buf, pc);
+    if (op == OP_FUND || op == OP_FUNDD)
+    {
+      entries[next] = TRUE;
+    }
+    else if (op == OP_FUNC || op == OP_FUNCG || op == OP_FUNCS)
+    {
+      entries[next] = TRUE;
+    }
+  }
+  for (int pc = 0; pc <= size; pc++)
+  {
+    labels[pc] |= entries[pc];
+  }
+}
+
+// the C expression of a register operand.
+static void write_register_operand(FILE *fp, int operand)
+{
+  if (IMMEDIATE_OPERAND_P(operand))
+  {
+    fprintf(fp, "make_integer(%d)", operand >> 1);
+  }
+  else
+  {
+    fprintf(fp, "frame[%d]", (operand >> 1) + 4);
+  }
+}
+
+static void write_register_operands(FILE *fp, char *buf, int pc)
+{
+  fprintf(fp, "  { Cell c1 = ");
+  write_register_operand(fp, get_operand(buf, pc));
+  fprintf(fp, ", c2 = ");
+  write_register_operand(fp, get_operand(buf, pc + sizeof(Cell)));
+  fprintf(fp, ";\n");
+}
+
+// writes the code of the instruction at pc and returns where the next
+// code starts, which is past both instructions when two are fused.
+static int write_inst_code(FILE *fp, char *buf, int pc, int next, char *labels)
+{
+  aq_opcode op = (unsigned char)buf[pc];
+  int operand = (next - pc > (int)sizeof(Cell)) ? get_operand(buf, pc + 1) : 0;
+  switch (op)
+  {
+  case OP_NOP:
+    break;
+  case OP_PUSH:
+  {
+    // (+ a b) and (* a b) push their number of arguments for OP_ADD and OP_MUL.
+    aq_opcode arith = (unsigned char)buf[next];
+    if (operand == 2 && (arith == OP_ADD || arith == OP_MUL) && !labels[next])
+    {
+      fprintf(fp, "  if (!INTEGER_P(TOP) || !INTEGER_P(NEXT)) FAIL(%d, %d);\n", pc, next + 1);
+      fprintf(fp, "  { Cell r = make_integer((long)INT_VALUE(NEXT) %s INT_VALUE(TOP)); pop_arg(); pop_arg(); push_arg(r); }\n",
+              (arith == OP_ADD) ? "+" : "*");
+      return next + 1;
+    }
+    fprintf(fp, "  push_arg(make_integer(%d));\n", operand);
+    break;
+  }
+  case OP_ARGC:
+    fprintf(fp, "  push_arg(make_integer(%d));\n", operand);
+    break;
+  case OP_PUSH_NIL:
+    fprintf(fp, "  push_arg((Cell)AQ_NIL);\n");
+    break;
+  case OP_PUSH_TRUE:
+    fprintf(fp, "  push_arg((Cell)AQ_TRUE);\n");
+    break;
+  case OP_PUSH_FALSE:
+    fprintf(fp, "  push_arg((Cell)AQ_FALSE);\n");
+    break;
+  case OP_PUSH_STR:
+    fprintf(fp, "  push_arg(string_cell(&buf[%d]));\n", pc + 1);
+    break;
+  case OP_PUSH_SYM:
+    fprintf(fp, "  push_arg(symbol_cell(&buf[%d]));\n", pc + 1);
+    break;
+  case OP_POP:
+    fprintf(fp, "  pop_arg();\n");
+    break;
+  case OP_LOAD:
+    fprintf(fp, "  push_arg(frame[-%d]);\n", operand);
+    break;
+  case OP_REFG:
+    fprintf(fp, "  if (UNDEF_P(env[%d])) FAIL(%d, %d);\n", operand, pc, next);
+    fprintf(fp, "  push_arg(env[%d]);\n", operand);
+    break;
+  case OP_ADD1:
+  case OP_ADD2:
+  case OP_SUB1:
+  case OP_SUB2:
+    fprintf(fp, "  if (!INTEGER_P(TOP)) FAIL(%d, %d);\n", pc, next);
+    fprintf(fp, "  { int ans = %d + INT_VALUE(TOP); pop_arg(); push_arg(make_integer(ans)); }\n",
+            (op == OP_ADD1) ? 1 : (op == OP_ADD2) ? 2 : (op == OP_SUB1) ? -1 : -2);
+    break;
+  case OP_EQUAL:
+  case OP_LT:
+  case OP_LTE:
+  case OP_GT:
+  case OP_GTE:
+    fprintf(fp, "  if (!INTEGER_P(TOP) || !INTEGER_P(NEXT)) FAIL(%d, %d);\n", pc, next);
+    fprintf(fp, "  { Cell r = (INT_VALUE(NEXT) %s INT_VALUE(TOP)) ? (Cell)AQ_TRUE : (Cell)AQ_FALSE; pop_arg(); pop_arg(); push_arg(r); }\n",
+            comparison_operator(op));
+    break;
+  case OP_EQ:
+    fprintf(fp, "  { Cell p1 = pop_arg(); Cell p2 = pop_arg(); push_arg((p1 == p2) ? (Cell)AQ_TRUE : (Cell)AQ_FALSE); }\n");
+    break;
+  case OP_CONS:
+    fprintf(fp, "  { Cell r = pair_cell(&NEXT, &TOP); pop_arg(); pop_arg(); push_arg(r); }\n");
+    break;
+  case OP_CAR:
+  case OP_CDR:
+    fprintf(fp, "  if (!PAIR_P(TOP)) FAIL(%d, %d);\n", pc, next);
+    fprintf(fp, "  gc_write_barrier_root(&TOP, %s(TOP));\n", (op == OP_CAR) ? "CAR" : "CDR");
+    break;
+  case OP_CADR:
+  case OP_CDDR:
+    fprintf(fp, "  if (!PAIR_P(TOP) || !PAIR_P(CDR(TOP))) FAIL(%d, %d);\n", pc, next);
+    fprintf(fp, "  gc_write_barrier_root(&TOP, %s(CDR(TOP)));\n", (op == OP_CADR) ? "CAR" : "CDR");
+    break;
+  case OP_LOAD_CAR:
+  case OP_LOAD_CDR:
+    fprintf(fp, "  if (!PAIR_P(frame[-%d])) FAIL(%d, %d);\n", operand, pc, next);
+    fprintf(fp, "  push_arg(%s(frame[-%d]));\n", (op == OP_LOAD_CAR) ? "CAR" : "CDR", operand);
+    break;
+  case OP_JMP:
+    fprintf(fp, "  goto L_%d;\n", operand);
+    break;
+  case OP_JNEQ:
+    fprintf(fp, "  if (!TRUE_P(pop_arg())) goto L_%d;\n", operand);
+    break;
+  case OP_JNEQUAL:
+  case OP_JNLT:
+  case OP_JNLTE:
+  case OP_JNGT:
+  case OP_JNGTE:
+    fprintf(fp, "  if (!INTEGER_P(TOP) || !INTEGER_P(NEXT)) FAIL(%d, %d);\n", pc, next);
+    fprintf(fp, "  { int b = (INT_VALUE(NEXT) %s INT_VALUE(TOP)); pop_arg(); pop_arg(); if (!b) goto L_%d; }\n",
+            comparison_operator(op), operand);
+    break;
+  case OP_JNEQUAL_LL:
+  case OP_JNLT_LL:
+  case OP_JNLTE_LL:
+  case OP_JNGT_LL:
+  case OP_JNGTE_LL:
+  {
+    int operand2 = get_operand(buf, pc + 1 + sizeof(Cell));
+    fprintf(fp, "  if (!INTEGER_P(frame[-%d]) || !INTEGER_P(frame[-%d])) FAIL(%d, %d);\n", operand2, operand, pc, next);
+    fprintf(fp, "  if (!(INT_VALUE(frame[-%d]) %s INT_VALUE(frame[-%d]))) goto L_%d;\n",
+            operand, comparison_operator(op), operand2, jump_target(buf, pc));
+    break;
+  }
+  case OP_JNEQUAL_LI:
+  case OP_JNLT_LI:
+  case OP_JNLTE_LI:
+  case OP_JNGT_LI:
+  case OP_JNGTE_LI:
+    fprintf(fp, "  if (!INTEGER_P(frame[-%d])) FAIL(%d, %d);\n", operand, pc, next);
+    fprintf(fp, "  if (!(INT_VALUE(frame[-%d]) %s %d)) goto L_%d;\n",
+            operand, comparison_operator(op), get_operand(buf, pc + 1 + sizeof(Cell)), jump_target(buf, pc));
+    break;
+  case OP_ADD_R:
+  case OP_SUB_R:
+  case OP_MUL_R:
+  case OP_EQUAL_R:
+  case OP_LT_R:
+  case OP_LTE_R:
+  case OP_GT_R:
+  case OP_GTE_R:
+    write_register_operands(fp, buf, pc + 1 + sizeof(Cell));
+    fprintf(fp, "    if (!INTEGER_P(c2) || !INTEGER_P(c1)) FAIL(%d, %d);\n", pc, next);
+    if (op <= OP_MUL_R)
+    {
+      fprintf(fp, "    set_register(%d, make_integer((long)INT_VALUE(c1) %s INT_VALUE(c2))); }\n", operand,
+              (op == OP_ADD_R) ? "+" : (op == OP_SUB_R) ? "-" : "*");
+    }
+    else
+    {
+      fprintf(fp, "    set_register(%d, (INT_VALUE(c1) %s INT_VALUE(c2)) ? (Cell)AQ_TRUE : (Cell)AQ_FALSE); }\n", operand,
+              comparison_operator(op));
+    }
+    break;
+  case OP_JNEQUAL_R:
+  case OP_JNLT_R:
+  case OP_JNLTE_R:
+  case OP_JNGT_R:
+  case OP_JNGTE_R:
+    write_register_operands(fp, buf, pc + 1);
+    fprintf(fp, "    if (!INTEGER_P(c2) || !INTEGER_P(c1)) FAIL(%d, %d);\n", pc, next);
+    fprintf(fp, "    pop_registers(%d); pop_registers(%d);\n", operand, get_operand(buf, pc + 1 + sizeof(Cell)));
+    fprintf(fp, "    if (!(INT_VALUE(c1) %s INT_VALUE(c2))) goto L_%d; }\n", comparison_operator(op), jump_target(buf, pc));
+    break;
+  case OP_JNEQ_R:
+    fprintf(fp, "  { Cell c = ");
+    write_register_operand(fp, operand);
+    fprintf(fp, "; pop_registers(%d); if (!TRUE_P(c)) goto L_%d; }\n", operand, jump_target(buf, pc));
+    break;
+  case OP_FUND:
+  case OP_FUNDD:
+    fprintf(fp, "  push_arg(lambda_cell(%d, %d, %s));\n", next, get_operand(buf, pc + 1 + sizeof(Cell)),
+            (op == OP_FUNDD) ? "TRUE" : "FALSE");
+    fprintf(fp, "  goto L_%d;\n", operand);
+    break;
+  case OP_FUNC:
+  case OP_FUNCG:
+  case OP_TFUNCG:
+  case OP_FUNCS:
+  case OP_TFUNCS:
+    fprintf(fp, "  CALL(%d);\n", pc);
+    break;
+  case OP_RET:
+    fprintf(fp, "  pc = leave_function();\n");
+    fprintf(fp, "  if (pc < 0) goto aot_exit;\n");
+    fprintf(fp, "  goto aot_dispatch;\n");
+    break;
+  case OP_HALT:
+    fprintf(fp, "  goto aot_exit;\n");
+    break;
+  default:
+    fprintf(fp, "  STEP(%d, %d);\n", pc, next);
+    break;
+  }
+  return next;
+}
+
+void aot_write(FILE *fp, char *buf, int size)
+{
+  char *labels = (char *)calloc(size + 1, sizeof(char));
+  char *entries = (char *)calloc(size + 1, sizeof(char));
+  mark_labels(buf, size, labels, entries);
+
+  fputs(aot_prelude, fp);
+
+  // the bytecode stays for the VM, the strings and the inline caches.
+  fprintf(fp, "static char aot_buf[%d] = {", (size > 0) ? size : 1);
+  for (int i = 0; i < size; i++)
+  {
+    fprintf(fp, "%s%d,", (i % 16 == 0) ? "\n  " : " ", buf[i]);
+  }
+  fprintf(fp, "\n};\n\n");
+
+  fprintf(fp, "void aot_execute()\n{\n");
+  fprintf(fp, "  char *buf = aot_buf;\n");
+  fprintf(fp, "  Cell *frame = NULL;\n");
+  fprintf(fp, "  int pc = 0;\n");
+  fprintf(fp, "  stack_top = 0;\n\n");
+
+  int pc = 0;
+  while (pc < size)
+  {
+    int next = pc + get_inst_size(buf, pc);
+    if (labels[pc])
+    {
+      fprintf(fp, "L_%d:\n", pc);
+    }
+    pc = write_inst_code(fp, buf, pc, next, labels);
+  }
+  if (labels[size])
+  {
+    fprintf(fp, "L_%d:\n", size);
+  }
+  fprintf(fp, "  goto aot_exit;\n\n");
+
+  // calls and returns land on the function entries and the return addresses.
+  fprintf(fp, "aot_dispatch:\n");
+  fprintf(fp, "  frame = get_frame_base();\n");
+  fprintf(fp, "  switch (pc)\n  {\n");
+  for (int i = 0; i < size; i++)
+  {
+    if (entries[i])
+    {
+      fprintf(fp, "  case %d:\n    goto L_%d;\n", i, i);
+    }
+  }
+  fprintf(fp, "  }\n");
+  fprintf(fp, "aot_exit:\n");
+  fprintf(fp, "  (void)frame;\n");
+  fprintf(fp, "}\n");
+
+  free(labels);
+  free(entries);
+}
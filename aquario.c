@@ -1,6 +1,9 @@
 #include <string.h>
 #include <ctype.h>
 #include <sys/stat.h>
+#if defined(AQ_GC_THREADS)
+#include <unistd.h>
+#endif
 
 #include "aquario.h"
 #include "gc/base.h"
@@ -8,12 +11,49 @@
 static void set_gc(char *);
 
 aq_bool g_GC_stress;
+aq_bool g_GC_lazy_sweep;
+aq_bool g_GC_incremental;
+aq_bool g_GC_depth_first;
+size_t g_heap_max = HEAP_MAX;
+int g_heap_live_ratio = HEAP_LIVE_RATIO;
+int g_GC_time_ratio = GC_TIME_RATIO;
+int g_GC_threads = 1;
+aq_bool g_register_code = FALSE;
+#if defined(AQ_JIT)
+int g_JIT_threshold = -1;
+#endif
 
-static Cell get_chain(char *name, int *key);
-static void register_var(Cell name_cell, Cell chain, Cell c, Cell *env);
+Cell env[ENVSIZE];
+Cell stack[STACKSIZE];
+int stack_top;
+
+// global variables: each name is given a fixed slot of env[] at compile time.
+struct _global_entry
+{
+  char *name;
+  int slot;
+  struct _global_entry *next;
+};
+typedef struct _global_entry global_entry;
+static global_entry *global_table[ENVSIZE];
+static int global_count = 0;
+static int global_version[ENVSIZE]; // bumped whenever a slot is rebound.
+
+// interned symbols: the cells live in the static area, which no collector moves.
+#define SYMBOL_TABLE_SIZE (1024)
+struct _symbol_entry
+{
+  Cell symbol;
+  struct _symbol_entry *next;
+};
+typedef struct _symbol_entry symbol_entry;
+static symbol_entry *symbol_table[SYMBOL_TABLE_SIZE];
 
 static void init();
 static void term();
+#if defined(AQ_PROFILE_OPCODES)
+static void print_opcode_profile();
+#endif
 
 static int heap_size = HEAP_SIZE;
 
@@ -31,17 +71,21 @@ static int get_function_stack_top();
 
 static aq_error_type err_type = ERR_TYPE_NONE;
 
+// leaves the current function when an error is set.
+// execute() redefines this so that it leaves the dispatch loop instead.
+#define ERROR_RETURN return
+
 #define SET_ERROR_WITH_STR(err, str) \
   err_type = err;                    \
   push_arg(string_cell(str));        \
-  return;
+  ERROR_RETURN;
 
 #define ERR_WRONG_NUMBER_ARGS_BASE(required, given, str) \
   err_type = ERR_TYPE_WRONG_NUMBER_ARG;                  \
   push_arg(make_integer(required));                      \
   push_arg(make_integer(given));                         \
   push_arg(string_cell(str));                            \
-  return;
+  ERROR_RETURN;
 
 #define ERR_WRONG_NUMBER_ARGS(required, given, str)   \
   if (required != given)                              \
@@ -60,7 +104,7 @@ static aq_error_type err_type = ERR_TYPE_NONE;
   {                                     \
     err_type = ERR_TYPE_PAIR_NOT_GIVEN; \
     push_arg(string_cell(str));         \
-    return;                             \
+    ERROR_RETURN;                       \
   }
 
 #define ERR_INT_NOT_GIVEN(num, str)    \
@@ -69,7 +113,7 @@ static aq_error_type err_type = ERR_TYPE_NONE;
     err_type = ERR_TYPE_INT_NOT_GIVEN; \
     push_arg(num);                     \
     push_arg(string_cell(str));        \
-    return;                            \
+    ERROR_RETURN;                      \
   }
 
 #define EXECUTE_INT_COMPARISON(op_name, _op)                     \
@@ -82,12 +126,101 @@ static aq_error_type err_type = ERR_TYPE_NONE;
     pop_arg();                                                   \
     pop_arg();                                                   \
     push_arg(ret);                                               \
-    ++(*pc);                                                     \
+    ++pc;                                                        \
+  }
+
+#define EXECUTE_INT_COMPARISON_JUMP(op_name, _op)                        \
+  {                                                                      \
+    ERR_INT_NOT_GIVEN(STACK_TOP, op_name);                               \
+    ERR_INT_NOT_GIVEN(STACK_TOP_NEXT, op_name);                          \
+    int num2 = INT_VALUE(STACK_TOP);                                     \
+    int num1 = INT_VALUE(STACK_TOP_NEXT);                                \
+    pop_arg();                                                           \
+    pop_arg();                                                           \
+    pc = (num1 _op num2) ? pc + 1 + sizeof(Cell) : get_operand(buf, pc + 1); \
+  }
+
+#define LOCAL_VALUE(operand_pc) (stack[get_function_stack_top() - get_operand(buf, operand_pc) - 4])
+
+#define EXECUTE_LOCAL_COMPARISON_JUMP(op_name, _op, rhs)                                         \
+  {                                                                                              \
+    Cell c1 = LOCAL_VALUE(pc + 1);                                                               \
+    Cell c2 = rhs;                                                                               \
+    ERR_INT_NOT_GIVEN(c2, op_name);                                                              \
+    ERR_INT_NOT_GIVEN(c1, op_name);                                                              \
+    pc = (INT_VALUE(c1) _op INT_VALUE(c2)) ? pc + 1 + sizeof(Cell) * 3 : get_operand(buf, pc + 1 + sizeof(Cell) * 2); \
+  }
+
+// the register or the integer of the operand at operand_pc; imm holds the integer.
+#define REGISTER_REF(operand_pc, imm) (get_register(get_operand(buf, operand_pc), imm))
+#define BOOL_CELL(b) ((b) ? (Cell)AQ_TRUE : (Cell)AQ_FALSE)
+
+#define EXECUTE_REGISTER_OPERATION(op_name, _op, to_cell)                            \
+  {                                                                                 \
+    Cell imm1, imm2;                                                                \
+    Cell c1 = *REGISTER_REF(pc + 1 + sizeof(Cell), &imm1);                          \
+    Cell c2 = *REGISTER_REF(pc + 1 + sizeof(Cell) * 2, &imm2);                      \
+    ERR_INT_NOT_GIVEN(c2, op_name);                                                 \
+    ERR_INT_NOT_GIVEN(c1, op_name);                                                 \
+    set_register(get_operand(buf, pc + 1), to_cell((long)INT_VALUE(c1) _op INT_VALUE(c2))); \
+    pc += 1 + sizeof(Cell) * 3;                                                     \
+  }
+
+#define EXECUTE_REGISTER_COMPARISON_JUMP(op_name, _op)                                       \
+  {                                                                                          \
+    Cell imm1, imm2;                                                                         \
+    int operand1 = get_operand(buf, pc + 1);                                                 \
+    int operand2 = get_operand(buf, pc + 1 + sizeof(Cell));                                  \
+    Cell c1 = *get_register(operand1, &imm1);                                                \
+    Cell c2 = *get_register(operand2, &imm2);                                                \
+    ERR_INT_NOT_GIVEN(c2, op_name);                                                          \
+    ERR_INT_NOT_GIVEN(c1, op_name);                                                          \
+    pop_registers(operand1);                                                                 \
+    pop_registers(operand2);                                                                 \
+    pc = (INT_VALUE(c1) _op INT_VALUE(c2)) ? pc + 1 + sizeof(Cell) * 3 : get_operand(buf, pc + 1 + sizeof(Cell) * 2); \
+  }
+
+#define EXECUTE_REGISTER_ACCESSOR(op_name, accessor)       \
+  {                                                        \
+    Cell imm;                                              \
+    Cell val = *REGISTER_REF(pc + 1 + sizeof(Cell), &imm); \
+    if (!PAIR_P(val))                                      \
+    {                                                      \
+      push_arg(val);                                       \
+      ERR_PAIR_NOT_GIVEN(op_name);                         \
+    }                                                      \
+    set_register(get_operand(buf, pc + 1), accessor(val)); \
+    pc += 1 + sizeof(Cell) * 2;                            \
+  }
+
+#define EXECUTE_LOAD_ACCESSOR(op_name, accessor) \
+  {                                              \
+    Cell val = LOCAL_VALUE(pc + 1);              \
+    if (!PAIR_P(val))                            \
+    {                                            \
+      push_arg(val);                             \
+      ERR_PAIR_NOT_GIVEN(op_name);               \
+    }                                            \
+    push_arg(accessor(val));                     \
+    pc += 1 + sizeof(Cell);                      \
+  }
+
+#define EXECUTE_CDR_ACCESSOR(op_name, accessor)       \
+  {                                                   \
+    ERR_PAIR_NOT_GIVEN("cdr");                        \
+    Cell val = CDR(STACK_TOP);                        \
+    if (!PAIR_P(val))                                 \
+    {                                                 \
+      gc_write_barrier_root(&STACK_TOP, val);         \
+      ERR_PAIR_NOT_GIVEN(op_name);                    \
+    }                                                 \
+    gc_write_barrier_root(&STACK_TOP, accessor(val)); \
+    ++pc;                                             \
   }
 
 #define EXECUTE_PUSH_IMMEDIATE_VALUE(value) \
   push_arg((Cell)value);                    \
-  ++(*pc);
+  ++pc;
 
 #define EXECUTE_MATH_OPERATOR_WITH_CONSTANT(op_name, _op, num) \
   {                                                            \
@@ -95,7 +228,7 @@ static aq_error_type err_type = ERR_TYPE_NONE;
     int ans = num _op INT_VALUE(STACK_TOP);                    \
     pop_arg();                                                 \
     push_arg(make_integer(ans));                               \
-    ++(*pc);                                                   \
+    ++pc;                                                      \
   }
 
 #define SKIP_CLOSE_PARENTHESIS() \
@@ -116,7 +249,7 @@ static aq_error_type err_type = ERR_TYPE_NONE;
       pop_arg();                                      \
     }                                                 \
     push_arg(make_integer(ans));                      \
-    ++(*pc);                                          \
+    ++pc;                                             \
   }
 
 #if defined(_TEST)
@@ -170,9 +303,27 @@ Cell pair_cell(Cell *a, Cell *d)
 
 Cell symbol_cell(char *symbol)
 {
+  // symbols are interned: the same cell is returned for the same name.
+  unsigned int key = (unsigned int)hash(symbol) % SYMBOL_TABLE_SIZE;
+  symbol_entry *entry = symbol_table[key];
+  while (entry && strcmp(symbol, SYMBOL_VALUE(entry->symbol)) != 0)
+  {
+    entry = entry->next;
+  }
+  if (entry)
+  {
+    return entry->symbol;
+  }
+
   int obj_size = sizeof(struct cell) + sizeof(char) * strlen(symbol) - sizeof(cell_union) + 1;
-  Cell c = new_cell(T_SYMBOL, obj_size);
+  Cell c = (Cell)gc_malloc_static(obj_size);
+  c->_type = T_SYMBOL;
   STRCPY(SYMBOL_VALUE(c), symbol);
+
+  entry = (symbol_entry *)malloc(sizeof(symbol_entry));
+  entry->symbol = c;
+  entry->next = symbol_table[key];
+  symbol_table[key] = entry;
   return c;
 }
 
@@ -403,6 +554,10 @@ size_t compile(FILE *fp, char *buf, int offset)
     return 0;
   AQ_UNGETC(c, fp);
 
+#if defined(AQ_JIT)
+  // native code of the bytecode to be overwritten is stale.
+  jit_invalidate(offset);
+#endif
   aq_inst *inst = create_inst(OP_NOP, 1);
   inst_queue queue;
   queue.head = inst;
@@ -414,10 +569,18 @@ size_t compile(FILE *fp, char *buf, int offset)
   {
     return 0;
   }
+  optimize_inst(&queue);
   return write_inst(queue.head, buf);
 }
 
 int compile_list(inst_queue *queue, FILE *fp, Cell symbol_list)
+{
+  return compile_sequence(queue, fp, symbol_list, FALSE);
+}
+
+// compiles the elements up to the close parenthesis. if discard is TRUE,
+// the values of all but the last element are popped.
+int compile_sequence(inst_queue *queue, FILE *fp, Cell symbol_list, aq_bool discard)
 {
   char c;
   int n = 0;
@@ -443,6 +606,10 @@ int compile_list(inst_queue *queue, FILE *fp, Cell symbol_list)
     default:
     {
       AQ_UNGETC(c, fp);
+      if (discard && n > 0)
+      {
+        add_one_byte_inst_tail(queue, OP_POP);
+      }
       compile_elem(queue, fp, symbol_list);
       n++;
     }
@@ -568,6 +735,20 @@ aq_inst *create_inst_num(aq_opcode op, int num)
   return result;
 }
 
+aq_inst *create_inst_global(aq_opcode op, char *name)
+{
+  // operands: the slot, the size of the name and the name itself.
+  aq_inst *result = create_inst_str(op, name);
+  result->size += sizeof(Cell) * 2;
+  if (op == OP_FUNCG)
+  {
+    result->size += sizeof(aq_call_cache);
+  }
+  result->operand2._num = make_integer(get_global_slot(name));
+
+  return result;
+}
+
 aq_inst *create_inst(aq_opcode op, int size)
 {
   aq_inst *result = (aq_inst *)malloc(sizeof(aq_inst));
@@ -576,8 +757,12 @@ aq_inst *create_inst(aq_opcode op, int size)
   result->next = NULL;
   result->operand1._num = (Cell)AQ_NIL;
   result->operand2._num = (Cell)AQ_NIL;
+  result->operand3._num = (Cell)AQ_NIL;
   result->size = size;
   result->offset = 0;
+  result->target = NULL;
+  result->is_target = FALSE;
+  result->depth = -1;
 
   return result;
 }
@@ -645,7 +830,7 @@ void compile_token(inst_queue *queue, char *token, Cell symbol_list)
       symbol_list = CDR(symbol_list);
       index++;
     }
-    aq_inst *inst = create_inst_str(OP_REF, token);
+    aq_inst *inst = create_inst_global(OP_REFG, token);
     add_inst_tail(queue, inst);
   }
 }
@@ -742,7 +927,7 @@ void compile_procedure(char *func, int num, inst_queue *queue)
   else
   {
     add_push_tail(queue, num);
-    add_inst_tail(queue, create_inst_str(OP_FUNC, func));
+    add_inst_tail(queue, create_inst_global(OP_FUNCG, func));
   }
 }
 
@@ -879,7 +1064,7 @@ void compile_lambda(inst_queue *queue, FILE *fp)
     }
   }
 
-  compile_list(queue, fp, symbol_list); // body
+  compile_sequence(queue, fp, symbol_list, TRUE); // body
   while (symbol_list != (Cell)AQ_NIL)
   {
     Cell tmp = symbol_list;
@@ -888,12 +1073,41 @@ void compile_lambda(inst_queue *queue, FILE *fp)
     free(tmp);
   }
   add_one_byte_inst_tail(queue, OP_RET);
+  mark_tail_calls(inst, queue->tail);
 
   int addr = queue->tail->offset + queue->tail->size;
   inst->operand1._num = make_integer(addr);
   inst->operand2._num = make_integer(index);
 }
 
+// turns the calls between from and to whose continuation is OP_RET,
+// directly or through jumps, into tail calls.
+void mark_tail_calls(aq_inst *from, aq_inst *to)
+{
+  for (aq_inst *inst = from->next; inst != to; inst = inst->next)
+  {
+    if (inst->op != OP_FUNCG && inst->op != OP_FUNCS)
+    {
+      continue;
+    }
+
+    aq_inst *next = inst->next;
+    while (next->op == OP_JMP)
+    {
+      int addr = INT_VALUE(next->operand1._num);
+      while (next != to && next->offset != addr)
+      {
+        next = next->next;
+      }
+    }
+
+    if (next->op == OP_RET)
+    {
+      inst->op = (inst->op == OP_FUNCG) ? OP_TFUNCG : OP_TFUNCS;
+    }
+  }
+}
+
 void compile_define(inst_queue *queue, FILE *fp, Cell symbol_list)
 {
   aq_inst *last_inst = queue->tail;
@@ -905,7 +1119,7 @@ void compile_define(inst_queue *queue, FILE *fp, Cell symbol_list)
   AQ_UNGETC(c, fp);
 
   compile_elem(queue, fp, NULL);
-  if (queue->tail->op != OP_REF)
+  if (queue->tail->op != OP_REFG)
   {
     SKIP_CLOSE_PARENTHESIS();
     SET_ERROR_WITH_STR(ERR_TYPE_SYMBOL_NOT_GIVEN, "define");
@@ -927,7 +1141,7 @@ void compile_define(inst_queue *queue, FILE *fp, Cell symbol_list)
     return;
   }
 
-  last_inst->op = OP_SET;
+  last_inst->op = OP_SETG;
   add_inst_tail(queue, last_inst);
 
   char buf[LINESIZE];
@@ -1033,63 +1247,52 @@ int hash(char *key)
   return val;
 }
 
-Cell get_var(char *name)
+int get_global_slot(char *name)
 {
-  int key = 0;
-  Cell chain = get_chain(name, &key);
-  if (UNDEF_P(chain))
+  unsigned int key = (unsigned int)hash(name) % ENVSIZE;
+  global_entry *entry = global_table[key];
+  while (entry && strcmp(name, entry->name) != 0)
   {
-    return (Cell)AQ_UNDEF;
+    entry = entry->next;
   }
-  else
+  if (entry)
+  {
+    return entry->slot;
+  }
+
+  if (global_count >= ENVSIZE)
   {
-    return CDAR(chain);
+    set_error(ERR_TYPE_TOO_MANY_GLOBALS);
+    return 0;
   }
+  entry = (global_entry *)malloc(sizeof(global_entry));
+  entry->name = malloc(strlen(name) + 1);
+  STRCPY(entry->name, name);
+  entry->slot = global_count++;
+  entry->next = global_table[key];
+  global_table[key] = entry;
+  return entry->slot;
 }
 
-void set_var(char *name, Cell c)
+Cell get_var(char *name)
 {
-  int key = 0;
-  push_arg(c);
-  Cell name_cell = string_cell(name);
-  c = pop_arg();
-  Cell chain = get_chain(name, &key);
-  register_var(name_cell, chain, c, &env[key]);
+  int slot = get_global_slot(name);
+  return is_error() ? (Cell)AQ_UNDEF : env[slot];
 }
 
-void register_var(Cell name_cell, Cell chain, Cell c, Cell *env)
+void set_var(char *name, Cell c)
 {
-  if (!UNDEF_P(chain))
-  {
-    gc_write_barrier(chain, &CDAR(chain), c);
-  }
-  else
+  int slot = get_global_slot(name);
+  if (!is_error())
   {
-    push_arg(name_cell);
-    push_arg(c);
-    Cell entry = pair_cell(&STACK_TOP_NEXT, &STACK_TOP);
-    pop_arg();
-    pop_arg();
-
-    push_arg(entry);
-    push_arg(*env);
-    Cell p = pair_cell(&STACK_TOP_NEXT, &STACK_TOP);
-    pop_arg();
-    pop_arg();
-
-    gc_write_barrier_root(env, p);
+    set_global(slot, c);
   }
 }
 
-Cell get_chain(char *name, int *key)
+void set_global(int slot, Cell c)
 {
-  *key = hash(name) % ENVSIZE;
-  Cell chain = env[*key];
-  while (PAIR_P(chain) && strcmp(name, STR_VALUE(CAAR(chain))) != 0)
-  {
-    chain = CDR(chain);
-  }
-  return chain;
+  gc_write_barrier_root(&env[slot], c);
+  global_version[slot]++;
 }
 
 void init()
@@ -1105,7 +1308,25 @@ void init()
 
 void term()
 {
+#if defined(AQ_PROFILE_OPCODES)
+  print_opcode_profile();
+#endif
+#if defined(AQ_JIT)
+  jit_term();
+#endif
   gc_term();
+
+  // the symbols go with the static area.
+  int i;
+  for (i = 0; i < SYMBOL_TABLE_SIZE; i++)
+  {
+    while (symbol_table[i])
+    {
+      symbol_entry *entry = symbol_table[i];
+      symbol_table[i] = entry->next;
+      free(entry);
+    }
+  }
   gc_term_base();
 }
 
@@ -1116,12 +1337,12 @@ void set_gc(char *gc_char)
   gc_init(gc_char, heap_size, &gc_info);
 }
 
-void load_file(char *filename)
+#if !defined(_WIN32) && !defined(_WIN64)
+// compiles the file into buf, or reads its bytecode from the .abc file
+// next to it if that is newer, and returns the size of the bytecode.
+static size_t load_bytecode(char *filename, char *buf)
 {
   FILE *fp = NULL;
-#if defined(_WIN32) || defined(_WIN64)
-  fopen_s(&fp, filename, "r");
-#else
   int len = strlen(filename);
   char *abc_file_name = malloc(sizeof(char *) * (len + 3));
   STRCPY(abc_file_name, filename);
@@ -1130,7 +1351,8 @@ void load_file(char *filename)
   {
     *ext = '\0';
   }
-  strcat(abc_file_name, ".abc");
+  // the register code is cached apart so that the formats can be compared.
+  strcat(abc_file_name, g_register_code ? ".abr" : ".abc");
 
   struct stat abc_info;
   struct stat lsp_info;
@@ -1138,8 +1360,6 @@ void load_file(char *filename)
                       stat(filename, &lsp_info) == 0 &&
                       abc_info.st_ctime > lsp_info.st_ctime);
 
-  char *buf = (char *)malloc(sizeof(char) * 1024 * 1024);
-  int pc = 0;
   size_t file_size = 0;
   if (compiled)
   {
@@ -1178,17 +1398,54 @@ void load_file(char *filename)
       push_arg(string_cell(filename));
     }
   }
+
+  free(abc_file_name);
+  return file_size;
+}
+#endif
+
+void load_file(char *filename)
+{
+#if defined(_WIN32) || defined(_WIN64)
+  FILE *fp = NULL;
+  fopen_s(&fp, filename, "r");
+#else
+  char *buf = (char *)malloc(sizeof(char) * 1024 * 1024);
+  int pc = 0;
+  size_t file_size = load_bytecode(filename, buf);
   if (!is_error())
   {
     execute(buf, &pc, file_size);
-    handle_error();
   }
-  else
+  handle_error();
+
+  free(buf);
+#endif
+}
+
+// writes the program in the file as C code, which runs without the VM
+// when it is linked with the runtime built with AQ_AOT.
+void compile_file_to_c(char *filename, char *output)
+{
+#if !defined(_WIN32) && !defined(_WIN64)
+  char *buf = (char *)malloc(sizeof(char) * 1024 * 1024);
+  size_t file_size = load_bytecode(filename, buf);
+  if (!is_error())
   {
-    handle_error();
+    FILE *fp = fopen(output, "w");
+    if (fp)
+    {
+      aot_write(fp, buf, file_size);
+      fclose(fp);
+    }
+    else
+    {
+      set_error(ERR_FILE_NOT_FOUND);
+      push_arg(string_cell(output));
+    }
   }
+  handle_error();
 
-  free(abc_file_name);
   free(buf);
 #endif
 }
@@ -1235,456 +1492,2131 @@ int do_test(char *input, char *correct_output)
 }
 #endif
 
-size_t write_inst(aq_inst *inst, char *buf)
-{
-  size_t size = 0;
-  while (inst)
-  {
-    aq_opcode op = inst->op;
-    buf[size] = (char)op;
-    switch (op)
-    {
-    case OP_PUSH:
-    case OP_JNEQ:
-    case OP_JMP:
-    case OP_SROT:
-    case OP_LOAD:
-    {
-      long val = INT_VALUE(inst->operand1._num);
-      memcpy(&buf[++size], &val, sizeof(Cell));
-      size += sizeof(Cell);
-      break;
-    }
-    case OP_SET:
-    case OP_REF:
-    case OP_FUNC:
-    case OP_PUSH_STR:
-    case OP_PUSH_SYM:
-    {
-      char *str = inst->operand1._string;
-      STRCPY(&buf[++size], str);
-      size += (strlen(str) + 1);
-      free(inst->operand1._string);
-      break;
-    }
-    case OP_FUND:
-    case OP_FUNDD:
-    {
-      int addr = INT_VALUE(inst->operand1._num);
-      memcpy(&buf[++size], &addr, sizeof(Cell));
-      size += sizeof(Cell);
+// Peephole optimization of the instructions of one top-level expression.
+// Jump operands are resolved to instructions first so that instructions
+// can be removed freely; offsets and jump operands are recomputed at the end.
 
-      int param_num = INT_VALUE(inst->operand2._num);
-      memcpy(&buf[size], &param_num, sizeof(Cell));
-      size += sizeof(Cell);
-      break;
-    }
-    case OP_NOP:
-    case OP_ADD:
-    case OP_ADD1:
-    case OP_ADD2:
-    case OP_SUB:
-    case OP_SUB1:
-    case OP_SUB2:
-    case OP_MUL:
-    case OP_DIV:
-    case OP_PRINT:
-    case OP_POP:
-    case OP_CONS:
-    case OP_CAR:
-    case OP_CDR:
-    case OP_PUSH_NIL:
-    case OP_PUSH_TRUE:
-    case OP_PUSH_FALSE:
-    case OP_GT:
-    case OP_LT:
-    case OP_GTE:
-    case OP_LTE:
-    case OP_HALT:
-    case OP_EQUAL:
-    case OP_EQ:
-    case OP_RET:
-    case OP_FUNCS:
-      buf[size] = (char)inst->op;
-      size += 1;
-      break;
-    }
+#define INT_PUSH_P(inst) ((inst) != NULL && (inst)->op == OP_PUSH && (inst)->size == 1 + sizeof(Cell))
 
-    inst = inst->next;
+static aq_bool jump_inst_p(aq_inst *inst)
+{
+  switch (inst->op)
+  {
+  case OP_JNEQ:
+  case OP_JMP:
+  case OP_JNEQUAL:
+  case OP_JNLT:
+  case OP_JNLTE:
+  case OP_JNGT:
+  case OP_JNGTE:
+  case OP_FUND:
+  case OP_FUNDD:
+  case OP_JNEQUAL_LL:
+  case OP_JNLT_LL:
+  case OP_JNLTE_LL:
+  case OP_JNGT_LL:
+  case OP_JNGTE_LL:
+  case OP_JNEQUAL_LI:
+  case OP_JNLT_LI:
+  case OP_JNLTE_LI:
+  case OP_JNGT_LI:
+  case OP_JNGTE_LI:
+  case OP_JNEQUAL_R:
+  case OP_JNLT_R:
+  case OP_JNLTE_R:
+  case OP_JNGT_R:
+  case OP_JNGTE_R:
+  case OP_JNEQ_R:
+    return TRUE;
+  default:
+    return FALSE;
   }
-
-  return size;
 }
 
-int get_operand(char *buf, int pc)
+static aq_bool push_inst_p(aq_inst *inst)
 {
-  return (int)(*(Cell *)&buf[pc]);
+  switch (inst->op)
+  {
+  case OP_PUSH:
+  case OP_PUSH_NIL:
+  case OP_PUSH_TRUE:
+  case OP_PUSH_FALSE:
+  case OP_PUSH_STR:
+  case OP_PUSH_SYM:
+  case OP_LOAD:
+    return TRUE;
+  default:
+    return FALSE;
+  }
 }
 
-void execute(char *buf, int *pc, int end)
+static aq_bool resolve_jumps(inst_queue *queue)
 {
-  aq_bool exec = TRUE;
-  stack_top = 0;
-  int i = 0;
-  while (exec != FALSE && (*pc) < end && !is_error())
+  int end = queue->tail->offset + queue->tail->size;
+  for (aq_inst *inst = queue->head; inst; inst = inst->next)
   {
-    aq_opcode op = buf[*pc];
-    switch (op)
-    {
-    case OP_PUSH:
+    inst->target = NULL;
+    if (!jump_inst_p(inst))
     {
-      int value = get_operand(buf, ++(*pc));
-      push_arg(make_integer(value));
-      *pc += sizeof(Cell);
-      break;
+      continue;
     }
-    case OP_PUSH_NIL:
-      EXECUTE_PUSH_IMMEDIATE_VALUE(AQ_NIL);
-      break;
-    case OP_PUSH_TRUE:
-      EXECUTE_PUSH_IMMEDIATE_VALUE(AQ_TRUE);
-      break;
-    case OP_PUSH_FALSE:
-      EXECUTE_PUSH_IMMEDIATE_VALUE(AQ_FALSE);
-      break;
-    case OP_ADD1:
-      EXECUTE_MATH_OPERATOR_WITH_CONSTANT("+", +, 1);
-      break;
-    case OP_ADD2:
-      EXECUTE_MATH_OPERATOR_WITH_CONSTANT("+", +, 2);
-      break;
-    case OP_SUB1:
-      EXECUTE_MATH_OPERATOR_WITH_CONSTANT("-", +, -1);
-      break;
-    case OP_SUB2:
-      EXECUTE_MATH_OPERATOR_WITH_CONSTANT("-", +, -2);
-      break;
-    case OP_ADD:
-      EXECUTE_MATH_OPERATION("+", +=, 0);
-      break;
-    case OP_SUB:
+
+    int addr = INT_VALUE(inst->operand1._num);
+    if (addr == end)
     {
-      ERR_INT_NOT_GIVEN(STACK_TOP, "-");
-      int num = INT_VALUE(STACK_TOP);
-      if (num == 0)
-      {
-        pop_arg();
-        EXECUTE_MATH_OPERATOR_WITH_CONSTANT("-", *, -1)
-      }
-      else
-      {
-        EXECUTE_MATH_OPERATION("-", +=, 0);
-        int result = INT_VALUE(pop_arg());
-        push_arg(make_integer(INT_VALUE(pop_arg()) - result));
-      }
-      break;
+      continue;
     }
-    case OP_MUL:
-      EXECUTE_MATH_OPERATION("*", *=, 1);
-      break;
-    case OP_DIV:
+    for (aq_inst *t = queue->head; t; t = t->next)
     {
-      ERR_INT_NOT_GIVEN(STACK_TOP, "/");
-      int num = INT_VALUE(STACK_TOP);
-      if (num == 0)
-      {
-        pop_arg();
-        EXECUTE_MATH_OPERATOR_WITH_CONSTANT("/", /, 1);
-      }
-      else
+      if (t->offset == addr)
       {
-        EXECUTE_MATH_OPERATION("/", *=, 1);
-        int result = INT_VALUE(pop_arg());
-        push_arg(make_integer(INT_VALUE(pop_arg()) / result));
+        inst->target = t;
+        break;
       }
-      break;
     }
-    case OP_RET:
+    if (inst->target == NULL)
     {
-      Cell val = stack[--stack_top];
-      while (!SFRAME_P(pop_arg()))
-      {
-      }
-      int ret_addr = INT_VALUE(pop_arg());
-      int arg_num = INT_VALUE(pop_arg());
-      for (i = 0; i < arg_num; ++i)
-      {
-        pop_arg();
-      }
-      pop_function_stack();
-      stack[stack_top++] = val;
-      *pc = ret_addr;
-      break;
+      // not an instruction boundary; leave the code as it is.
+      return FALSE;
     }
-    case OP_CONS:
-    {
-      Cell ret = pair_cell(&STACK_TOP_NEXT, &STACK_TOP);
-      pop_arg();
-      pop_arg();
+  }
+  return TRUE;
+}
 
-      push_arg(ret);
-      ++(*pc);
-      break;
+static void mark_jump_targets(inst_queue *queue)
+{
+  for (aq_inst *inst = queue->head; inst; inst = inst->next)
+  {
+    inst->is_target = FALSE;
+  }
+  for (aq_inst *inst = queue->head; inst; inst = inst->next)
+  {
+    if (!jump_inst_p(inst))
+    {
+      continue;
     }
-    case OP_CAR:
+    if (inst->target)
     {
-      ERR_PAIR_NOT_GIVEN("car");
-      gc_write_barrier_root(&STACK_TOP, CAR(STACK_TOP));
-      ++(*pc);
-      break;
+      inst->target->is_target = TRUE;
     }
-    case OP_CDR:
+    if ((inst->op == OP_FUND || inst->op == OP_FUNDD) && inst->next)
     {
-      ERR_PAIR_NOT_GIVEN("cdr");
-      gc_write_barrier_root(&STACK_TOP, CDR(STACK_TOP));
-      ++(*pc);
-      break;
+      // the entry of the lambda body.
+      inst->next->is_target = TRUE;
     }
-    case OP_EQUAL:
-      EXECUTE_INT_COMPARISON("=", ==);
+  }
+}
+
+// unlinks and frees inst, moving the jumps to it onto the next instruction.
+static aq_inst *remove_inst(inst_queue *queue, aq_inst *inst)
+{
+  aq_inst *next = inst->next;
+  if (inst->is_target)
+  {
+    for (aq_inst *i = queue->head; i; i = i->next)
+    {
+      if (jump_inst_p(i) && i->target == inst)
+      {
+        i->target = next;
+      }
+    }
+    if (next)
+    {
+      next->is_target = TRUE;
+    }
+  }
+
+  if (inst->prev)
+  {
+    inst->prev->next = next;
+  }
+  else
+  {
+    queue->head = next;
+  }
+  if (next)
+  {
+    next->prev = inst->prev;
+  }
+  else
+  {
+    queue->tail = inst->prev;
+  }
+
+  switch (inst->op)
+  {
+  case OP_SET:
+  case OP_REF:
+  case OP_FUNC:
+  case OP_PUSH_STR:
+  case OP_PUSH_SYM:
+  case OP_SETG:
+  case OP_REFG:
+  case OP_FUNCG:
+  case OP_TFUNCG:
+    free(inst->operand1._string);
+    break;
+  default:
+    break;
+  }
+  free(inst);
+  return next;
+}
+
+static void set_push_inst(aq_inst *inst, int num)
+{
+  inst->op = OP_PUSH;
+  inst->size = 1 + sizeof(Cell);
+  inst->operand1._num = make_integer(num);
+}
+
+static void set_bool_inst(aq_inst *inst, aq_bool b)
+{
+  inst->op = b ? OP_PUSH_TRUE : OP_PUSH_FALSE;
+  inst->size = 1;
+}
+
+// folds an arithmetic operation whose operands and their number are all
+// literal integers, computing the value the same way execute() does.
+static aq_bool fold_arithmetic(inst_queue *queue, aq_inst *inst)
+{
+  aq_inst *count = inst->prev;
+  if (!INT_PUSH_P(count) || count->is_target || inst->is_target)
+  {
+    return FALSE;
+  }
+  int num = INT_VALUE(count->operand1._num);
+  int operand_num = (inst->op == OP_SUB || inst->op == OP_DIV) ? num + 1 : num;
+  if (operand_num <= 0)
+  {
+    return FALSE;
+  }
+
+  aq_inst *first = count;
+  for (int i = 0; i < operand_num; i++)
+  {
+    if (first != count && first->is_target)
+    {
+      return FALSE;
+    }
+    first = first->prev;
+    if (!INT_PUSH_P(first))
+    {
+      return FALSE;
+    }
+  }
+
+  long ans = (inst->op == OP_MUL || inst->op == OP_DIV) ? 1 : 0;
+  aq_inst *operand = (operand_num > num) ? first->next : first;
+  for (; operand != count; operand = operand->next)
+  {
+    if (inst->op == OP_ADD || inst->op == OP_SUB)
+    {
+      ans += INT_VALUE(operand->operand1._num);
+    }
+    else
+    {
+      ans *= INT_VALUE(operand->operand1._num);
+    }
+  }
+
+  int value = INT_VALUE(first->operand1._num);
+  int result = INT_VALUE(make_integer(ans));
+  switch (inst->op)
+  {
+  case OP_SUB:
+    result = (num == 0) ? -1 * value : value - result;
+    break;
+  case OP_DIV:
+    if ((num == 0 && value == 0) || (num > 0 && result == 0))
+    {
+      return FALSE;
+    }
+    result = (num == 0) ? 1 / value : value / result;
+    break;
+  default:
+    break;
+  }
+
+  set_push_inst(first, result);
+  while (first->next != inst)
+  {
+    remove_inst(queue, first->next);
+  }
+  remove_inst(queue, inst);
+  return TRUE;
+}
+
+static aq_bool fold_constant_operator(inst_queue *queue, aq_inst *inst)
+{
+  aq_inst *prev = inst->prev;
+  if (!INT_PUSH_P(prev) || inst->is_target)
+  {
+    return FALSE;
+  }
+  int value = INT_VALUE(prev->operand1._num);
+  switch (inst->op)
+  {
+  case OP_ADD1:
+    value += 1;
+    break;
+  case OP_ADD2:
+    value += 2;
+    break;
+  case OP_SUB1:
+    value -= 1;
+    break;
+  default:
+    value -= 2;
+    break;
+  }
+  set_push_inst(prev, value);
+  remove_inst(queue, inst);
+  return TRUE;
+}
+
+static aq_bool fold_comparison(inst_queue *queue, aq_inst *inst)
+{
+  aq_inst *rhs = inst->prev;
+  if (!INT_PUSH_P(rhs) || rhs->is_target || inst->is_target || !INT_PUSH_P(rhs->prev))
+  {
+    return FALSE;
+  }
+  int num1 = INT_VALUE(rhs->prev->operand1._num);
+  int num2 = INT_VALUE(rhs->operand1._num);
+  aq_bool b = FALSE;
+  switch (inst->op)
+  {
+  case OP_EQUAL:
+  case OP_EQ:
+    b = (num1 == num2);
+    break;
+  case OP_LT:
+    b = (num1 < num2);
+    break;
+  case OP_LTE:
+    b = (num1 <= num2);
+    break;
+  case OP_GT:
+    b = (num1 > num2);
+    break;
+  default:
+    b = (num1 >= num2);
+    break;
+  }
+  set_bool_inst(rhs->prev, b);
+  remove_inst(queue, rhs);
+  remove_inst(queue, inst);
+  return TRUE;
+}
+
+// a branch on a literal is either taken always or never.
+static aq_bool fold_branch(inst_queue *queue, aq_inst *inst)
+{
+  aq_inst *prev = inst->prev;
+  if (prev == NULL || inst->is_target)
+  {
+    return FALSE;
+  }
+  switch (prev->op)
+  {
+  case OP_PUSH_TRUE:
+    remove_inst(queue, prev);
+    remove_inst(queue, inst);
+    return TRUE;
+  case OP_PUSH:
+  case OP_PUSH_NIL:
+  case OP_PUSH_FALSE:
+    remove_inst(queue, prev);
+    inst->op = OP_JMP;
+    return TRUE;
+  default:
+    return FALSE;
+  }
+}
+
+static aq_bool simplify_jump(inst_queue *queue, aq_inst *inst)
+{
+  aq_bool changed = FALSE;
+  aq_inst *target = inst->target;
+  while (target && target->op == OP_JMP && target != inst && target->target != target)
+  {
+    target = target->target;
+    inst->target = target;
+    changed = TRUE;
+  }
+
+  if (inst->op == OP_JMP && inst->target && inst->target->op == OP_RET)
+  {
+    inst->op = OP_RET;
+    inst->size = 1;
+    inst->target = NULL;
+    return TRUE;
+  }
+  if (inst->target == inst->next)
+  {
+    if (inst->op == OP_JMP)
+    {
+      remove_inst(queue, inst);
+      return TRUE;
+    }
+    if (inst->op == OP_JNEQ)
+    {
+      inst->op = OP_POP;
+      inst->size = 1;
+      inst->target = NULL;
+      return TRUE;
+    }
+  }
+  return changed;
+}
+
+static aq_bool remove_dead_code(inst_queue *queue, aq_inst *inst)
+{
+  aq_bool changed = FALSE;
+  while (inst->next && !inst->next->is_target)
+  {
+    remove_inst(queue, inst->next);
+    changed = TRUE;
+  }
+  return changed;
+}
+
+static aq_bool optimize_pass(inst_queue *queue)
+{
+  aq_bool changed = FALSE;
+  mark_jump_targets(queue);
+  for (aq_inst *inst = queue->head; inst;)
+  {
+    aq_inst *next = inst->next;
+    aq_bool done = FALSE;
+    switch (inst->op)
+    {
+    case OP_NOP:
+      if (inst->next)
+      {
+        remove_inst(queue, inst);
+        done = TRUE;
+      }
       break;
-    case OP_GT:
-      EXECUTE_INT_COMPARISON(">", >);
+    case OP_ADD:
+    case OP_SUB:
+    case OP_MUL:
+    case OP_DIV:
+      done = fold_arithmetic(queue, inst);
+      break;
+    case OP_ADD1:
+    case OP_ADD2:
+    case OP_SUB1:
+    case OP_SUB2:
+      done = fold_constant_operator(queue, inst);
       break;
+    case OP_EQUAL:
+    case OP_LT:
+    case OP_LTE:
+    case OP_GT:
     case OP_GTE:
-      EXECUTE_INT_COMPARISON(">=", >=);
+    case OP_EQ:
+      done = fold_comparison(queue, inst);
+      break;
+    case OP_POP:
+      if (inst->prev && push_inst_p(inst->prev) && !inst->is_target)
+      {
+        remove_inst(queue, inst->prev);
+        remove_inst(queue, inst);
+        done = TRUE;
+      }
+      break;
+    case OP_JNEQ:
+      done = fold_branch(queue, inst) || simplify_jump(queue, inst);
+      break;
+    case OP_JMP:
+      done = simplify_jump(queue, inst) || remove_dead_code(queue, inst);
+      break;
+    case OP_RET:
+      done = remove_dead_code(queue, inst);
+      break;
+    case OP_FUND:
+    case OP_FUNDD:
+      done = simplify_jump(queue, inst);
+      break;
+    default:
+      break;
+    }
+
+    if (done)
+    {
+      // rescan from the start, the instructions around inst may have gone.
+      changed = TRUE;
+      break;
+    }
+    inst = next;
+  }
+  return changed;
+}
+
+// fuses a comparison and the branch on its result into one instruction.
+static void fuse_compare_jumps(inst_queue *queue)
+{
+  mark_jump_targets(queue);
+  for (aq_inst *inst = queue->head; inst; inst = inst->next)
+  {
+    aq_inst *next = inst->next;
+    if (next == NULL || next->op != OP_JNEQ || next->is_target)
+    {
+      continue;
+    }
+
+    aq_opcode op;
+    switch (inst->op)
+    {
+    case OP_EQUAL:
+      op = OP_JNEQUAL;
       break;
     case OP_LT:
-      EXECUTE_INT_COMPARISON("<", <);
+      op = OP_JNLT;
       break;
     case OP_LTE:
-      EXECUTE_INT_COMPARISON("<=", <=);
+      op = OP_JNLTE;
       break;
-    case OP_EQ:
+    case OP_GT:
+      op = OP_JNGT;
+      break;
+    case OP_GTE:
+      op = OP_JNGTE;
+      break;
+    default:
+      continue;
+    }
+    inst->op = op;
+    inst->size = 1 + sizeof(Cell);
+    inst->target = next->target;
+    remove_inst(queue, next);
+  }
+}
+
+// replaces frequent sequences with superinstructions. the sequences
+// were picked with the opcode pair counts of AQ_PROFILE_OPCODES.
+static void combine_superinstructions(inst_queue *queue)
+{
+  mark_jump_targets(queue);
+  for (aq_inst *inst = queue->head; inst; inst = inst->next)
+  {
+    aq_inst *next = inst->next;
+    if (next == NULL)
+    {
+      break;
+    }
+
+    switch (inst->op)
+    {
+    case OP_LOAD:
+      if (next->is_target)
+      {
+        break;
+      }
+      if (next->op == OP_CAR || next->op == OP_CDR)
+      {
+        inst->op = (next->op == OP_CAR) ? OP_LOAD_CAR : OP_LOAD_CDR;
+        remove_inst(queue, next);
+      }
+      else if ((next->op == OP_LOAD || INT_PUSH_P(next)) && next->next && !next->next->is_target &&
+               next->next->op >= OP_JNEQUAL && next->next->op <= OP_JNGTE)
+      {
+        // (< x y) and (< x 1) in a branch.
+        aq_inst *jump = next->next;
+        aq_opcode base = (next->op == OP_LOAD) ? OP_JNEQUAL_LL : OP_JNEQUAL_LI;
+        inst->op = base + (jump->op - OP_JNEQUAL);
+        inst->size = 1 + sizeof(Cell) * 3;
+        inst->operand2._num = next->operand1._num;
+        inst->target = jump->target;
+        remove_inst(queue, next);
+        remove_inst(queue, jump);
+      }
+      break;
+    case OP_CDR:
+      if (!next->is_target && (next->op == OP_CAR || next->op == OP_CDR))
+      {
+        inst->op = (next->op == OP_CAR) ? OP_CADR : OP_CDDR;
+        remove_inst(queue, next);
+      }
+      break;
+    case OP_PUSH:
+      // the call stays in place; OP_ARGC only saves its dispatch.
+      if (INT_PUSH_P(inst) && (next->op == OP_FUNCG || next->op == OP_TFUNCG))
+      {
+        inst->op = OP_ARGC;
+      }
+      break;
+    default:
+      break;
+    }
+  }
+}
+
+// Register code: the values a lambda body keeps on the stack are given
+// registers by their depth, so the operands of an operation can be read
+// where they are instead of being pushed on the stack first. The
+// parameters and small integers pushed for an operation are kept aside
+// while walking the body, and an operation that can take them as
+// operands is replaced with its register form; anything else gets them
+// pushed as they were. The stack code stays where the depth is not known.
+
+#define REGISTER_STACK_SIZE (256)
+#define IMMEDIATE_P(num) ((num) >= -(1 << 28) && (num) < (1 << 28))
+
+struct _register_entry
+{
+  aq_bool on_stack;
+  aq_inst *push;  // the OP_LOAD or OP_PUSH kept aside, if any.
+  aq_bool is_int; // the value is the integer num.
+  int num;
+};
+typedef struct _register_entry register_entry;
+
+static void set_register_entry(register_entry *e, aq_bool on_stack, aq_inst *push, aq_bool is_int, int num)
+{
+  e->on_stack = on_stack;
+  e->push = push;
+  e->is_int = is_int;
+  e->num = num;
+}
+
+static int register_entry_operand(register_entry *entries, int index)
+{
+  register_entry *e = &entries[index];
+  if (e->on_stack)
+  {
+    return REGISTER_OPERAND(index);
+  }
+  else if (e->push && e->push->op == OP_LOAD)
+  {
+    return REGISTER_OPERAND(PARAMETER_REGISTER(INT_VALUE(e->push->operand1._num)));
+  }
+  return IMMEDIATE_OPERAND(e->num);
+}
+
+// pushes the entries kept aside, where their instructions are.
+static void flush_registers(register_entry *entries, int n)
+{
+  for (int i = 0; i < n; i++)
+  {
+    entries[i].on_stack = TRUE;
+  }
+}
+
+// turns inst into op on the top num entries, whose result (if any) goes
+// to the register of the lowest one; returns the new depth.
+static int set_register_inst(inst_queue *queue, aq_inst *inst, aq_opcode op, register_entry *entries, int n, int num, aq_bool has_result)
+{
+  int base = n - num;
+  flush_registers(entries, base);
+  aq_operand operands[3];
+  int i = 0;
+  if (has_result)
+  {
+    operands[i++]._num = make_integer(base);
+  }
+  for (int j = base; j < n; j++)
+  {
+    operands[i++]._num = make_integer(register_entry_operand(entries, j));
+    if (!entries[j].on_stack && entries[j].push)
+    {
+      remove_inst(queue, entries[j].push);
+    }
+  }
+
+  inst->op = op;
+  inst->size = 1 + sizeof(Cell) * (jump_inst_p(inst) ? i + 1 : i);
+  inst->operand1 = operands[0];
+  inst->operand2 = (i > 1) ? operands[1] : inst->operand2;
+  inst->operand3 = (i > 2) ? operands[2] : inst->operand3;
+  if (!has_result)
+  {
+    return base;
+  }
+  set_register_entry(&entries[base], TRUE, NULL, FALSE, 0);
+  return base + 1;
+}
+
+static aq_bool any_deferred_p(register_entry *entries, int n, int num)
+{
+  for (int i = n - num; i < n; i++)
+  {
+    if (!entries[i].on_stack)
+    {
+      return TRUE;
+    }
+  }
+  return FALSE;
+}
+
+static aq_bool record_depth(aq_inst *target, int n)
+{
+  if (target == NULL)
+  {
+    return TRUE;
+  }
+  if (target->depth >= 0 && target->depth != n)
+  {
+    return FALSE;
+  }
+  target->depth = n;
+  return TRUE;
+}
+
+// the stack effect of an instruction left as it is, or -1 if it is not known.
+static int stack_effect(aq_inst *inst, register_entry *entries, int n, int *pops)
+{
+  int count = (n > 0 && entries[n - 1].is_int) ? entries[n - 1].num : -1;
+  switch (inst->op)
+  {
+  case OP_NOP:
+  case OP_SET:
+  case OP_SETG:
+  case OP_ADD1:
+  case OP_ADD2:
+  case OP_SUB1:
+  case OP_SUB2:
+  case OP_CAR:
+  case OP_CDR:
+  case OP_JMP:
+    *pops = 0;
+    return 0;
+  case OP_PUSH:
+  case OP_PUSH_NIL:
+  case OP_PUSH_TRUE:
+  case OP_PUSH_FALSE:
+  case OP_PUSH_STR:
+  case OP_PUSH_SYM:
+  case OP_REF:
+  case OP_REFG:
+  case OP_LOAD:
+  case OP_FUND:
+  case OP_FUNDD:
+    *pops = 0;
+    return 1;
+  case OP_POP:
+  case OP_JNEQ:
+    *pops = 1;
+    return 0;
+  case OP_EQUAL:
+  case OP_LT:
+  case OP_LTE:
+  case OP_GT:
+  case OP_GTE:
+  case OP_EQ:
+  case OP_CONS:
+    *pops = 2;
+    return 1;
+  case OP_JNEQUAL:
+  case OP_JNLT:
+  case OP_JNLTE:
+  case OP_JNGT:
+  case OP_JNGTE:
+    *pops = 2;
+    return 0;
+  case OP_ADD:
+  case OP_MUL:
+  case OP_PRINT:
+  case OP_FUNC:
+  case OP_FUNCG:
+    // the count, then the arguments.
+    *pops = count + 1;
+    return (count < 0) ? -1 : 1;
+  case OP_SUB:
+  case OP_DIV:
+    *pops = count + 2;
+    return (count < 0) ? -1 : 1;
+  default:
+    return -1;
+  }
+}
+
+static void allocate_body_registers(inst_queue *queue, aq_inst *from, aq_inst *to)
+{
+  register_entry entries[REGISTER_STACK_SIZE];
+  int n = 0;
+  aq_bool reachable = TRUE;
+  aq_inst *next;
+  for (aq_inst *inst = from; inst != to; inst = next)
+  {
+    next = inst->next;
+    if (inst->is_target)
+    {
+      flush_registers(entries, n);
+      if (!reachable)
+      {
+        n = inst->depth;
+      }
+      if (n < 0 || !record_depth(inst, n))
+      {
+        return;
+      }
+      for (int i = 0; i < n; i++)
+      {
+        entries[i].is_int = FALSE;
+      }
+      reachable = TRUE;
+    }
+    if (!reachable)
+    {
+      continue;
+    }
+    if (n + 1 >= REGISTER_STACK_SIZE)
+    {
+      flush_registers(entries, n);
+      return;
+    }
+
+    aq_opcode op = inst->op;
+    int count = (n > 0 && entries[n - 1].is_int) ? entries[n - 1].num : -1;
+    switch (op)
+    {
+    case OP_LOAD:
+      set_register_entry(&entries[n++], FALSE, inst, FALSE, 0);
+      continue;
+    case OP_PUSH:
+      if (INT_PUSH_P(inst) && IMMEDIATE_P(INT_VALUE(inst->operand1._num)))
+      {
+        set_register_entry(&entries[n++], FALSE, inst, TRUE, INT_VALUE(inst->operand1._num));
+        continue;
+      }
+      break;
+    case OP_ADD:
+    case OP_MUL:
+    case OP_SUB:
+      if (count == ((op == OP_SUB) ? 1 : 2) && n >= 3)
+      {
+        // the count is only read by the stack code.
+        if (!entries[n - 1].on_stack)
+        {
+          remove_inst(queue, entries[n - 1].push);
+        }
+        n--;
+        aq_opcode rop = (op == OP_ADD) ? OP_ADD_R : (op == OP_SUB) ? OP_SUB_R : OP_MUL_R;
+        n = set_register_inst(queue, inst, rop, entries, n, 2, TRUE);
+        continue;
+      }
+      break;
+    case OP_ADD1:
+    case OP_ADD2:
+    case OP_SUB1:
+    case OP_SUB2:
+      if (n >= 1 && !entries[n - 1].on_stack)
+      {
+        // x - 1 and x + 1 on an immediate which is not in the code.
+        set_register_entry(&entries[n++], FALSE, NULL, TRUE, (op == OP_ADD1 || op == OP_SUB1) ? 1 : 2);
+        n = set_register_inst(queue, inst, (op == OP_ADD1 || op == OP_ADD2) ? OP_ADD_R : OP_SUB_R, entries, n, 2, TRUE);
+        continue;
+      }
+      break;
+    case OP_EQUAL:
+    case OP_LT:
+    case OP_LTE:
+    case OP_GT:
+    case OP_GTE:
+      if (n >= 2 && any_deferred_p(entries, n, 2))
+      {
+        if (next && next->op == OP_JNEQ && !next->is_target)
+        {
+          n = set_register_inst(queue, inst, OP_JNEQUAL_R + (op - OP_EQUAL), entries, n, 2, FALSE);
+          inst->target = next->target;
+          next = remove_inst(queue, next);
+          flush_registers(entries, n);
+          if (!record_depth(inst->target, n))
+          {
+            return;
+          }
+        }
+        else
+        {
+          n = set_register_inst(queue, inst, OP_EQUAL_R + (op - OP_EQUAL), entries, n, 2, TRUE);
+        }
+        continue;
+      }
+      break;
+    case OP_EQ:
+    case OP_CONS:
+      if (n >= 2 && any_deferred_p(entries, n, 2))
+      {
+        n = set_register_inst(queue, inst, (op == OP_EQ) ? OP_EQ_R : OP_CONS_R, entries, n, 2, TRUE);
+        continue;
+      }
+      break;
+    case OP_CAR:
+    case OP_CDR:
+      if (n >= 1 && !entries[n - 1].on_stack)
+      {
+        n = set_register_inst(queue, inst, (op == OP_CAR) ? OP_CAR_R : OP_CDR_R, entries, n, 1, TRUE);
+        continue;
+      }
+      break;
+    case OP_JNEQ:
+      if (n >= 1 && !entries[n - 1].on_stack && entries[n - 1].push->op == OP_LOAD)
+      {
+        n = set_register_inst(queue, inst, OP_JNEQ_R, entries, n, 1, FALSE);
+        flush_registers(entries, n);
+        if (!record_depth(inst->target, n))
+        {
+          return;
+        }
+        continue;
+      }
+      break;
+    case OP_RET:
+    case OP_TFUNCG:
+    case OP_TFUNCS:
+    case OP_HALT:
+      flush_registers(entries, n);
+      reachable = FALSE;
+      continue;
+    default:
+      break;
+    }
+
+    // the stack code: its operands have to be on the stack.
+    flush_registers(entries, n);
+    int pops = 0;
+    int pushes = stack_effect(inst, entries, n, &pops);
+    if (pushes < 0 || pops > n)
+    {
+      return;
+    }
+    n -= pops;
+    for (int i = 0; i < pushes; i++)
+    {
+      set_register_entry(&entries[n++], TRUE, NULL, FALSE, 0);
+    }
+    if (op == OP_PUSH && INT_PUSH_P(inst))
+    {
+      set_register_entry(&entries[n - 1], TRUE, NULL, TRUE, INT_VALUE(inst->operand1._num));
+    }
+    if (jump_inst_p(inst) && op != OP_FUND && op != OP_FUNDD && !record_depth(inst->target, n))
+    {
+      return;
+    }
+    if (op == OP_JMP)
+    {
+      reachable = FALSE;
+    }
+    else if (op == OP_FUND || op == OP_FUNDD)
+    {
+      // the body of an inner lambda is a function of its own.
+      next = inst->target;
+    }
+  }
+  flush_registers(entries, n);
+}
+
+static void allocate_registers(inst_queue *queue)
+{
+  mark_jump_targets(queue);
+  for (aq_inst *inst = queue->head; inst; inst = inst->next)
+  {
+    if (inst->op == OP_FUND || inst->op == OP_FUNDD)
+    {
+      allocate_body_registers(queue, inst->next, inst->target);
+    }
+  }
+}
+
+void optimize_inst(inst_queue *queue)
+{
+  int offset = queue->head->offset;
+  if (!resolve_jumps(queue))
+  {
+    return;
+  }
+
+  while (optimize_pass(queue))
+  {
+  }
+  if (g_register_code)
+  {
+    allocate_registers(queue);
+  }
+  fuse_compare_jumps(queue);
+  combine_superinstructions(queue);
+
+  // relocate
+  for (aq_inst *inst = queue->head; inst; inst = inst->next)
+  {
+    inst->offset = offset;
+    offset += inst->size;
+  }
+  for (aq_inst *inst = queue->head; inst; inst = inst->next)
+  {
+    if ((inst->op >= OP_JNEQUAL_LL && inst->op <= OP_JNGTE_LI) ||
+        (inst->op >= OP_JNEQUAL_R && inst->op <= OP_JNGTE_R))
+    {
+      inst->operand3._num = make_integer(inst->target ? inst->target->offset : offset);
+    }
+    else if (inst->op == OP_JNEQ_R)
+    {
+      inst->operand2._num = make_integer(inst->target ? inst->target->offset : offset);
+    }
+    else if (jump_inst_p(inst))
+    {
+      inst->operand1._num = make_integer(inst->target ? inst->target->offset : offset);
+    }
+  }
+}
+
+size_t write_inst(aq_inst *inst, char *buf)
+{
+  size_t size = 0;
+  while (inst)
+  {
+    aq_opcode op = inst->op;
+    buf[size] = (char)op;
+    switch (op)
+    {
+    case OP_PUSH:
+    case OP_JNEQ:
+    case OP_JMP:
+    case OP_JNEQUAL:
+    case OP_JNLT:
+    case OP_JNLTE:
+    case OP_JNGT:
+    case OP_JNGTE:
+    case OP_SROT:
+    case OP_LOAD:
+    case OP_LOAD_CAR:
+    case OP_LOAD_CDR:
+    case OP_ARGC:
+    {
+      long val = INT_VALUE(inst->operand1._num);
+      memcpy(&buf[++size], &val, sizeof(Cell));
+      size += sizeof(Cell);
+      break;
+    }
+    case OP_SET:
+    case OP_REF:
+    case OP_FUNC:
+    case OP_PUSH_STR:
+    case OP_PUSH_SYM:
+    {
+      char *str = inst->operand1._string;
+      STRCPY(&buf[++size], str);
+      size += (strlen(str) + 1);
+      free(inst->operand1._string);
+      break;
+    }
+    case OP_SETG:
+    case OP_REFG:
+    case OP_FUNCG:
+    case OP_TFUNCG:
+    {
+      long slot = INT_VALUE(inst->operand2._num);
+      memcpy(&buf[++size], &slot, sizeof(Cell));
+      size += sizeof(Cell);
+
+      char *str = inst->operand1._string;
+      long len = strlen(str) + 1;
+      memcpy(&buf[size], &len, sizeof(Cell));
+      size += sizeof(Cell);
+
+      if (op == OP_FUNCG || op == OP_TFUNCG)
+      {
+        aq_call_cache cache = {-1, 0, 0, FALSE};
+        memcpy(&buf[size], &cache, sizeof(aq_call_cache));
+        size += sizeof(aq_call_cache);
+      }
+
+      STRCPY(&buf[size], str);
+      size += len;
+      free(inst->operand1._string);
+      break;
+    }
+    case OP_JNEQUAL_LL:
+    case OP_JNLT_LL:
+    case OP_JNLTE_LL:
+    case OP_JNGT_LL:
+    case OP_JNGTE_LL:
+    case OP_JNEQUAL_LI:
+    case OP_JNLT_LI:
+    case OP_JNLTE_LI:
+    case OP_JNGT_LI:
+    case OP_JNGTE_LI:
+    case OP_ADD_R:
+    case OP_SUB_R:
+    case OP_MUL_R:
+    case OP_EQUAL_R:
+    case OP_LT_R:
+    case OP_LTE_R:
+    case OP_GT_R:
+    case OP_GTE_R:
+    case OP_JNEQUAL_R:
+    case OP_JNLT_R:
+    case OP_JNLTE_R:
+    case OP_JNGT_R:
+    case OP_JNGTE_R:
+    case OP_CONS_R:
+    case OP_EQ_R:
+    {
+      long val[3] = {INT_VALUE(inst->operand1._num), INT_VALUE(inst->operand2._num), INT_VALUE(inst->operand3._num)};
+      memcpy(&buf[++size], val, sizeof(Cell) * 3);
+      size += sizeof(Cell) * 3;
+      break;
+    }
+    case OP_CAR_R:
+    case OP_CDR_R:
+    case OP_JNEQ_R:
+    {
+      long val[2] = {INT_VALUE(inst->operand1._num), INT_VALUE(inst->operand2._num)};
+      memcpy(&buf[++size], val, sizeof(Cell) * 2);
+      size += sizeof(Cell) * 2;
+      break;
+    }
+    case OP_FUND:
+    case OP_FUNDD:
+    {
+      int addr = INT_VALUE(inst->operand1._num);
+      memcpy(&buf[++size], &addr, sizeof(Cell));
+      size += sizeof(Cell);
+
+      int param_num = INT_VALUE(inst->operand2._num);
+      memcpy(&buf[size], &param_num, sizeof(Cell));
+      size += sizeof(Cell);
+      break;
+    }
+    case OP_NOP:
+    case OP_ADD:
+    case OP_ADD1:
+    case OP_ADD2:
+    case OP_SUB:
+    case OP_SUB1:
+    case OP_SUB2:
+    case OP_MUL:
+    case OP_DIV:
+    case OP_PRINT:
+    case OP_POP:
+    case OP_CONS:
+    case OP_CAR:
+    case OP_CDR:
+    case OP_CADR:
+    case OP_CDDR:
+    case OP_PUSH_NIL:
+    case OP_PUSH_TRUE:
+    case OP_PUSH_FALSE:
+    case OP_GT:
+    case OP_LT:
+    case OP_GTE:
+    case OP_LTE:
+    case OP_HALT:
+    case OP_EQUAL:
+    case OP_EQ:
+    case OP_RET:
+    case OP_FUNCS:
+    case OP_TFUNCS:
+      buf[size] = (char)inst->op;
+      size += 1;
+      break;
+    }
+
+    inst = inst->next;
+  }
+
+  return size;
+}
+
+int get_operand(char *buf, int pc)
+{
+  return (int)(*(Cell *)&buf[pc]);
+}
+
+// the size of the instruction at pc, as execute() steps over it.
+int get_inst_size(char *buf, int pc)
+{
+  switch ((unsigned char)buf[pc])
+  {
+  case OP_PUSH:
+  case OP_JNEQ:
+  case OP_JMP:
+  case OP_JNEQUAL:
+  case OP_JNLT:
+  case OP_JNLTE:
+  case OP_JNGT:
+  case OP_JNGTE:
+  case OP_SROT:
+  case OP_LOAD:
+  case OP_LOAD_CAR:
+  case OP_LOAD_CDR:
+  case OP_ARGC:
+    return 1 + sizeof(Cell);
+  case OP_JNEQUAL_LL:
+  case OP_JNLT_LL:
+  case OP_JNLTE_LL:
+  case OP_JNGT_LL:
+  case OP_JNGTE_LL:
+  case OP_JNEQUAL_LI:
+  case OP_JNLT_LI:
+  case OP_JNLTE_LI:
+  case OP_JNGT_LI:
+  case OP_JNGTE_LI:
+  case OP_ADD_R:
+  case OP_SUB_R:
+  case OP_MUL_R:
+  case OP_EQUAL_R:
+  case OP_LT_R:
+  case OP_LTE_R:
+  case OP_GT_R:
+  case OP_GTE_R:
+  case OP_JNEQUAL_R:
+  case OP_JNLT_R:
+  case OP_JNLTE_R:
+  case OP_JNGT_R:
+  case OP_JNGTE_R:
+  case OP_CONS_R:
+  case OP_EQ_R:
+    return 1 + sizeof(Cell) * 3;
+  case OP_CAR_R:
+  case OP_CDR_R:
+  case OP_JNEQ_R:
+    return 1 + sizeof(Cell) * 2;
+  case OP_SET:
+  case OP_REF:
+  case OP_FUNC:
+  case OP_PUSH_STR:
+  case OP_PUSH_SYM:
+    return 1 + strlen(&buf[pc + 1]) + 1;
+  case OP_SETG:
+  case OP_REFG:
+    return 1 + sizeof(Cell) * 2 + get_operand(buf, pc + 1 + sizeof(Cell));
+  case OP_FUNCG:
+  case OP_TFUNCG:
+    return 1 + sizeof(Cell) * 2 + sizeof(aq_call_cache) + get_operand(buf, pc + 1 + sizeof(Cell));
+  case OP_FUND:
+  case OP_FUNDD:
+    return 1 + sizeof(Cell) * 2;
+  default:
+    return 1;
+  }
+}
+
+// checks the number of the arguments on the stack, and packs the rest
+// parameters of a dot list into a list.
+static void bind_args(int param_num, aq_bool is_param_dlist, char *name)
+{
+  int arg_num = INT_VALUE(STACK_TOP);
+  if (is_param_dlist)
+  {
+    ERR_WRONG_NUMBER_ARGS_DLIST(param_num, arg_num, name);
+    pop_arg();
+    int num = arg_num - param_num + 1;
+    Cell lst = (Cell)AQ_NIL;
+    for (int i = 0; i < num; i++)
+    {
+      push_arg(lst);
+      lst = pair_cell(&STACK_TOP_NEXT, &STACK_TOP);
+      pop_arg();
+      pop_arg();
+    }
+    push_arg(lst);
+    push_arg(make_integer(param_num));
+  }
+  else
+  {
+    ERR_WRONG_NUMBER_ARGS(param_num, arg_num, name);
+  }
+}
+
+// pushes the frame of a call whose arguments and their number are on the stack.
+static void push_frame(int param_num, aq_bool is_param_dlist, int ret_addr, char *name)
+{
+  bind_args(param_num, is_param_dlist, name);
+  if (is_error())
+  {
+    return;
+  }
+  push_arg(make_integer(ret_addr));
+  push_arg((Cell)AQ_SFRAME);
+  push_function_stack(stack_top);
+}
+
+// replaces the frame of the running function with the frame of a call in
+// tail position: the arguments are moved down over the current ones, and
+// the return address of the current frame is reused.
+static void replace_frame(int param_num, aq_bool is_param_dlist, char *name)
+{
+  bind_args(param_num, is_param_dlist, name);
+  if (is_error())
+  {
+    return;
+  }
+  int frame_top = get_function_stack_top();
+  int base = frame_top - 3 - INT_VALUE(stack[frame_top - 3]);
+  Cell ret_addr = stack[frame_top - 2];
+  int num = INT_VALUE(STACK_TOP) + 1;
+  int src = stack_top - num;
+  for (int i = 0; i < num; i++)
+  {
+    gc_write_barrier_root(&stack[base + i], stack[src + i]);
+  }
+  gc_write_barrier_root(&stack[base + num], ret_addr);
+  gc_write_barrier_root(&stack[base + num + 1], (Cell)AQ_SFRAME);
+  while (stack_top > base + num + 2)
+  {
+    pop_arg();
+  }
+  function_stack[function_stack_top - 1] = stack_top;
+}
+
+#undef ERROR_RETURN
+#define ERROR_RETURN return -1
+
+// sets up the frame of the call instruction at pc, and returns the address
+// of the callee or -1 on an error. the frame returns to ret_addr, or to the
+// next instruction if ret_addr is -1; tail calls keep the current one.
+int enter_function(char *buf, int pc, int ret_addr)
+{
+  aq_opcode op = (unsigned char)buf[pc];
+  switch (op)
+  {
+  case OP_FUNC:
+  {
+    char *str = &buf[pc + 1];
+    Cell func = get_var(str);
+    if (UNDEF_P(func))
+    {
+      SET_ERROR_WITH_STR(ERR_UNDEFINED_SYMBOL, str);
+    }
+    if (ret_addr < 0)
     {
-      Cell p1 = pop_arg();
-      Cell p2 = pop_arg();
-      Cell ret = (p1 == p2) ? (Cell)AQ_TRUE : (Cell)AQ_FALSE;
-      push_arg(ret);
-      ++(*pc);
-      break;
+      ret_addr = pc + 1 + strlen(str) + 1;
     }
-    case OP_PRINT:
+    push_frame(INT_VALUE(LAMBDA_PARAM_NUM(func)), LAMBDA_FLAG(func), ret_addr, str);
+    return is_error() ? -1 : INT_VALUE(LAMBDA_ADDR(func));
+  }
+  case OP_FUNCG:
+  case OP_TFUNCG:
+  {
+    int slot = get_operand(buf, pc + 1);
+    aq_call_cache *cache = (aq_call_cache *)&buf[pc + 1 + sizeof(Cell) * 2];
+    char *str = &buf[pc + 1 + sizeof(Cell) * 2 + sizeof(aq_call_cache)];
+    if (cache->version != global_version[slot])
     {
-      int num = INT_VALUE(pop_arg());
-      for (int i = num - 1; i >= 0; i--)
-      {
-        print_cell(stdout, STACK_OFFSET(i));
-      }
-      for (int i = 0; i < num; i++)
+      // the callee has been (re)defined since the last call from here.
+      Cell func = env[slot];
+      if (UNDEF_P(func))
       {
-        pop_arg();
+        SET_ERROR_WITH_STR(ERR_UNDEFINED_SYMBOL, str);
       }
-      AQ_PRINTF("\n");
-      push_arg((Cell)AQ_UNDEF);
-      ++(*pc);
-      break;
+      cache->addr = INT_VALUE(LAMBDA_ADDR(func));
+      cache->param_num = INT_VALUE(LAMBDA_PARAM_NUM(func));
+      cache->is_param_dlist = LAMBDA_FLAG(func);
+      cache->version = global_version[slot];
     }
-    case OP_JNEQ:
+    if (op == OP_FUNCG)
     {
-      Cell c = STACK_TOP;
-      pop_arg();
-      ++(*pc);
-      if (!TRUE_P(c))
+      if (ret_addr < 0)
       {
-        int addr = get_operand(buf, *pc);
-        *pc = addr;
+        ret_addr = (str - buf) + get_operand(buf, pc + 1 + sizeof(Cell));
       }
-      else
-      {
-        *pc += sizeof(Cell);
-      }
-      break;
+      push_frame(cache->param_num, cache->is_param_dlist, ret_addr, str);
     }
-    case OP_JMP:
-    {
-      int addr = get_operand(buf, ++(*pc));
-      *pc = addr;
-      break;
-    }
-    case OP_SET:
+    else
     {
-      // this is for on-memory
-      Cell val = STACK_TOP;
-      char *str = &buf[++(*pc)];
-      set_var(str, val);
-      pop_arg();
-      push_arg(symbol_cell(str));
-      *pc += (strlen(str) + 1);
-      break;
+      replace_frame(cache->param_num, cache->is_param_dlist, str);
     }
-    case OP_PUSH_STR:
+    return is_error() ? -1 : cache->addr;
+  }
+  case OP_FUNCS:
+  case OP_TFUNCS:
+  {
+    Cell func = STACK_TOP;
+    int param_num = INT_VALUE(LAMBDA_PARAM_NUM(func));
+    int func_addr = INT_VALUE(LAMBDA_ADDR(func));
+    aq_bool is_param_dlist = LAMBDA_FLAG(func);
+    pop_arg();
+    if (op == OP_FUNCS)
     {
-      char *str = &buf[++(*pc)];
-      Cell str_cell = string_cell(str);
-      push_arg(str_cell);
-      *pc += (strlen(str) + 1);
-      break;
+      push_frame(param_num, is_param_dlist, (ret_addr < 0) ? pc + 1 : ret_addr, "lambda");
     }
-    case OP_PUSH_SYM:
+    else
     {
-      char *sym = &buf[++(*pc)];
-      Cell symCell = symbol_cell(sym);
-      push_arg(symCell);
-      *pc += (strlen(sym) + 1);
-      break;
+      replace_frame(param_num, is_param_dlist, "lambda");
     }
-    case OP_REF:
+    return is_error() ? -1 : func_addr;
+  }
+  default:
+    return -1;
+  }
+}
+
+// pops the frame of the running function, leaving its value on the stack,
+// and returns the return address or -1 on an error.
+int leave_function()
+{
+  Cell val = stack[--stack_top];
+  while (!SFRAME_P(pop_arg()))
+  {
+  }
+  int ret_addr = INT_VALUE(pop_arg());
+  int arg_num = INT_VALUE(pop_arg());
+  for (int i = 0; i < arg_num; ++i)
+  {
+    pop_arg();
+  }
+  pop_function_stack();
+  if (is_error())
+  {
+    return -1;
+  }
+  stack[stack_top++] = val;
+  return ret_addr;
+}
+
+#undef ERROR_RETURN
+#define ERROR_RETURN return
+
+#if defined(AQ_JIT)
+// entry points of the runtime for the native code of the JIT.
+
+static aq_bool jit_tail_called = FALSE;
+
+// runs the native code of the function at pc as long as the JIT has
+// compiled it, following tail calls; returns the pc where the VM goes on,
+// or -1 on an error.
+int jit_enter(char *buf, int pc)
+{
+  aq_jit_code code;
+  while ((code = jit_lookup(buf, pc)) != NULL)
+  {
+    jit_tail_called = FALSE;
+    pc = code();
+    if (pc < 0 || !jit_tail_called)
     {
-      char *str = &buf[++(*pc)];
-      Cell ret = get_var(str);
-      if (UNDEF_P(ret))
-      {
-        SET_ERROR_WITH_STR(ERR_UNDEFINED_SYMBOL, str);
-        push_arg((Cell)AQ_UNDEF);
-        exec = FALSE;
-      }
-      else
-      {
-        push_arg(ret);
-        *pc += (strlen(str) + 1);
-      }
       break;
     }
-    case OP_FUNC:
+  }
+  return pc;
+}
+
+// runs the instructions in [pc, end) with the VM.
+int jit_run(char *buf, int pc, int end)
+{
+  vm_run(buf, &pc, end);
+  return is_error() ? -1 : pc;
+}
+
+// calls the function of the call instruction at pc and runs it until it
+// returns. its frame returns to JIT_RETURN_PC, where the VM stops.
+int jit_call(char *buf, int pc)
+{
+  int addr = enter_function(buf, pc, JIT_RETURN_PC);
+  if (addr >= 0)
+  {
+    addr = jit_enter(buf, addr);
+  }
+  if (addr >= 0 && addr < JIT_RETURN_PC)
+  {
+    vm_run(buf, &addr, JIT_RETURN_PC);
+  }
+  return is_error() ? -1 : 0;
+}
+
+// replaces the frame for the tail call at pc, and returns the address of
+// the callee for jit_enter().
+int jit_tail_call(char *buf, int pc)
+{
+  jit_tail_called = TRUE;
+  return enter_function(buf, pc, -1);
+}
+
+int jit_ret()
+{
+  jit_tail_called = FALSE;
+  return leave_function();
+}
+#endif
+
+// sets register r of the running function to val, popping the registers
+// above it; r is at most the depth of the stack.
+void set_register(int r, Cell val)
+{
+  int index = get_function_stack_top() + r;
+  if (index == stack_top)
+  {
+    push_arg(val);
+    return;
+  }
+  gc_write_barrier_root(&stack[index], val);
+  while (stack_top > index + 1)
+  {
+    pop_arg();
+  }
+}
+
+// returns the register of an operand, or imm set to its integer.
+static Cell *get_register(int operand, Cell *imm)
+{
+  if (IMMEDIATE_OPERAND_P(operand))
+  {
+    *imm = make_integer(operand >> 1);
+    return imm;
+  }
+  return &stack[get_function_stack_top() + (operand >> 1)];
+}
+
+// pops the registers from the operand up when it is a temporary register.
+void pop_registers(int operand)
+{
+  if (!TEMPORARY_REGISTER_P(operand))
+  {
+    return;
+  }
+  int index = get_function_stack_top() + (operand >> 1);
+  while (stack_top > index)
+  {
+    pop_arg();
+  }
+}
+
+// returns the address of the first local of the running function, or NULL
+// at the top level.
+Cell *get_frame_base()
+{
+  if (function_stack_top == 0)
+  {
+    return NULL;
+  }
+  return &stack[get_function_stack_top() - 4];
+}
+
+// The dispatch loop is direct-threaded where the compiler supports
+// labels as values: each handler jumps straight to the next handler
+// through dispatch_table instead of going back to a central switch.
+// Define AQ_NO_THREADED_CODE to force the portable switch.
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(AQ_NO_THREADED_CODE)
+#define AQ_THREADED_CODE
+#endif
+
+// Define AQ_PROFILE_OPCODES to count the dispatched opcode pairs and
+// print the most frequent ones at exit; superinstructions are picked
+// from these counts.
+#if defined(AQ_PROFILE_OPCODES)
+#define PROFILE_PAIR_NUM (20)
+static long opcode_pairs[256][256];
+static int prev_opcode = OP_NOP;
+#define PROFILE_OPCODE(op) (opcode_pairs[prev_opcode][(op)]++, prev_opcode = (op))
+
+static void print_opcode_profile()
+{
+  for (int n = 0; n < PROFILE_PAIR_NUM; n++)
+  {
+    int first = 0, second = 0;
+    for (int i = 0; i < 256; i++)
     {
-      char *str = &buf[++(*pc)];
-      Cell func = get_var(str);
-      if (UNDEF_P(func))
-      {
-        SET_ERROR_WITH_STR(ERR_UNDEFINED_SYMBOL, str);
-        int num = INT_VALUE(pop_arg());
-        for (i = 0; i < num; i++)
-        {
-          pop_arg();
-        }
-        push_arg((Cell)AQ_UNDEF);
-        exec = FALSE;
-      }
-      else
+      for (int j = 0; j < 256; j++)
       {
-        int param_num = INT_VALUE(LAMBDA_PARAM_NUM(func));
-        int arg_num = INT_VALUE(STACK_TOP);
-        int func_addr = INT_VALUE(LAMBDA_ADDR(func));
-        aq_bool is_param_dlist = LAMBDA_FLAG(func);
-        if (is_param_dlist)
-        {
-          ERR_WRONG_NUMBER_ARGS_DLIST(param_num, arg_num, "str");
-          pop_arg();
-          int num = arg_num - param_num + 1;
-          Cell lst = (Cell)AQ_NIL;
-          for (i = 0; i < num; i++)
-          {
-            push_arg(lst);
-            lst = pair_cell(&STACK_TOP_NEXT, &STACK_TOP);
-            pop_arg();
-            pop_arg();
-          }
-          push_arg(lst);
-          push_arg(make_integer(param_num));
-        }
-        else
+        if (opcode_pairs[i][j] > opcode_pairs[first][second])
         {
-          ERR_WRONG_NUMBER_ARGS(param_num, arg_num, "str");
+          first = i;
+          second = j;
         }
-        int ret_addr = *pc + strlen(str) + 1;
-        push_arg(make_integer(ret_addr));
-        push_arg((Cell)AQ_SFRAME);
-        push_function_stack(stack_top);
-
-        // jump
-        *pc = func_addr;
       }
-      break;
     }
-    case OP_FUND:
-    case OP_FUNDD:
+    if (opcode_pairs[first][second] == 0)
     {
-      // jump
-      int def_end = get_operand(buf, ++(*pc));
-      int def_start = *pc + sizeof(Cell) * 2;
-      *pc += sizeof(Cell);
-      int param_num = get_operand(buf, *pc);
-      Cell l = lambda_cell(def_start, param_num, (op == OP_FUNDD) ? TRUE : FALSE);
-      push_arg(l);
-      *pc = def_end;
       break;
     }
-    case OP_FUNCS:
+    fprintf(stderr, "%3d %3d: %ld\n", first, second, opcode_pairs[first][second]);
+    opcode_pairs[first][second] = 0;
+  }
+}
+#else
+#define PROFILE_OPCODE(op)
+#endif
+
+#if defined(AQ_THREADED_CODE)
+#define VM_CASE(op) L_##op
+#define VM_DEFAULT L_UNKNOWN
+#define VM_DISPATCH()            \
+  if (pc >= end)                 \
+  {                              \
+    goto vm_exit;                \
+  }                              \
+  op = (unsigned char)buf[pc];   \
+  PROFILE_OPCODE(op);            \
+  goto *dispatch_table[op];
+#else
+#define VM_CASE(op) case op
+#define VM_DEFAULT default
+#define VM_DISPATCH() continue;
+#endif
+
+#if defined(AQ_JIT)
+// enters the native code of the callee once the JIT has compiled it.
+#define JIT_ENTER()                \
+  if (g_JIT_threshold >= 0)        \
+  {                                \
+    int next = jit_enter(buf, pc); \
+    if (next < 0)                  \
+    {                              \
+      goto vm_exit;                \
+    }                              \
+    pc = next;                     \
+  }
+#else
+#define JIT_ENTER()
+#endif
+
+#define EXECUTE_CALL()                           \
+  {                                              \
+    int func_addr = enter_function(buf, pc, -1); \
+    if (func_addr < 0)                           \
+    {                                            \
+      goto vm_exit;                              \
+    }                                            \
+                                                 \
+    /* jump */                                   \
+    pc = func_addr;                              \
+    JIT_ENTER();                                 \
+  }
+
+#undef ERROR_RETURN
+#define ERROR_RETURN goto vm_exit
+
+void execute(char *buf, int *start, int end)
+{
+  stack_top = 0;
+  vm_run(buf, start, end);
+}
+
+// runs the instructions from *start until pc reaches end, on the stack as
+// it is; compiled code runs the instructions it has no code for with it.
+void vm_run(char *buf, int *start, int end)
+{
+  // pc is kept in a local so that it can live in a register;
+  // it is written back to *start when the loop is left.
+  int pc = *start;
+  aq_opcode op;
+  int i = 0;
+
+#if defined(AQ_THREADED_CODE)
+  static void *dispatch_table[256] = {
+      [0 ... 255] = &&L_UNKNOWN,
+      [OP_NOP] = &&L_OP_NOP,
+      [OP_ADD] = &&L_OP_ADD,
+      [OP_SUB] = &&L_OP_SUB,
+      [OP_MUL] = &&L_OP_MUL,
+      [OP_DIV] = &&L_OP_DIV,
+      [OP_ADD1] = &&L_OP_ADD1,
+      [OP_SUB1] = &&L_OP_SUB1,
+      [OP_ADD2] = &&L_OP_ADD2,
+      [OP_SUB2] = &&L_OP_SUB2,
+      [OP_PRINT] = &&L_OP_PRINT,
+      [OP_PUSH] = &&L_OP_PUSH,
+      [OP_POP] = &&L_OP_POP,
+      [OP_EQUAL] = &&L_OP_EQUAL,
+      [OP_LT] = &&L_OP_LT,
+      [OP_LTE] = &&L_OP_LTE,
+      [OP_GT] = &&L_OP_GT,
+      [OP_GTE] = &&L_OP_GTE,
+      [OP_JNEQ] = &&L_OP_JNEQ,
+      [OP_JMP] = &&L_OP_JMP,
+      [OP_JNEQUAL] = &&L_OP_JNEQUAL,
+      [OP_JNLT] = &&L_OP_JNLT,
+      [OP_JNLTE] = &&L_OP_JNLTE,
+      [OP_JNGT] = &&L_OP_JNGT,
+      [OP_JNGTE] = &&L_OP_JNGTE,
+      [OP_LOAD] = &&L_OP_LOAD,
+      [OP_RET] = &&L_OP_RET,
+      [OP_CONS] = &&L_OP_CONS,
+      [OP_CAR] = &&L_OP_CAR,
+      [OP_CDR] = &&L_OP_CDR,
+      [OP_LOAD_CAR] = &&L_OP_LOAD_CAR,
+      [OP_LOAD_CDR] = &&L_OP_LOAD_CDR,
+      [OP_CADR] = &&L_OP_CADR,
+      [OP_CDDR] = &&L_OP_CDDR,
+      [OP_PUSH_NIL] = &&L_OP_PUSH_NIL,
+      [OP_PUSH_TRUE] = &&L_OP_PUSH_TRUE,
+      [OP_PUSH_FALSE] = &&L_OP_PUSH_FALSE,
+      [OP_SET] = &&L_OP_SET,
+      [OP_REF] = &&L_OP_REF,
+      [OP_FUNC] = &&L_OP_FUNC,
+      [OP_FUND] = &&L_OP_FUND,
+      [OP_FUNCS] = &&L_OP_FUNCS,
+      [OP_TFUNCS] = &&L_OP_TFUNCS,
+      [OP_SROT] = &&L_OP_SROT,
+      [OP_PUSH_STR] = &&L_OP_PUSH_STR,
+      [OP_PUSH_SYM] = &&L_OP_PUSH_SYM,
+      [OP_FUNDD] = &&L_OP_FUNDD,
+      [OP_EQ] = &&L_OP_EQ,
+      [OP_SETG] = &&L_OP_SETG,
+      [OP_REFG] = &&L_OP_REFG,
+      [OP_FUNCG] = &&L_OP_FUNCG,
+      [OP_TFUNCG] = &&L_OP_TFUNCG,
+      [OP_ARGC] = &&L_OP_ARGC,
+      [OP_JNEQUAL_LL] = &&L_OP_JNEQUAL_LL,
+      [OP_JNLT_LL] = &&L_OP_JNLT_LL,
+      [OP_JNLTE_LL] = &&L_OP_JNLTE_LL,
+      [OP_JNGT_LL] = &&L_OP_JNGT_LL,
+      [OP_JNGTE_LL] = &&L_OP_JNGTE_LL,
+      [OP_JNEQUAL_LI] = &&L_OP_JNEQUAL_LI,
+      [OP_JNLT_LI] = &&L_OP_JNLT_LI,
+      [OP_JNLTE_LI] = &&L_OP_JNLTE_LI,
+      [OP_JNGT_LI] = &&L_OP_JNGT_LI,
+      [OP_JNGTE_LI] = &&L_OP_JNGTE_LI,
+      [OP_HALT] = &&L_OP_HALT,
+      [OP_ADD_R] = &&L_OP_ADD_R,
+      [OP_SUB_R] = &&L_OP_SUB_R,
+      [OP_MUL_R] = &&L_OP_MUL_R,
+      [OP_EQUAL_R] = &&L_OP_EQUAL_R,
+      [OP_LT_R] = &&L_OP_LT_R,
+      [OP_LTE_R] = &&L_OP_LTE_R,
+      [OP_GT_R] = &&L_OP_GT_R,
+      [OP_GTE_R] = &&L_OP_GTE_R,
+      [OP_JNEQUAL_R] = &&L_OP_JNEQUAL_R,
+      [OP_JNLT_R] = &&L_OP_JNLT_R,
+      [OP_JNLTE_R] = &&L_OP_JNLTE_R,
+      [OP_JNGT_R] = &&L_OP_JNGT_R,
+      [OP_JNGTE_R] = &&L_OP_JNGTE_R,
+      [OP_CONS_R] = &&L_OP_CONS_R,
+      [OP_EQ_R] = &&L_OP_EQ_R,
+      [OP_CAR_R] = &&L_OP_CAR_R,
+      [OP_CDR_R] = &&L_OP_CDR_R,
+      [OP_JNEQ_R] = &&L_OP_JNEQ_R,
+  };
+
+  VM_DISPATCH();
+#else
+  while (pc < end)
+  {
+    op = buf[pc];
+    PROFILE_OPCODE(op);
+    switch (op)
+    {
+#endif
+  VM_CASE(OP_PUSH):
+  {
+    int value = get_operand(buf, ++pc);
+    push_arg(make_integer(value));
+    pc += sizeof(Cell);
+    VM_DISPATCH();
+  }
+  VM_CASE(OP_POP):
+    pop_arg();
+    ++pc;
+    VM_DISPATCH();
+  VM_CASE(OP_PUSH_NIL):
+    EXECUTE_PUSH_IMMEDIATE_VALUE(AQ_NIL);
+    VM_DISPATCH();
+  VM_CASE(OP_PUSH_TRUE):
+    EXECUTE_PUSH_IMMEDIATE_VALUE(AQ_TRUE);
+    VM_DISPATCH();
+  VM_CASE(OP_PUSH_FALSE):
+    EXECUTE_PUSH_IMMEDIATE_VALUE(AQ_FALSE);
+    VM_DISPATCH();
+  VM_CASE(OP_ADD1):
+    EXECUTE_MATH_OPERATOR_WITH_CONSTANT("+", +, 1);
+    VM_DISPATCH();
+  VM_CASE(OP_ADD2):
+    EXECUTE_MATH_OPERATOR_WITH_CONSTANT("+", +, 2);
+    VM_DISPATCH();
+  VM_CASE(OP_SUB1):
+    EXECUTE_MATH_OPERATOR_WITH_CONSTANT("-", +, -1);
+    VM_DISPATCH();
+  VM_CASE(OP_SUB2):
+    EXECUTE_MATH_OPERATOR_WITH_CONSTANT("-", +, -2);
+    VM_DISPATCH();
+  VM_CASE(OP_ADD):
+    EXECUTE_MATH_OPERATION("+", +=, 0);
+    VM_DISPATCH();
+  VM_CASE(OP_SUB):
+  {
+    ERR_INT_NOT_GIVEN(STACK_TOP, "-");
+    int num = INT_VALUE(STACK_TOP);
+    if (num == 0)
     {
-      Cell func = STACK_TOP;
-      int param_num = INT_VALUE(LAMBDA_PARAM_NUM(func));
-      int func_addr = INT_VALUE(LAMBDA_ADDR(func));
-      aq_bool is_param_dlist = LAMBDA_FLAG(func);
       pop_arg();
-      int arg_num = INT_VALUE(STACK_TOP);
-      if (is_param_dlist)
-      {
-        ERR_WRONG_NUMBER_ARGS_DLIST(param_num, arg_num, "lambda");
-        pop_arg();
-        int num = arg_num - param_num + 1;
-        Cell lst = (Cell)AQ_NIL;
-        for (i = 0; i < num; i++)
-        {
-          push_arg(lst);
-          lst = pair_cell(&STACK_TOP_NEXT, &STACK_TOP);
-          pop_arg();
-          pop_arg();
-        }
-        push_arg(lst);
-        push_arg(make_integer(param_num));
-      }
-      else
-      {
-        ERR_WRONG_NUMBER_ARGS(param_num, arg_num, "lambda");
-      }
-
-      int ret_addr = *pc + 1;
-      push_arg(make_integer(ret_addr));
-      push_arg((Cell)AQ_SFRAME);
-      push_function_stack(stack_top);
+      EXECUTE_MATH_OPERATOR_WITH_CONSTANT("-", *, -1)
+    }
+    else
+    {
+      EXECUTE_MATH_OPERATION("-", +=, 0);
+      int result = INT_VALUE(pop_arg());
+      push_arg(make_integer(INT_VALUE(pop_arg()) - result));
+    }
+    VM_DISPATCH();
+  }
+  VM_CASE(OP_MUL):
+    EXECUTE_MATH_OPERATION("*", *=, 1);
+    VM_DISPATCH();
+  VM_CASE(OP_DIV):
+  {
+    ERR_INT_NOT_GIVEN(STACK_TOP, "/");
+    int num = INT_VALUE(STACK_TOP);
+    if (num == 0)
+    {
+      pop_arg();
+      EXECUTE_MATH_OPERATOR_WITH_CONSTANT("/", /, 1);
+    }
+    else
+    {
+      EXECUTE_MATH_OPERATION("/", *=, 1);
+      int result = INT_VALUE(pop_arg());
+      push_arg(make_integer(INT_VALUE(pop_arg()) / result));
+    }
+    VM_DISPATCH();
+  }
+  VM_CASE(OP_RET):
+  {
+    int ret_addr = leave_function();
+    if (ret_addr < 0)
+    {
+      goto vm_exit;
+    }
+    pc = ret_addr;
+    VM_DISPATCH();
+  }
+  VM_CASE(OP_CONS):
+  {
+    Cell ret = pair_cell(&STACK_TOP_NEXT, &STACK_TOP);
+    pop_arg();
+    pop_arg();
 
-      // jump
-      *pc = func_addr;
-      break;
+    push_arg(ret);
+    ++pc;
+    VM_DISPATCH();
+  }
+  VM_CASE(OP_CAR):
+  {
+    ERR_PAIR_NOT_GIVEN("car");
+    gc_write_barrier_root(&STACK_TOP, CAR(STACK_TOP));
+    ++pc;
+    VM_DISPATCH();
+  }
+  VM_CASE(OP_CDR):
+  {
+    ERR_PAIR_NOT_GIVEN("cdr");
+    gc_write_barrier_root(&STACK_TOP, CDR(STACK_TOP));
+    ++pc;
+    VM_DISPATCH();
+  }
+  VM_CASE(OP_LOAD_CAR):
+    EXECUTE_LOAD_ACCESSOR("car", CAR);
+    VM_DISPATCH();
+  VM_CASE(OP_LOAD_CDR):
+    EXECUTE_LOAD_ACCESSOR("cdr", CDR);
+    VM_DISPATCH();
+  VM_CASE(OP_CADR):
+    EXECUTE_CDR_ACCESSOR("car", CAR);
+    VM_DISPATCH();
+  VM_CASE(OP_CDDR):
+    EXECUTE_CDR_ACCESSOR("cdr", CDR);
+    VM_DISPATCH();
+  VM_CASE(OP_EQUAL):
+    EXECUTE_INT_COMPARISON("=", ==);
+    VM_DISPATCH();
+  VM_CASE(OP_GT):
+    EXECUTE_INT_COMPARISON(">", >);
+    VM_DISPATCH();
+  VM_CASE(OP_GTE):
+    EXECUTE_INT_COMPARISON(">=", >=);
+    VM_DISPATCH();
+  VM_CASE(OP_LT):
+    EXECUTE_INT_COMPARISON("<", <);
+    VM_DISPATCH();
+  VM_CASE(OP_LTE):
+    EXECUTE_INT_COMPARISON("<=", <=);
+    VM_DISPATCH();
+  VM_CASE(OP_EQ):
+  {
+    Cell p1 = pop_arg();
+    Cell p2 = pop_arg();
+    Cell ret = (p1 == p2) ? (Cell)AQ_TRUE : (Cell)AQ_FALSE;
+    push_arg(ret);
+    ++pc;
+    VM_DISPATCH();
+  }
+  VM_CASE(OP_PRINT):
+  {
+    int num = INT_VALUE(pop_arg());
+    for (int i = num - 1; i >= 0; i--)
+    {
+      print_cell(stdout, STACK_OFFSET(i));
+    }
+    for (int i = 0; i < num; i++)
+    {
+      pop_arg();
     }
-    case OP_SROT:
+    AQ_PRINTF("\n");
+    push_arg((Cell)AQ_UNDEF);
+    ++pc;
+    VM_DISPATCH();
+  }
+  VM_CASE(OP_JNEQ):
+  {
+    Cell c = STACK_TOP;
+    pop_arg();
+    ++pc;
+    if (!TRUE_P(c))
     {
-      int n = get_operand(buf, ++(*pc));
-      Cell val = STACK_OFFSET(n);
-      for (i = n; i > 0; i--)
-      {
-        STACK_OFFSET(i) = STACK_OFFSET(i);
-      }
-      STACK_TOP = val;
-      *pc += sizeof(Cell);
-      break;
+      pc = get_operand(buf, pc);
     }
-    case OP_LOAD:
+    else
     {
-      int offset = get_operand(buf, ++(*pc));
-      int index = get_function_stack_top() - offset - 4;
-      Cell val = stack[index];
-      push_arg(val);
-      *pc += sizeof(Cell);
-      break;
+      pc += sizeof(Cell);
+    }
+    VM_DISPATCH();
+  }
+  VM_CASE(OP_JMP):
+  {
+    pc = get_operand(buf, ++pc);
+    VM_DISPATCH();
+  }
+  VM_CASE(OP_JNEQUAL):
+    EXECUTE_INT_COMPARISON_JUMP("=", ==);
+    VM_DISPATCH();
+  VM_CASE(OP_JNLT):
+    EXECUTE_INT_COMPARISON_JUMP("<", <);
+    VM_DISPATCH();
+  VM_CASE(OP_JNLTE):
+    EXECUTE_INT_COMPARISON_JUMP("<=", <=);
+    VM_DISPATCH();
+  VM_CASE(OP_JNGT):
+    EXECUTE_INT_COMPARISON_JUMP(">", >);
+    VM_DISPATCH();
+  VM_CASE(OP_JNGTE):
+    EXECUTE_INT_COMPARISON_JUMP(">=", >=);
+    VM_DISPATCH();
+  VM_CASE(OP_JNEQUAL_LL):
+    EXECUTE_LOCAL_COMPARISON_JUMP("=", ==, LOCAL_VALUE(pc + 1 + sizeof(Cell)));
+    VM_DISPATCH();
+  VM_CASE(OP_JNLT_LL):
+    EXECUTE_LOCAL_COMPARISON_JUMP("<", <, LOCAL_VALUE(pc + 1 + sizeof(Cell)));
+    VM_DISPATCH();
+  VM_CASE(OP_JNLTE_LL):
+    EXECUTE_LOCAL_COMPARISON_JUMP("<=", <=, LOCAL_VALUE(pc + 1 + sizeof(Cell)));
+    VM_DISPATCH();
+  VM_CASE(OP_JNGT_LL):
+    EXECUTE_LOCAL_COMPARISON_JUMP(">", >, LOCAL_VALUE(pc + 1 + sizeof(Cell)));
+    VM_DISPATCH();
+  VM_CASE(OP_JNGTE_LL):
+    EXECUTE_LOCAL_COMPARISON_JUMP(">=", >=, LOCAL_VALUE(pc + 1 + sizeof(Cell)));
+    VM_DISPATCH();
+  VM_CASE(OP_JNEQUAL_LI):
+    EXECUTE_LOCAL_COMPARISON_JUMP("=", ==, make_integer(get_operand(buf, pc + 1 + sizeof(Cell))));
+    VM_DISPATCH();
+  VM_CASE(OP_JNLT_LI):
+    EXECUTE_LOCAL_COMPARISON_JUMP("<", <, make_integer(get_operand(buf, pc + 1 + sizeof(Cell))));
+    VM_DISPATCH();
+  VM_CASE(OP_JNLTE_LI):
+    EXECUTE_LOCAL_COMPARISON_JUMP("<=", <=, make_integer(get_operand(buf, pc + 1 + sizeof(Cell))));
+    VM_DISPATCH();
+  VM_CASE(OP_JNGT_LI):
+    EXECUTE_LOCAL_COMPARISON_JUMP(">", >, make_integer(get_operand(buf, pc + 1 + sizeof(Cell))));
+    VM_DISPATCH();
+  VM_CASE(OP_JNGTE_LI):
+    EXECUTE_LOCAL_COMPARISON_JUMP(">=", >=, make_integer(get_operand(buf, pc + 1 + sizeof(Cell))));
+    VM_DISPATCH();
+  VM_CASE(OP_ADD_R):
+    EXECUTE_REGISTER_OPERATION("+", +, make_integer);
+    VM_DISPATCH();
+  VM_CASE(OP_SUB_R):
+    EXECUTE_REGISTER_OPERATION("-", -, make_integer);
+    VM_DISPATCH();
+  VM_CASE(OP_MUL_R):
+    EXECUTE_REGISTER_OPERATION("*", *, make_integer);
+    VM_DISPATCH();
+  VM_CASE(OP_EQUAL_R):
+    EXECUTE_REGISTER_OPERATION("=", ==, BOOL_CELL);
+    VM_DISPATCH();
+  VM_CASE(OP_LT_R):
+    EXECUTE_REGISTER_OPERATION("<", <, BOOL_CELL);
+    VM_DISPATCH();
+  VM_CASE(OP_LTE_R):
+    EXECUTE_REGISTER_OPERATION("<=", <=, BOOL_CELL);
+    VM_DISPATCH();
+  VM_CASE(OP_GT_R):
+    EXECUTE_REGISTER_OPERATION(">", >, BOOL_CELL);
+    VM_DISPATCH();
+  VM_CASE(OP_GTE_R):
+    EXECUTE_REGISTER_OPERATION(">=", >=, BOOL_CELL);
+    VM_DISPATCH();
+  VM_CASE(OP_JNEQUAL_R):
+    EXECUTE_REGISTER_COMPARISON_JUMP("=", ==);
+    VM_DISPATCH();
+  VM_CASE(OP_JNLT_R):
+    EXECUTE_REGISTER_COMPARISON_JUMP("<", <);
+    VM_DISPATCH();
+  VM_CASE(OP_JNLTE_R):
+    EXECUTE_REGISTER_COMPARISON_JUMP("<=", <=);
+    VM_DISPATCH();
+  VM_CASE(OP_JNGT_R):
+    EXECUTE_REGISTER_COMPARISON_JUMP(">", >);
+    VM_DISPATCH();
+  VM_CASE(OP_JNGTE_R):
+    EXECUTE_REGISTER_COMPARISON_JUMP(">=", >=);
+    VM_DISPATCH();
+  VM_CASE(OP_CONS_R):
+  {
+    Cell imm1, imm2;
+    Cell ret = pair_cell(REGISTER_REF(pc + 1 + sizeof(Cell), &imm1), REGISTER_REF(pc + 1 + sizeof(Cell) * 2, &imm2));
+    set_register(get_operand(buf, pc + 1), ret);
+    pc += 1 + sizeof(Cell) * 3;
+    VM_DISPATCH();
+  }
+  VM_CASE(OP_EQ_R):
+  {
+    Cell imm1, imm2;
+    Cell ret = BOOL_CELL(*REGISTER_REF(pc + 1 + sizeof(Cell), &imm1) == *REGISTER_REF(pc + 1 + sizeof(Cell) * 2, &imm2));
+    set_register(get_operand(buf, pc + 1), ret);
+    pc += 1 + sizeof(Cell) * 3;
+    VM_DISPATCH();
+  }
+  VM_CASE(OP_CAR_R):
+    EXECUTE_REGISTER_ACCESSOR("car", CAR);
+    VM_DISPATCH();
+  VM_CASE(OP_CDR_R):
+    EXECUTE_REGISTER_ACCESSOR("cdr", CDR);
+    VM_DISPATCH();
+  VM_CASE(OP_JNEQ_R):
+  {
+    Cell imm;
+    int operand = get_operand(buf, pc + 1);
+    aq_bool b = TRUE_P(*REGISTER_REF(pc + 1, &imm));
+    pop_registers(operand);
+    pc = b ? pc + 1 + sizeof(Cell) * 2 : get_operand(buf, pc + 1 + sizeof(Cell));
+    VM_DISPATCH();
+  }
+  VM_CASE(OP_SET):
+  {
+    // this is for on-memory
+    Cell val = STACK_TOP;
+    char *str = &buf[++pc];
+    set_var(str, val);
+    pop_arg();
+    push_arg(symbol_cell(str));
+    pc += (strlen(str) + 1);
+    VM_DISPATCH();
+  }
+  VM_CASE(OP_PUSH_STR):
+  {
+    char *str = &buf[++pc];
+    Cell str_cell = string_cell(str);
+    push_arg(str_cell);
+    pc += (strlen(str) + 1);
+    VM_DISPATCH();
+  }
+  VM_CASE(OP_PUSH_SYM):
+  {
+    char *sym = &buf[++pc];
+    Cell symCell = symbol_cell(sym);
+    push_arg(symCell);
+    pc += (strlen(sym) + 1);
+    VM_DISPATCH();
+  }
+  VM_CASE(OP_REF):
+  {
+    char *str = &buf[++pc];
+    Cell ret = get_var(str);
+    if (UNDEF_P(ret))
+    {
+      SET_ERROR_WITH_STR(ERR_UNDEFINED_SYMBOL, str);
     }
-    case OP_NOP:
-      // do nothing
-      ++(*pc);
-      break;
-    case OP_HALT:
-      exec = FALSE;
-      ++(*pc);
-      break;
-    default:
-      AQ_PRINTF("Unknown opcode: %d\n", op);
-      exec = FALSE;
-      break;
+    push_arg(ret);
+    pc += (strlen(str) + 1);
+    VM_DISPATCH();
+  }
+  VM_CASE(OP_FUNC):
+    EXECUTE_CALL();
+    VM_DISPATCH();
+  VM_CASE(OP_SETG):
+  {
+    Cell val = STACK_TOP;
+    int slot = get_operand(buf, pc + 1);
+    char *str = &buf[pc + 1 + sizeof(Cell) * 2];
+    set_global(slot, val);
+    pop_arg();
+    push_arg(symbol_cell(str));
+    pc += 1 + sizeof(Cell) * 2 + get_operand(buf, pc + 1 + sizeof(Cell));
+    VM_DISPATCH();
+  }
+  VM_CASE(OP_REFG):
+  {
+    Cell ret = env[get_operand(buf, pc + 1)];
+    if (UNDEF_P(ret))
+    {
+      SET_ERROR_WITH_STR(ERR_UNDEFINED_SYMBOL, &buf[pc + 1 + sizeof(Cell) * 2]);
+    }
+    push_arg(ret);
+    pc += 1 + sizeof(Cell) * 2 + get_operand(buf, pc + 1 + sizeof(Cell));
+    VM_DISPATCH();
+  }
+  VM_CASE(OP_ARGC):
+    // pushes the number of arguments and enters the call that follows
+    // without a dispatch.
+    push_arg(make_integer(get_operand(buf, pc + 1)));
+    pc += 1 + sizeof(Cell);
+    // fall through
+  VM_CASE(OP_FUNCG):
+  VM_CASE(OP_TFUNCG):
+    EXECUTE_CALL();
+    VM_DISPATCH();
+  VM_CASE(OP_FUND):
+  VM_CASE(OP_FUNDD):
+  {
+    // jump
+    int def_end = get_operand(buf, ++pc);
+    int def_start = pc + sizeof(Cell) * 2;
+    pc += sizeof(Cell);
+    int param_num = get_operand(buf, pc);
+    Cell l = lambda_cell(def_start, param_num, (op == OP_FUNDD) ? TRUE : FALSE);
+    push_arg(l);
+    pc = def_end;
+    VM_DISPATCH();
+  }
+  VM_CASE(OP_FUNCS):
+  VM_CASE(OP_TFUNCS):
+    EXECUTE_CALL();
+    VM_DISPATCH();
+  VM_CASE(OP_SROT):
+  {
+    int n = get_operand(buf, ++pc);
+    Cell val = STACK_OFFSET(n);
+    for (i = n; i > 0; i--)
+    {
+      STACK_OFFSET(i) = STACK_OFFSET(i);
+    }
+    STACK_TOP = val;
+    pc += sizeof(Cell);
+    VM_DISPATCH();
+  }
+  VM_CASE(OP_LOAD):
+  {
+    int offset = get_operand(buf, ++pc);
+    int index = get_function_stack_top() - offset - 4;
+    Cell val = stack[index];
+    push_arg(val);
+    pc += sizeof(Cell);
+    VM_DISPATCH();
+  }
+  VM_CASE(OP_NOP):
+    // do nothing
+    ++pc;
+    VM_DISPATCH();
+  VM_CASE(OP_HALT):
+    ++pc;
+    goto vm_exit;
+  VM_DEFAULT:
+    AQ_PRINTF("Unknown opcode: %d\n", op);
+    goto vm_exit;
+#if !defined(AQ_THREADED_CODE)
     }
   }
+#endif
+
+vm_exit:
+  *start = pc;
 }
 
+#undef ERROR_RETURN
+#define ERROR_RETURN return
+
 aq_bool is_error()
 {
   return (err_type != ERR_TYPE_NONE);
@@ -1753,12 +3685,18 @@ void handle_error()
   case ERR_TYPE_UNEXPECTED_TOKEN:
     AQ_FPRINTF(fp, "unexpected token: %s\n", STR_VALUE(pop_arg()));
     break;
+  case ERR_TYPE_TOO_MANY_GLOBALS:
+    AQ_FPRINTF(fp, "too many global variables\n");
+    break;
   case ERR_UNDEFINED_SYMBOL:
     AQ_FPRINTF(fp, "undefined symbol: %s\n", STR_VALUE(pop_arg()));
     break;
   case ERR_HEAP_EXHAUSTED:
     AQ_FPRINTF(fp, "heap exhausted\n");
     break;
+  case ERR_SYMBOL_AREA_EXHAUSTED:
+    AQ_FPRINTF(fp, "symbol area exhausted\n");
+    break;
   case ERR_FILE_NOT_FOUND:
     AQ_FPRINTF(fp, "cannot open file: %s\n", STR_VALUE(pop_arg()));
     break;
@@ -1819,6 +3757,9 @@ void repl()
   free(buf);
 }
 
+static char *aot_output = NULL;
+static char *gc_name = "";
+
 int handle_option(int argc, char *argv[])
 {
   int i = 1;
@@ -1826,28 +3767,108 @@ int handle_option(int argc, char *argv[])
   {
     if (strcmp(argv[i], "-GC") == 0)
     {
-      set_gc(argv[++i]);
+      gc_name = argv[++i];
     }
     else if (strcmp(argv[i], "-GC_STRESS") == 0)
     {
       g_GC_stress = TRUE;
     }
+    else if (strcmp(argv[i], "-GC_LAZY_SWEEP") == 0)
+    {
+      // mark-sweep sweeps as it allocates instead of in the collection.
+      g_GC_lazy_sweep = TRUE;
+    }
+    else if (strcmp(argv[i], "-GC_INCREMENTAL") == 0)
+    {
+      // mark-sweep marks a little at each allocation instead of in the collection.
+      g_GC_incremental = TRUE;
+    }
+    else if (strcmp(argv[i], "-GC_DEPTH_FIRST") == 0)
+    {
+      // copying and generational copy the CDR chain of a pair right behind it.
+      g_GC_depth_first = TRUE;
+    }
+    else if (strcmp(argv[i], "-HEAP_SIZE") == 0)
+    {
+      // the initial heap size in bytes.
+      heap_size = atoi(argv[++i]);
+    }
+    else if (strcmp(argv[i], "-HEAP_MAX") == 0)
+    {
+      // the heap grows up to this size in bytes; 0 keeps the initial size.
+      g_heap_max = strtoul(argv[++i], NULL, 10);
+    }
+    else if (strcmp(argv[i], "-HEAP_LIVE_RATIO") == 0)
+    {
+      // the percentage of the heap live data should fill after a collection.
+      g_heap_live_ratio = atoi(argv[++i]);
+      g_heap_live_ratio = (g_heap_live_ratio < 1) ? 1 : (g_heap_live_ratio > 90) ? 90 : g_heap_live_ratio;
+    }
+    else if (strcmp(argv[i], "-GC_TIME_RATIO") == 0)
+    {
+      // the percentage of the run time above which the heap grows.
+      g_GC_time_ratio = atoi(argv[++i]);
+    }
+    else if (strcmp(argv[i], "-GC_THREADS") == 0)
+    {
+      // the number of threads that mark in mark-sweep, mark-compact and the major GC of
+      // generational, and that copy in the copying collector.
+#if defined(AQ_GC_THREADS)
+      // more threads than processors would only take turns.
+      long cpu_num = sysconf(_SC_NPROCESSORS_ONLN);
+      g_GC_threads = atoi(argv[++i]);
+      g_GC_threads = (cpu_num > 0 && g_GC_threads > cpu_num) ? (int)cpu_num : g_GC_threads;
+#else
+      ++i;
+      fprintf(stderr, "GC threads are not supported on this platform\n");
+#endif
+    }
+    else if (strcmp(argv[i], "-JIT") == 0)
+    {
+      // compiles lambdas once they are called more times than the threshold.
+#if defined(AQ_JIT)
+      g_JIT_threshold = atoi(argv[++i]);
+#else
+      ++i;
+      fprintf(stderr, "JIT is not supported on this platform\n");
+#endif
+    }
+    else if (strcmp(argv[i], "-VM") == 0)
+    {
+      // the bytecode format of lambdas: "stack" (default) or "register".
+      g_register_code = (strcmp(argv[++i], "register") == 0);
+    }
+    else if (strcmp(argv[i], "-AOT") == 0)
+    {
+      // writes the program as C code instead of running it.
+      aot_output = argv[++i];
+    }
   }
   return i;
 }
 
 int main(int argc, char *argv[])
 {
-  set_gc("");
+  // the collector is set up after the heap options.
   int i = handle_option(argc, argv);
+  set_gc(gc_name);
   init();
 #if defined(_TEST)
   return do_test(argv[i - 1], argv[i]);
+#elif defined(AQ_AOT)
+  // the program has been compiled into aot_execute(); no file is read.
+  (void)i;
+  aot_execute();
+  handle_error();
 #else
   if (i >= argc)
   {
     repl();
   }
+  else if (aot_output)
+  {
+    compile_file_to_c(argv[i], aot_output);
+  }
   else
   {
     load_file(argv[i]);
@@ -48,12 +48,21 @@ enum _opcode
 
   OP_JNEQ = 31,
   OP_JMP = 32,
+  OP_JNEQUAL = 33,
+  OP_JNLT = 34,
+  OP_JNLTE = 35,
+  OP_JNGT = 36,
+  OP_JNGTE = 37,
 
   OP_LOAD = 40,
   OP_RET = 41,
   OP_CONS = 42,
   OP_CAR = 43,
   OP_CDR = 44,
+  OP_LOAD_CAR = 45,
+  OP_LOAD_CDR = 46,
+  OP_CADR = 47,
+  OP_CDDR = 48,
 
   OP_PUSH_NIL = 50,
   OP_PUSH_TRUE = 51,
@@ -64,6 +73,7 @@ enum _opcode
   OP_FUND = 56,
   OP_FUNCS = 57,
   OP_SROT = 58,
+  OP_TFUNCS = 59,
 
   OP_PUSH_STR = 60,
   OP_PUSH_SYM = 61,
@@ -71,7 +81,46 @@ enum _opcode
 
   OP_EQ = 70,
 
+  OP_SETG = 80,
+  OP_REFG = 81,
+  OP_FUNCG = 82,
+  OP_TFUNCG = 83,
+  OP_ARGC = 84,
+
+  // compare two locals, or a local and an immediate, and jump if false.
+  OP_JNEQUAL_LL = 90,
+  OP_JNLT_LL = 91,
+  OP_JNLTE_LL = 92,
+  OP_JNGT_LL = 93,
+  OP_JNGTE_LL = 94,
+  OP_JNEQUAL_LI = 95,
+  OP_JNLT_LI = 96,
+  OP_JNLTE_LI = 97,
+  OP_JNGT_LI = 98,
+  OP_JNGTE_LI = 99,
+
   OP_HALT = 100,
+
+  // register code (-VM register): operands are registers of the frame or
+  // integers (see REGISTER_OPERAND), and the result goes to register dst.
+  OP_ADD_R = 110, // dst, a, b
+  OP_SUB_R = 111,
+  OP_MUL_R = 112,
+  OP_EQUAL_R = 113,
+  OP_LT_R = 114,
+  OP_LTE_R = 115,
+  OP_GT_R = 116,
+  OP_GTE_R = 117,
+  OP_JNEQUAL_R = 118, // a, b, target
+  OP_JNLT_R = 119,
+  OP_JNLTE_R = 120,
+  OP_JNGT_R = 121,
+  OP_JNGTE_R = 122,
+  OP_CONS_R = 123, // dst, a, b
+  OP_EQ_R = 124,
+  OP_CAR_R = 125, // dst, a
+  OP_CDR_R = 126,
+  OP_JNEQ_R = 127, // a, target
 };
 typedef enum _opcode aq_opcode;
 
@@ -132,13 +181,28 @@ struct _inst
   aq_opcode op;
   aq_operand operand1;
   aq_operand operand2;
+  aq_operand operand3;
   int offset;
   int size;
   struct _inst *prev;
   struct _inst *next;
+  struct _inst *target; // jump target while optimizing, NULL for the end.
+  aq_bool is_target;
+  int depth; // stack depth at a jump target, for the register code.
 };
 typedef struct _inst aq_inst;
 
+// inline cache of a call site, encoded in the bytecode of OP_FUNCG.
+// it is valid while version equals the version of the callee's global slot.
+struct _call_cache
+{
+  int version;
+  int addr;
+  int param_num;
+  int is_param_dlist;
+};
+typedef struct _call_cache aq_call_cache;
+
 struct _inst_queue
 {
   aq_inst *head;
@@ -174,6 +238,7 @@ enum _error_type
   ERR_TYPE_SYMBOL_NOT_GIVEN,
   ERR_TYPE_SYNTAX_ERROR,
   ERR_TYPE_UNEXPECTED_TOKEN,
+  ERR_TYPE_TOO_MANY_GLOBALS,
 
   // runtime error
   ERR_TYPE_PAIR_NOT_GIVEN,
@@ -182,6 +247,7 @@ enum _error_type
   ERR_STACK_UNDERFLOW,
   ERR_UNDEFINED_SYMBOL,
   ERR_HEAP_EXHAUSTED,
+  ERR_SYMBOL_AREA_EXHAUSTED,
   ERR_FILE_NOT_FOUND,
 
   ERR_TYPE_GENERAL_ERROR,
@@ -242,16 +308,19 @@ aq_inst *create_inst(aq_opcode op, int size);
 aq_inst *create_inst_char(aq_opcode op, char c);
 aq_inst *create_inst_str(aq_opcode op, char *str);
 aq_inst *create_inst_num(aq_opcode op, int num);
+aq_inst *create_inst_global(aq_opcode op, char *name);
 aq_inst *create_inst_token(inst_queue *queue, char *token);
 
 void add_inst_tail(inst_queue *queue, aq_inst *inst);
 size_t write_inst(aq_inst *inst, char *buf);
+void optimize_inst(inst_queue *queue);
 void add_push_tail(inst_queue *queue, int num);
 void add_one_byte_inst_tail(inst_queue *queue, aq_opcode op);
 
 size_t compile(FILE *fp, char *buf, int offset);
 void compile_token(inst_queue *queue, char *token, Cell symbol_list);
 int compile_list(inst_queue *queue, FILE *fp, Cell symbol_list);
+int compile_sequence(inst_queue *queue, FILE *fp, Cell symbol_list, aq_bool discard);
 void compile_elem(inst_queue *queue, FILE *fp, Cell symbol_list);
 void compile_quote(inst_queue *queue, FILE *fp);
 void compile_quoted_atom(inst_queue *queue, char *symbol, FILE *fp);
@@ -263,20 +332,76 @@ void compile_define(inst_queue *queue, FILE *fp, Cell symbol_list);
 void compile_lambda(inst_queue *queue, FILE *fp);
 void compile_procedure(char *func, int num, inst_queue *queue);
 void compile_symbol_list(char *var, Cell *symbol_list);
+void mark_tail_calls(aq_inst *from, aq_inst *to);
 
 void execute(char *buf, int *start, int end);
+int get_operand(char *buf, int pc);
+int get_inst_size(char *buf, int pc);
+
+// runtime of compiled code: the JIT and the C code written by -AOT.
+void vm_run(char *buf, int *start, int end);
+int enter_function(char *buf, int pc, int ret_addr);
+int leave_function();
+Cell *get_frame_base();
+
+// register r of a frame is stack[get_function_stack_top() + r]: the
+// parameters are below the frame header, the temporaries above it. In
+// register code an operand is either a register or an integer.
+#define REGISTER_OPERAND(r) ((r)*2)
+#define IMMEDIATE_OPERAND(num) ((num)*2 + 1)
+#define IMMEDIATE_OPERAND_P(operand) ((operand)&1)
+#define PARAMETER_REGISTER(offset) (-4 - (offset))
+#define TEMPORARY_REGISTER_P(operand) (!IMMEDIATE_OPERAND_P(operand) && (operand) >= 0)
+
+extern aq_bool g_register_code; // -VM register compiles lambdas to register code.
+
+void set_register(int r, Cell val);
+void pop_registers(int operand);
+
+// AOT (aot.c): -AOT writes the bytecode of a program as C code. The code
+// defines aot_execute(), which main() of the runtime built with AQ_AOT calls.
+void aot_write(FILE *fp, char *buf, int size);
+void aot_execute();
+
+// The baseline JIT (jit.c) compiles the bytecode of hot lambdas to x86-64
+// code. Define AQ_NO_JIT to leave it out.
+#if defined(__x86_64__) && !defined(_WIN32) && !defined(AQ_NO_JIT)
+#define AQ_JIT
+#endif
+
+#if defined(AQ_JIT)
+// native code of a lambda: returns the pc where the VM goes on, or -1 on an error.
+typedef int (*aq_jit_code)();
+
+// frames of calls from native code return here, which stops the VM.
+#define JIT_RETURN_PC (AQ_INT_MAX)
+
+extern int g_JIT_threshold; // -1 disables the JIT.
+
+aq_jit_code jit_lookup(char *buf, int addr);
+void jit_invalidate(int from);
+void jit_term();
+
+int jit_enter(char *buf, int pc);
+int jit_run(char *buf, int pc, int end);
+int jit_call(char *buf, int pc);
+int jit_tail_call(char *buf, int pc);
+int jit_ret();
+#endif
 
 #define ENVSIZE (3000)
-Cell env[ENVSIZE];
+extern Cell env[ENVSIZE];
 #define LINESIZE (1024)
 
 #define STACKSIZE (1024 * 1024)
-Cell stack[STACKSIZE];
-int stack_top;
+extern Cell stack[STACKSIZE];
+extern int stack_top;
 
 int hash(char *key);
+int get_global_slot(char *name);
 Cell get_var(char *name);
 void set_var(char *name, Cell c);
+void set_global(int slot, Cell c);
 
 void repl();
 
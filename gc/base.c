@@ -3,11 +3,13 @@
 
 #include "base.h"
 #include <string.h>
+#include <time.h>
 
 static void gc_write_barrier_default(Cell obj, Cell *cellp, Cell cell); //write barrier;
 static void gc_write_barrier_root_default(Cell *cellp, Cell cell);      //write barrier;
 static void gc_init_ptr_default(Cell *cellp, Cell cell);                //init pointer;
 static void gc_memcpy_default(char *dst, char *src, size_t size);       //memcpy;
+static aq_bool add_static_area(size_t size);                            //static area;
 
 Cell pop_arg_default();
 void push_arg_default(Cell c);
@@ -23,6 +25,9 @@ void gc_init_copy(aq_gc_info *gc_init);
 #define GC_STR_MARKCOMPACT "mc"
 void gc_init_markcompact(aq_gc_info *gc_info);
 
+#define GC_STR_COMPRESSOR "compressor"
+void gc_init_compressor(aq_gc_info *gc_info);
+
 #define GC_STR_GENERATIONAL "gen"
 void gc_init_generational(aq_gc_info *gc_info);
 
@@ -35,9 +40,24 @@ void gc_init_rc_zct(aq_gc_info *gc_info);
 #define GC_STR_MARK_SWEEP "ms"
 void gc_init_marksweep(aq_gc_info *gc_info);
 
+#define GC_STR_SNAPSHOT "snapshot"
+void gc_init_snapshot(aq_gc_info *gc_info);
+
+#define GC_STR_IMMIX "immix"
+void gc_init_immix(aq_gc_info *gc_info);
+
+char *aq_heap;
+static_area *aq_static_area = NULL;
+static static_area *static_last = NULL;
+static size_t static_area_size = 0;
+
 static char *_gc_char = "";
 static int heap_size = 0;
 
+// the clocks at the start of the current collection and at the end of the last one.
+static clock_t gc_start_clock = 0;
+static clock_t gc_end_clock = 0;
+
 // variable
 static void *(*_gc_malloc)(size_t size);
 static void (*_gc_start)();
@@ -61,6 +81,10 @@ void gc_init(char *gc_char, int h_size, aq_gc_info *gc_init)
 #endif
   heap_size = h_size;
   aq_heap = AQ_MALLOC(heap_size);
+  if (!aq_static_area && !add_static_area(STATIC_AREA_SIZE))
+  {
+    symbol_area_exhausted_error();
+  }
   if (strcmp(gc_char, GC_STR_COPYING) == 0)
   {
     gc_init_copy(gc_init);
@@ -71,6 +95,11 @@ void gc_init(char *gc_char, int h_size, aq_gc_info *gc_init)
     gc_init_markcompact(gc_init);
     _gc_char = GC_STR_MARKCOMPACT;
   }
+  else if (strcmp(gc_char, GC_STR_COMPRESSOR) == 0)
+  {
+    gc_init_compressor(gc_init);
+    _gc_char = GC_STR_COMPRESSOR;
+  }
   else if (strcmp(gc_char, GC_STR_GENERATIONAL) == 0)
   {
     gc_init_generational(gc_init);
@@ -92,6 +121,16 @@ void gc_init(char *gc_char, int h_size, aq_gc_info *gc_init)
     gc_init_marksweep(gc_init);
     _gc_char = GC_STR_MARK_SWEEP;
   }
+  else if (strcmp(gc_char, GC_STR_SNAPSHOT) == 0)
+  {
+    gc_init_snapshot(gc_init);
+    _gc_char = GC_STR_SNAPSHOT;
+  }
+  else if (strcmp(gc_char, GC_STR_IMMIX) == 0)
+  {
+    gc_init_immix(gc_init);
+    _gc_char = GC_STR_IMMIX;
+  }
   else
   {
     //default.
@@ -145,6 +184,67 @@ void gc_init(char *gc_char, int h_size, aq_gc_info *gc_init)
 void gc_term_base()
 {
   AQ_FREE(aq_heap);
+  while (aq_static_area)
+  {
+    static_area *area = aq_static_area;
+    aq_static_area = area->next;
+    AQ_FREE(area);
+  }
+  static_last = NULL;
+  static_area_size = 0;
+}
+
+// appends a chunk of size bytes to the static area.
+static aq_bool add_static_area(size_t size)
+{
+  static_area *area = NULL;
+  if (static_area_size + size > STATIC_AREA_MAX || (area = (static_area *)AQ_MALLOC(sizeof(static_area) + size)) == NULL)
+  {
+    return FALSE;
+  }
+  area->next = NULL;
+  area->start = area->top = (char *)(area + 1);
+  area->end = area->start + size;
+  if (static_last)
+  {
+    static_last->next = area;
+  }
+  else
+  {
+    aq_static_area = area;
+  }
+  static_last = area;
+  static_area_size += size;
+  return TRUE;
+}
+
+aq_bool static_cell_p(void *c)
+{
+  static_area *area;
+  for (area = aq_static_area->next; area; area = area->next)
+  {
+    if (IN_STATIC_AREA_P(area, c))
+    {
+      return TRUE;
+    }
+  }
+  return FALSE;
+}
+
+void *gc_malloc_static(size_t size)
+{
+  size = (size + sizeof(Cell) - 1) / sizeof(Cell) * sizeof(Cell);
+  if (static_last->top + size > static_last->end)
+  {
+    size_t area_size = (size_t)(static_last->end - static_last->start) * 2;
+    if (!add_static_area(area_size > size ? area_size : size))
+    {
+      symbol_area_exhausted_error();
+    }
+  }
+  void *ret = static_last->top;
+  static_last->top += size;
+  return ret;
 }
 
 Cell pop_arg_default()
@@ -165,17 +265,42 @@ void trace_roots(void (*trace)(Cell *cellp))
   while (scan > 0)
   {
     Cell *c = &stack[--scan];
-    if (CELL_P(*c))
+    if (HEAP_CELL_P(*c))
     {
       trace(c);
     }
   }
 
-  //trace env.
+  //trace global variables.
   int i;
   for (i = 0; i < ENVSIZE; i++)
   {
-    if (!UNDEF_P(env[i]))
+    if (HEAP_CELL_P(env[i]))
+    {
+      trace(&env[i]);
+    }
+  }
+}
+
+// traces the part-th of part_num equal slices of the stack and of the global variables,
+// so that each marking thread starts from its own roots.
+void trace_roots_part(int part, int part_num, void (*trace)(Cell *cellp))
+{
+  int scan = (int)((long long)stack_top * part / part_num);
+  int end = (int)((long long)stack_top * (part + 1) / part_num);
+  for (; scan < end; scan++)
+  {
+    if (HEAP_CELL_P(stack[scan]))
+    {
+      trace(&stack[scan]);
+    }
+  }
+
+  int i = (int)((long long)ENVSIZE * part / part_num);
+  end = (int)((long long)ENVSIZE * (part + 1) / part_num);
+  for (; i < end; i++)
+  {
+    if (HEAP_CELL_P(env[i]))
     {
       trace(&env[i]);
     }
@@ -193,11 +318,11 @@ void trace_object(Cell cell, void (*trace)(Cell *cellp))
     case T_STRING:
       break;
     case T_PAIR:
-      if (CELL_P(CAR(cell)))
+      if (HEAP_CELL_P(CAR(cell)))
       {
         trace(&(CAR(cell)));
       }
-      if (CELL_P(CDR(cell)))
+      if (HEAP_CELL_P(CDR(cell)))
       {
         trace(&(CDR(cell)));
       }
@@ -229,11 +354,11 @@ aq_bool trace_object_bool(Cell cell, aq_bool (*trace)(Cell *cellp))
     case T_STRING:
       break;
     case T_PAIR:
-      if (CELL_P(CAR(cell)) && trace(&(CAR(cell))))
+      if (HEAP_CELL_P(CAR(cell)) && trace(&(CAR(cell))))
       {
         return TRUE;
       }
-      if (CELL_P(CDR(cell)) && trace(&(CDR(cell))))
+      if (HEAP_CELL_P(CDR(cell)) && trace(&(CDR(cell))))
       {
         return TRUE;
       }
@@ -276,6 +401,98 @@ void gc_memcpy_default(char *dst, char *src, size_t size)
   memcpy(dst, src, size);
 }
 
+void mark_stack_init(gc_mark_stack *stack)
+{
+  stack->cells = (Cell *)AQ_MALLOC(sizeof(Cell) * MARK_STACK_INIT_SIZE);
+  stack->top = 0;
+  stack->size = MARK_STACK_INIT_SIZE;
+}
+
+void mark_stack_grow(gc_mark_stack *stack)
+{
+  Cell *cells = (Cell *)AQ_REALLOC(stack->cells, sizeof(Cell) * stack->size * 2);
+  if (!cells)
+  {
+    AQ_FPRINTF(stderr, "[GC] mark stack overflow\n");
+    exit(-1);
+  }
+  stack->cells = cells;
+  stack->size *= 2;
+}
+
+void mark_stack_term(gc_mark_stack *stack)
+{
+  AQ_FREE(stack->cells);
+  stack->cells = NULL;
+  stack->top = 0;
+  stack->size = 0;
+}
+
+// the bytes of the bitmap of a space of space_size bytes.
+size_t mark_bitmap_size(size_t space_size)
+{
+  size_t bits = (space_size + MARK_GRANULE - 1) / MARK_GRANULE;
+  return (bits + MARK_WORD_BITS - 1) / MARK_WORD_BITS * sizeof(mark_word);
+}
+
+// places a bitmap at the end of area; returns the size of the space it covers from the start of area.
+size_t mark_bitmap_init(mark_bitmap *bitmap, char *area, size_t area_size)
+{
+  // a bitmap word covers MARK_GRANULE * MARK_WORD_BITS bytes.
+  size_t unit = MARK_GRANULE * MARK_WORD_BITS;
+  size_t word_num = (area_size + unit + sizeof(mark_word) - 1) / (unit + sizeof(mark_word));
+  // a spare word for aligning the bitmap.
+  size_t space_size = (area_size - (word_num + 1) * sizeof(mark_word)) / MARK_GRANULE * MARK_GRANULE;
+  bitmap->words = (mark_word *)((size_t)(area + space_size + sizeof(mark_word) - 1) / sizeof(mark_word) * sizeof(mark_word));
+  bitmap->start = area;
+  bitmap->word_num = word_num;
+  mark_bitmap_clear(bitmap);
+  return space_size;
+}
+
+void mark_bitmap_clear(mark_bitmap *bitmap)
+{
+  memset(bitmap->words, 0, bitmap->word_num * sizeof(mark_word));
+}
+
+#if defined(__GNUC__) || defined(__clang__)
+#define CTZ(w) __builtin_ctzll(w)
+#else
+static int CTZ(mark_word w)
+{
+  int n = 0;
+  while (!(w & 1))
+  {
+    w >>= 1;
+    n++;
+  }
+  return n;
+}
+#endif
+
+// returns the first marked address in [from, end), or end.
+char *mark_bitmap_next(mark_bitmap *bitmap, char *from, char *end)
+{
+  size_t index = MARK_BITMAP_INDEX(bitmap, from);
+  size_t last = MARK_BITMAP_INDEX(bitmap, end);
+  size_t w = index / MARK_WORD_BITS;
+  if (index >= last)
+  {
+    return end;
+  }
+  mark_word word = bitmap->words[w] & (~(mark_word)0 << (index % MARK_WORD_BITS));
+  while (!word)
+  {
+    if (++w * MARK_WORD_BITS >= last)
+    {
+      return end;
+    }
+    word = bitmap->words[w];
+  }
+  index = w * MARK_WORD_BITS + CTZ(word);
+  return (index < last) ? bitmap->start + index * MARK_GRANULE : end;
+}
+
 free_chunk *aq_get_free_chunk(free_chunk **freelistp, size_t size)
 {
   //returns a chunk which size is larger than required size.
@@ -390,7 +607,64 @@ void *gc_malloc(size_t size)
 
 void gc_start()
 {
+  gc_start_clock = clock();
   _gc_start();
+  gc_end_clock = clock();
+}
+
+// the percentage of the time since the last collection that has been spent in this one.
+static int gc_time_percent()
+{
+  clock_t now = clock();
+  if (now <= gc_end_clock)
+  {
+    return 0;
+  }
+  return (int)((now - gc_start_clock) * 100 / (now - gc_end_clock));
+}
+
+// returns the size the heap should be resized to, or current_size to keep it.
+size_t gc_heap_target(size_t live_size, size_t current_size)
+{
+  size_t target = live_size * 100 / g_heap_live_ratio;
+  size_t max = (g_heap_max > (size_t)get_heap_size()) ? g_heap_max : (size_t)get_heap_size();
+
+  // forced collections say nothing about the time spent in GC.
+  if (!g_GC_stress && gc_time_percent() > g_GC_time_ratio && target < current_size * 2)
+  {
+    target = current_size * 2;
+  }
+  if (target < (size_t)get_heap_size())
+  {
+    target = get_heap_size();
+  }
+  // grows in steps of at least half the heap.
+  if (target > current_size && target < current_size + current_size / 2)
+  {
+    target = current_size + current_size / 2;
+  }
+  if (target > max)
+  {
+    target = max;
+  }
+
+  // small changes are not worth moving or mapping memory.
+  if (target > current_size || target < current_size / 2)
+  {
+    return target;
+  }
+  return current_size;
+}
+
+// memory added to a heap beyond aq_heap.
+char *gc_alloc_segment(size_t size)
+{
+  return AQ_MALLOC(size);
+}
+
+void gc_free_segment(char *segment)
+{
+  AQ_FREE(segment);
 }
 
 void gc_write_barrier(Cell cell, Cell *cellp, Cell newcell)
@@ -427,6 +701,14 @@ void push_arg(Cell c)
   }
 }
 
+// whether the stack is pushed and popped without the collector's hooks,
+// so that compiled code may touch it directly.
+aq_bool gc_plain_stack_p()
+{
+  return _push_arg == push_arg_default && _pop_arg == pop_arg_default &&
+         _gc_write_barrier_root == gc_write_barrier_root_default;
+}
+
 Cell pop_arg()
 {
   Cell c = _pop_arg();
@@ -444,6 +726,13 @@ void heap_exhausted_error()
   exit(-1);
 }
 
+void symbol_area_exhausted_error()
+{
+  set_error(ERR_SYMBOL_AREA_EXHAUSTED);
+  handle_error();
+  exit(-1);
+}
+
 #if defined(_DEBUG)
 size_t get_total_malloc_size()
 {
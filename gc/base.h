@@ -2,8 +2,11 @@
 #include <stdlib.h>
 
 #define HEAP_SIZE (16 * 1024)
+#define STATIC_AREA_SIZE (64 * 1024)
+#define STATIC_AREA_MAX (64 * 1024 * 1024)
 #define AQ_MALLOC  malloc
 #define AQ_FREE    free
+#define AQ_REALLOC realloc
 
 struct _free_chunk {
   int chunk_size;
@@ -11,7 +14,79 @@ struct _free_chunk {
 };
 typedef struct _free_chunk free_chunk;
 
+//side mark bitmap: a bit per MARK_GRANULE bytes of a space, set at the start of a live object.
+#define MARK_GRANULE (4)
+#define MARK_WORD_BITS (64)
+typedef unsigned long long mark_word;
+
+struct _mark_bitmap {
+  mark_word* words;
+  char* start;
+  size_t word_num;
+};
+typedef struct _mark_bitmap mark_bitmap;
+
+#define MARK_BITMAP_INDEX(bitmap, p) ((size_t)((char*)(p) - (bitmap)->start) / MARK_GRANULE)
+#define MARK_BITMAP_TEST(bitmap, p) (((bitmap)->words[MARK_BITMAP_INDEX(bitmap, p) / MARK_WORD_BITS] >> (MARK_BITMAP_INDEX(bitmap, p) % MARK_WORD_BITS)) & 1)
+#define MARK_BITMAP_SET(bitmap, p) ((bitmap)->words[MARK_BITMAP_INDEX(bitmap, p) / MARK_WORD_BITS] |= (mark_word)1 << (MARK_BITMAP_INDEX(bitmap, p) % MARK_WORD_BITS))
+
+size_t mark_bitmap_size(size_t space_size);
+size_t mark_bitmap_init(mark_bitmap* bitmap, char* area, size_t area_size);
+void mark_bitmap_clear(mark_bitmap* bitmap);
+char* mark_bitmap_next(mark_bitmap* bitmap, char* from, char* end);
+
+//collector threads (AQ_GC_THREADS) need pthreads and the GCC atomic builtins.
+#if defined(AQ_GC_THREADS)
+#define ATOMIC_LOAD(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define ATOMIC_STORE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define ATOMIC_FETCH_OR(p, v) __atomic_fetch_or((p), (v), __ATOMIC_RELAXED)
+#define ATOMIC_FETCH_ADD(p, v) __atomic_fetch_add((p), (v), __ATOMIC_RELAXED)
+#define MARK_BITMAP_TEST_AND_SET(bitmap, p) \
+  (!(ATOMIC_FETCH_OR(&(bitmap)->words[MARK_BITMAP_INDEX(bitmap, p) / MARK_WORD_BITS], \
+                     (mark_word)1 << (MARK_BITMAP_INDEX(bitmap, p) % MARK_WORD_BITS)) \
+     >> (MARK_BITMAP_INDEX(bitmap, p) % MARK_WORD_BITS) & 1))
+
+#define ATOMIC_CAS(p, expectedp, v) __atomic_compare_exchange_n((p), (expectedp), (v), 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+
+//parallel marking: g_GC_threads workers split the roots and mark from their own deques,
+//stealing from each other when they run out. mark claims *objp atomically, by setting its
+//mark bit or by copying it and updating *objp, and returns TRUE if this call claimed it;
+//the claimed object is then traced. gc_worker_index is the index of the calling worker.
+#define MAX_GC_THREADS (64)
+void parallel_mark(aq_bool (*mark)(Cell *objp));
+int gc_worker_index();
+void parallel_mark_term();
+#else
+#define ATOMIC_LOAD(p) (*(p))
+#define ATOMIC_STORE(p, v) (*(p) = (v))
+#endif
+
+//mark stack: allocated outside aq_heap, and doubled when it is full.
+#define MARK_STACK_INIT_SIZE (512)
+
+struct _gc_mark_stack {
+  Cell* cells;
+  int top;
+  int size;
+};
+typedef struct _gc_mark_stack gc_mark_stack;
+
+#define MARK_STACK_PUSH(stack, obj) \
+  do { \
+    if ((stack)->top >= (stack)->size) { \
+      mark_stack_grow(stack); \
+    } \
+    (stack)->cells[(stack)->top++] = (obj); \
+  } while (0)
+#define MARK_STACK_POP(stack) ((stack)->cells[--(stack)->top])
+#define MARK_STACK_EMPTY_P(stack) ((stack)->top == 0)
+
+void mark_stack_init(gc_mark_stack* stack);
+void mark_stack_grow(gc_mark_stack* stack);
+void mark_stack_term(gc_mark_stack* stack);
+
 void trace_roots(void (*trace) (Cell* cellp));
+void trace_roots_part(int part, int part_num, void (*trace) (Cell* cellp));
 void trace_object( Cell cell, void (*trace) (Cell* cellp) );
 aq_bool trace_object_bool( Cell cell, aq_bool (*trace) (Cell* cellp) );
 
@@ -23,6 +98,7 @@ void gc_term_base();
 free_chunk* aq_get_free_chunk( free_chunk** freelistp, size_t size );
 void put_chunk_to_freelist( free_chunk** freelistp, free_chunk* chunk, size_t size );
 void heap_exhausted_error();
+void symbol_area_exhausted_error();
 
 #if defined( _DEBUG )
 size_t get_total_malloc_size();
@@ -30,9 +106,43 @@ size_t get_total_malloc_size();
 
 int get_heap_size();
 
-char* aq_heap;
+//heap sizing policy: after a collection, a growable collector resizes its heap so that
+//live data fill g_heap_live_ratio percent of it, and at least doubles it while collections
+//take more than g_GC_time_ratio percent of the run time. g_heap_max bounds the heap.
+#define HEAP_MAX (64 * 1024 * 1024)
+#define HEAP_LIVE_RATIO (50)
+#define GC_TIME_RATIO (5)
+size_t gc_heap_target(size_t live_size, size_t current_size);
+char* gc_alloc_segment(size_t size);
+void gc_free_segment(char* segment);
+
+extern char* aq_heap;
+
+//static area: objects in it are never moved nor reclaimed, and collectors don't trace them.
+//it is a chain of chunks, from STATIC_AREA_SIZE bytes, each twice as large as the one before,
+//up to STATIC_AREA_MAX bytes in all.
+struct _static_area {
+  struct _static_area* next;
+  char* start;
+  char* top;
+  char* end;
+};
+typedef struct _static_area static_area;
+extern static_area* aq_static_area;
+#define IN_STATIC_AREA_P(area, c) ((area)->start <= (char*)(c) && (char*)(c) < (area)->end)
+#define STATIC_CELL_P(c) (IN_STATIC_AREA_P(aq_static_area, c) || (aq_static_area->next && static_cell_p(c)))
+aq_bool static_cell_p(void* c);
+#define HEAP_CELL_P(c) (CELL_P(c) && !STATIC_CELL_P(c))
+void* gc_malloc_static(size_t size);
 
 extern aq_bool g_GC_stress;
+extern aq_bool g_GC_lazy_sweep;
+extern aq_bool g_GC_incremental;
+extern aq_bool g_GC_depth_first;
+extern size_t g_heap_max;
+extern int g_heap_live_ratio;
+extern int g_GC_time_ratio;
+extern int g_GC_threads;
 extern void gc_init(char* gc_char, int heap_size, aq_gc_info* gc_init);
 
 extern void* gc_malloc(size_t size);
@@ -44,3 +154,4 @@ extern void gc_memcpy (char* dst, char* src, size_t size);
 extern void gc_term ();
 extern void push_arg (Cell c);
 extern Cell pop_arg ();
+extern aq_bool gc_plain_stack_p ();
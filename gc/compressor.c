@@ -0,0 +1,306 @@
+#include "base.h"
+#include <string.h>
+
+// a mark-compact collector in the style of the Compressor. the mark sets
+// the bit of every granule of a live object, so the live bytes below an
+// address are the popcount of the bitmap below it. a table of the live
+// bytes below each bitmap word turns that into a new address with one
+// popcount, so objects need no forwarding word, and the compaction moves
+// and updates the live objects in a single pass over the heap.
+struct _compressor_gc_header
+{
+  int obj_size;
+};
+typedef struct _compressor_gc_header compressor_gc_header;
+
+static void gc_start_compressor();
+static inline void *gc_malloc_compressor(size_t size);
+static void gc_term_compressor();
+
+static int heap_size = 0;
+
+#define MEMORY_ALIGNMENT (MARK_GRANULE)
+#define IS_ALLOCATABLE(size) (top + sizeof(compressor_gc_header) + (size) < heap + heap_size)
+#define GET_OBJECT_SIZE(obj) (((compressor_gc_header *)(obj)-1)->obj_size)
+
+static mark_bitmap mark_bits;
+#define IS_MARKED(obj) MARK_BITMAP_TEST(&mark_bits, (compressor_gc_header *)(obj)-1)
+#define NEXT_MARKED(p) mark_bitmap_next(&mark_bits, (p), top)
+
+// offsets[i] is the number of live bytes below the i-th word of the bitmap.
+static size_t *offsets = NULL;
+static size_t offset_num = 0;
+
+#if defined(__GNUC__) || defined(__clang__)
+#define POPCOUNT(w) __builtin_popcountll(w)
+#else
+static int POPCOUNT(mark_word w)
+{
+  int n = 0;
+  for (; w; w &= w - 1)
+  {
+    n++;
+  }
+  return n;
+}
+#endif
+
+static char *heap = NULL;
+static char *top = NULL;
+static char *new_top = NULL;
+
+// the heap starts as aq_heap. when the policy resizes it, the live
+// objects are compacted into a new segment of new_area_size bytes
+// instead of sliding in place.
+static size_t area_size = 0;
+static char *new_heap = NULL;
+static size_t new_area_size = 0;
+
+// the live bytes found by the mark, and the allocation that started the collection.
+static size_t live_size = 0;
+static size_t pending_size = 0;
+
+static gc_mark_stack mark_stack;
+
+static void set_live_bits(Cell obj, aq_bool atomic);
+static void mark_object(Cell *objp);
+#if defined(AQ_GC_THREADS)
+static aq_bool try_mark_object(Cell *objp);
+#endif
+static char *new_address(char *p);
+static void update(Cell *objp);
+static void resize_offsets();
+static void calc_offsets();
+static void compact();
+static void mark();
+
+// sets the bits of the granules after the header of obj; the header bit
+// has been set by the mark.
+void set_live_bits(Cell obj, aq_bool atomic)
+{
+  size_t from = MARK_BITMAP_INDEX(&mark_bits, obj);
+  size_t to = MARK_BITMAP_INDEX(&mark_bits, (char *)obj - sizeof(compressor_gc_header) + GET_OBJECT_SIZE(obj));
+  while (from < to)
+  {
+    size_t w = from / MARK_WORD_BITS;
+    size_t bit = from % MARK_WORD_BITS;
+    size_t num = MARK_WORD_BITS - bit < to - from ? MARK_WORD_BITS - bit : to - from;
+    mark_word mask = (num == MARK_WORD_BITS) ? ~(mark_word)0 : (((mark_word)1 << num) - 1) << bit;
+#if defined(AQ_GC_THREADS)
+    if (atomic)
+    {
+      ATOMIC_FETCH_OR(&mark_bits.words[w], mask);
+    }
+    else
+#endif
+    {
+      mark_bits.words[w] |= mask;
+    }
+    from += num;
+  }
+}
+
+void mark_object(Cell *objp)
+{
+  Cell obj = *objp;
+  if (obj && !IS_MARKED(obj))
+  {
+    MARK_BITMAP_SET(&mark_bits, (compressor_gc_header *)obj - 1);
+    set_live_bits(obj, FALSE);
+    live_size += GET_OBJECT_SIZE(obj);
+    MARK_STACK_PUSH(&mark_stack, obj);
+  }
+}
+
+#if defined(AQ_GC_THREADS)
+aq_bool try_mark_object(Cell *objp)
+{
+  Cell obj = *objp;
+  if (!MARK_BITMAP_TEST_AND_SET(&mark_bits, (compressor_gc_header *)obj - 1))
+  {
+    return FALSE;
+  }
+  set_live_bits(obj, TRUE);
+  ATOMIC_FETCH_ADD(&live_size, GET_OBJECT_SIZE(obj));
+  return TRUE;
+}
+#endif
+
+// the new address of a live address p: the live bytes below the word of
+// p, and those below p in the word.
+char *new_address(char *p)
+{
+  size_t index = MARK_BITMAP_INDEX(&mark_bits, p);
+  size_t w = index / MARK_WORD_BITS;
+  mark_word below = mark_bits.words[w] & (((mark_word)1 << (index % MARK_WORD_BITS)) - 1);
+  return new_heap + offsets[w] + POPCOUNT(below) * MARK_GRANULE;
+}
+
+void update(Cell *cellp)
+{
+  if (*cellp)
+  {
+    *cellp = (Cell)new_address((char *)*cellp);
+  }
+}
+
+void resize_offsets()
+{
+  size_t *new_offsets = (size_t *)AQ_REALLOC(offsets, mark_bits.word_num * sizeof(size_t));
+  if (!new_offsets)
+  {
+    heap_exhausted_error();
+  }
+  offsets = new_offsets;
+  offset_num = mark_bits.word_num;
+}
+
+// a pass over the bitmap, not the heap.
+void calc_offsets()
+{
+  size_t last = (MARK_BITMAP_INDEX(&mark_bits, top) + MARK_WORD_BITS - 1) / MARK_WORD_BITS;
+  size_t live = 0;
+  size_t w = 0;
+  last = last < offset_num ? last : offset_num;
+  for (w = 0; w < last; w++)
+  {
+    offsets[w] = live;
+    live += POPCOUNT(mark_bits.words[w]) * MARK_GRANULE;
+  }
+  new_top = new_heap + live;
+}
+
+// moves each live object to its new address and updates its fields there.
+// the new addresses only read the bitmap, which the moves do not touch.
+void compact()
+{
+  char *scanned = NULL;
+  int obj_size = 0;
+  calc_offsets();
+  trace_roots(update);
+  for (scanned = NEXT_MARKED(heap); scanned < top; scanned = NEXT_MARKED(scanned + obj_size))
+  {
+    Cell cell = (Cell)((compressor_gc_header *)scanned + 1);
+    char *dst = new_address(scanned);
+    obj_size = GET_OBJECT_SIZE(cell);
+    // the object may overlap its new place.
+    memmove(dst, scanned, obj_size);
+    trace_object((Cell)((compressor_gc_header *)dst + 1), update);
+  }
+  top = new_top;
+  if (new_heap == heap)
+  {
+    mark_bitmap_clear(&mark_bits);
+    return;
+  }
+  if (heap != aq_heap)
+  {
+    gc_free_segment(heap);
+  }
+  heap = new_heap;
+  area_size = new_area_size;
+  heap_size = mark_bitmap_init(&mark_bits, heap, area_size);
+  resize_offsets();
+}
+
+//Initialization.
+void gc_init_compressor(aq_gc_info *gc_info)
+{
+  //mark stack.
+  mark_stack_init(&mark_stack);
+
+  //heap, mark bitmap and offset table.
+  heap = aq_heap;
+  area_size = get_heap_size();
+  heap_size = mark_bitmap_init(&mark_bits, heap, area_size);
+  resize_offsets();
+  top = heap;
+
+  gc_info->gc_malloc = gc_malloc_compressor;
+  gc_info->gc_start = gc_start_compressor;
+  gc_info->gc_write_barrier = NULL;
+  gc_info->gc_init_ptr = NULL;
+  gc_info->gc_memcpy = NULL;
+  gc_info->gc_term = gc_term_compressor;
+}
+
+//Allocation.
+void *gc_malloc_compressor(size_t size)
+{
+  if (g_GC_stress || !IS_ALLOCATABLE(size))
+  {
+    pending_size = sizeof(compressor_gc_header) + size;
+    gc_start();
+    pending_size = 0;
+    if (!IS_ALLOCATABLE(size))
+    {
+      heap_exhausted_error();
+    }
+  }
+  compressor_gc_header *new_header = (compressor_gc_header *)top;
+  Cell ret = (Cell)(new_header + 1);
+  int allocate_size = (sizeof(compressor_gc_header) + size + MEMORY_ALIGNMENT - 1) / MEMORY_ALIGNMENT * MEMORY_ALIGNMENT;
+  top += allocate_size;
+  new_header->obj_size = allocate_size;
+  return ret;
+}
+
+//Start Garbage Collection.
+void mark()
+{
+#if defined(AQ_GC_THREADS)
+  if (g_GC_threads > 1)
+  {
+    parallel_mark(try_mark_object);
+    return;
+  }
+#endif
+
+  //mark root objects.
+  trace_roots(mark_object);
+
+  Cell obj = NULL;
+  while (!MARK_STACK_EMPTY_P(&mark_stack))
+  {
+    obj = MARK_STACK_POP(&mark_stack);
+    trace_object(obj, mark_object);
+  }
+}
+
+void gc_start_compressor()
+{
+  //initialization.
+  mark_stack.top = 0;
+  live_size = 0;
+
+  //mark phase.
+  mark();
+
+  //resizes the heap by the policy if the live objects fit.
+  new_heap = heap;
+  new_area_size = gc_heap_target(live_size + pending_size, area_size);
+  if (new_area_size != area_size && new_area_size - mark_bitmap_size(new_area_size) - sizeof(mark_word) * 2 > live_size + pending_size)
+  {
+    new_heap = gc_alloc_segment(new_area_size);
+    new_heap = new_heap ? new_heap : heap;
+  }
+
+  //compaction phase.
+  compact();
+}
+
+//term.
+void gc_term_compressor()
+{
+  if (heap != aq_heap)
+  {
+    gc_free_segment(heap);
+  }
+  AQ_FREE(offsets);
+  offsets = NULL;
+  offset_num = 0;
+  mark_stack_term(&mark_stack);
+#if defined(AQ_GC_THREADS)
+  parallel_mark_term();
+#endif
+}
@@ -15,17 +15,57 @@ static void gc_term_copy();
 static void *copy_object(Cell obj);
 static void copy_and_update(Cell *objp);
 
-#define IS_ALLOCATABLE(size) (top + sizeof(copy_header) + (size) < from_space + heap_size / 2)
+#define IS_ALLOCATABLE(size) (top + sizeof(copy_header) + (size) < from_space + space_size - COPY_RESERVE)
 #define GET_OBJECT_SIZE(obj) (((copy_header *)(obj)-1)->obj_size)
 
 #define FORWARDING(obj) (((copy_header *)(obj)-1)->forwarding)
-#define IS_COPIED(obj) (FORWARDING(obj) != (obj) || !(from_space <= (char *)(obj) && (char *)(obj) < from_space + heap_size / 2))
+#define IS_COPIED(obj) (FORWARDING(obj) != (obj) || !(from_space <= (char *)(obj) && (char *)(obj) < from_space + from_size))
 
 static char *from_space = NULL;
 static char *to_space = NULL;
 static char *top = NULL;
 
-static int heap_size = 0;
+// the semispaces start as the halves of aq_heap, and are replaced by
+// segments of space_size bytes when the heap is resized. from_size is
+// the size of the space being evacuated.
+static size_t space_size = 0;
+static size_t from_size = 0;
+static size_t to_size = 0;
+
+// the allocation that started the collection.
+static size_t pending_size = 0;
+
+static void copy_live_objects();
+static void resize_spaces(size_t size);
+static void copy_cdr_chain(Cell cell);
+
+#if defined(AQ_GC_THREADS)
+// parallel copying (-GC_THREADS n): the workers of parallel_mark claim an
+// object by a CAS of its forwarding pointer, copy it into a buffer of to
+// space of their own (PLAB), and scan the copies they made. the PLABs are
+// cut from to space at to_top, and their unused tails stay empty until
+// the next collection. objects of more than 1/8 of a PLAB are copied
+// outside PLABs, so that less than 1/8 of the copied bytes is wasted at
+// the end of a PLAB, and plab_size keeps the PLABs in use below 1/16 of
+// to space; the allocator leaves COPY_RESERVE bytes of from space for
+// these.
+#define PLAB_SIZE (1024)
+#define COPY_RESERVE ((g_GC_threads > 1) ? space_size / 4 : 0)
+
+struct _copy_plab
+{
+  char *top;
+  char *end;
+};
+typedef struct _copy_plab copy_plab;
+
+static copy_plab plabs[MAX_GC_THREADS];
+static size_t plab_size = PLAB_SIZE;
+static char *to_top = NULL;
+
+static char *plab_alloc(size_t size);
+static aq_bool claim_object(Cell *objp);
+#endif
 
 void *copy_object(Cell obj)
 {
@@ -54,18 +94,97 @@ void *copy_object(Cell obj)
   return new_cell;
 }
 
+// depth-first copy order (-GC_DEPTH_FIRST): the pairs of the CDR chain of
+// a copied pair are copied right behind it, so that the spine of a list
+// is contiguous in to space. the scan reaches them later as usual.
+void copy_cdr_chain(Cell cell)
+{
+  while (TYPE(cell) == T_PAIR && HEAP_CELL_P(CDR(cell)) && !IS_COPIED(CDR(cell)))
+  {
+    CDR(cell) = copy_object(CDR(cell));
+    cell = CDR(cell);
+  }
+}
+
 void copy_and_update(Cell *objp)
 {
   *objp = copy_object(*objp);
+  if (g_GC_depth_first && *objp)
+  {
+    copy_cdr_chain(*objp);
+  }
 }
 
+#if defined(AQ_GC_THREADS)
+char *plab_alloc(size_t size)
+{
+  copy_plab *plab = &plabs[gc_worker_index()];
+  if ((size_t)(plab->end - plab->top) >= size)
+  {
+    char *ret = plab->top;
+    plab->top += size;
+    return ret;
+  }
+
+  char *to_end = to_space + to_size;
+  char *old = ATOMIC_LOAD(&to_top);
+  size_t claim;
+  do
+  {
+    if ((size_t)(to_end - old) < size)
+    {
+      heap_exhausted_error();
+    }
+    claim = (size > plab_size / 8) ? size : plab_size;
+    claim = ((size_t)(to_end - old) < claim) ? (size_t)(to_end - old) : claim;
+  } while (!ATOMIC_CAS(&to_top, &old, old + claim));
+  if (claim > size)
+  {
+    plab->top = old + size;
+    plab->end = old + claim;
+  }
+  return old;
+}
+
+// copies *objp unless another worker has claimed it, and updates *objp.
+aq_bool claim_object(Cell *objp)
+{
+  Cell obj = *objp;
+  Cell forwarding = ATOMIC_LOAD(&FORWARDING(obj));
+  if (forwarding != obj || !(from_space <= (char *)obj && (char *)obj < from_space + from_size))
+  {
+    *objp = forwarding;
+    return FALSE;
+  }
+
+  // the space is taken before the CAS, and given back if it fails.
+  long size = GET_OBJECT_SIZE(obj);
+  copy_header *new_header = (copy_header *)plab_alloc(size);
+  Cell new_cell = (Cell)(new_header + 1);
+  if (!ATOMIC_CAS(&FORWARDING(obj), &forwarding, new_cell))
+  {
+    copy_plab *plab = &plabs[gc_worker_index()];
+    if (plab->top == (char *)new_header + size)
+    {
+      plab->top -= size;
+    }
+    *objp = forwarding;
+    return FALSE;
+  }
+  memcpy(new_header, (copy_header *)obj - 1, size);
+  FORWARDING(new_cell) = new_cell;
+  *objp = new_cell;
+  return TRUE;
+}
+#endif
+
 //Initialization.
 void gc_init_copy(aq_gc_info *gc_info)
 {
-  heap_size = get_heap_size();
+  space_size = from_size = to_size = get_heap_size() / 2;
 
   from_space = aq_heap;
-  to_space = aq_heap + heap_size / 2;
+  to_space = aq_heap + space_size;
   top = from_space;
 
   gc_info->gc_malloc = gc_malloc_copy;
@@ -81,7 +200,9 @@ void *gc_malloc_copy(size_t size)
 {
   if (g_GC_stress || !IS_ALLOCATABLE(size))
   {
+    pending_size = size + sizeof(copy_header);
     gc_start();
+    pending_size = 0;
     if (!IS_ALLOCATABLE(size))
     {
       heap_exhausted_error();
@@ -96,28 +217,98 @@ void *gc_malloc_copy(size_t size)
   return ret;
 }
 
-//Start Garbage Collection.
-void gc_start_copy()
+static void free_space(char *space)
 {
-  top = to_space;
+  if (space < aq_heap || aq_heap + get_heap_size() <= space)
+  {
+    gc_free_segment(space);
+  }
+}
 
-  //Copy all objects that are reachable from roots.
-  trace_roots(copy_and_update);
+void copy_live_objects()
+{
+  top = to_space;
 
-  //Trace all objects that are in to space but not scanned.
-  char *scanned = to_space;
-  while (scanned < top)
+#if defined(AQ_GC_THREADS)
+  if (g_GC_threads > 1)
+  {
+    to_top = to_space;
+    memset(plabs, 0, sizeof(plabs));
+    plab_size = to_size / 16 / g_GC_threads;
+    plab_size = (plab_size < PLAB_SIZE) ? plab_size / sizeof(Cell) * sizeof(Cell) : PLAB_SIZE;
+    parallel_mark(claim_object);
+    top = to_top;
+  }
+  else
+#endif
   {
-    Cell cell = (Cell)(((copy_header *)scanned) + 1);
-    trace_object(cell, copy_and_update);
-    scanned += GET_OBJECT_SIZE(cell);
+    //Copy all objects that are reachable from roots.
+    trace_roots(copy_and_update);
+
+    //Trace all objects that are in to space but not scanned.
+    char *scanned = to_space;
+    while (scanned < top)
+    {
+      Cell cell = (Cell)(((copy_header *)scanned) + 1);
+      trace_object(cell, copy_and_update);
+      scanned += GET_OBJECT_SIZE(cell);
+    }
   }
 
   //swap from space and to space.
-  void *tmp = from_space;
+  char *tmp = from_space;
   from_space = to_space;
   to_space = tmp;
+  size_t tmp_size = from_size;
+  from_size = to_size;
+  to_size = tmp_size;
+}
+
+// moves the live objects to a space of size bytes, and makes the other
+// space as large.
+void resize_spaces(size_t size)
+{
+  char *space = gc_alloc_segment(size);
+  if (!space)
+  {
+    return;
+  }
+  free_space(to_space);
+  to_space = space;
+  to_size = size;
+  copy_live_objects();
+
+  free_space(to_space);
+  to_space = gc_alloc_segment(size);
+  to_size = size;
+  space_size = size;
+  if (!to_space)
+  {
+    heap_exhausted_error();
+  }
+}
+
+//Start Garbage Collection.
+void gc_start_copy()
+{
+  copy_live_objects();
+
+  // resizes the heap by the policy at the cost of copying again. the
+  // live objects are counted twice for the space they are copied to.
+  size_t target = gc_heap_target((top - from_space + pending_size) * 2, space_size * 2) / 2;
+  target = target / sizeof(Cell) * sizeof(Cell);
+  if (target != space_size && target >= top - from_space + pending_size)
+  {
+    resize_spaces(target);
+  }
 }
 
 //term.
-void gc_term_copy() {}
+void gc_term_copy()
+{
+  free_space(from_space);
+  free_space(to_space);
+#if defined(AQ_GC_THREADS)
+  parallel_mark_term();
+#endif
+}
@@ -1,5 +1,6 @@
 #include "base.h"
 #include <string.h>
+#include <time.h>
 
 struct _generational_gc_header
 {
@@ -9,11 +10,23 @@ struct _generational_gc_header
 };
 typedef struct _generational_gc_header generational_gc_header;
 
-#define TENURING_THRESHOLD (15)
+#define MAX_TENURING_THRESHOLD (15)
 #define NERSARY_SIZE_RATIO (5)
 
+//adaptive nersary: minor GC resizes the part of the semispaces in use
+//(nersary_limit) within their size. it shrinks when a minor GC pauses
+//longer than MINOR_GC_PAUSE_TARGET, and grows while less than
+//LOW_SURVIVAL_RATE percent of the nersary survives.
+#define MINOR_GC_PAUSE_TARGET (CLOCKS_PER_SEC / 1000)
+#define LOW_SURVIVAL_RATE (20)
+#define MIN_NERSARY_SIZE (1024)
+
+//adaptive tenuring: the threshold is the youngest age at which the
+//survivors of that age and younger overflow TARGET_SURVIVOR_RATIO
+//percent of the nersary.
+#define TARGET_SURVIVOR_RATIO (50)
+
 #define MASK_OBJ_AGE (0x000000FF)
-#define MASK_REMEMBERED_BIT (1 << 8)
 #define MASK_TENURED_BIT (1 << 9)
 
 #define OBJ_HEADER(obj) ((generational_gc_header *)(obj)-1)
@@ -24,12 +37,8 @@ typedef struct _generational_gc_header generational_gc_header;
 
 #define OBJ_FLAGS(obj) ((OBJ_HEADER(obj))->flags)
 
-#define IS_REMEMBERED(obj) (OBJ_FLAGS(obj) & MASK_REMEMBERED_BIT)
-#define SET_REMEMBERED(obj) (OBJ_FLAGS(obj) |= MASK_REMEMBERED_BIT)
-#define CLEAR_REMEMBERED(obj) (OBJ_FLAGS(obj) &= ~MASK_REMEMBERED_BIT)
-
 #define AGE(obj) (OBJ_FLAGS(obj) & MASK_OBJ_AGE)
-#define IS_OLD(obj) (AGE(obj) >= TENURING_THRESHOLD)
+#define IS_OLD(obj) (AGE(obj) >= tenuring_threshold)
 #define INC_AGE(obj) (OBJ_FLAGS(obj)++)
 
 //mark table: a bit per WORD
@@ -45,6 +54,13 @@ static int *tenured_mark_tbl = NULL;
 #define SET_MARK_NERSARY(obj) (nersary_mark_tbl[(((char *)(obj)-from_space) / BIT_WIDTH)] |= (1 << (((char *)(obj)-from_space) % BIT_WIDTH)))
 #define SET_MARK(obj) (IS_TENURED(obj) ? SET_MARK_TENURED(obj) : SET_MARK_NERSARY(obj))
 
+#if defined(AQ_GC_THREADS)
+// sets the mark atomically and is true if it was not set before.
+#define TEST_AND_SET_MARK_IN(tbl, space, obj) \
+  (!(ATOMIC_FETCH_OR(&(tbl)[((char *)(obj) - (space)) / BIT_WIDTH], 1 << (((char *)(obj) - (space)) % BIT_WIDTH)) & (1 << (((char *)(obj) - (space)) % BIT_WIDTH))))
+#define TEST_AND_SET_MARK(obj) (IS_TENURED(obj) ? TEST_AND_SET_MARK_IN(tenured_mark_tbl, tenured_space, obj) : TEST_AND_SET_MARK_IN(nersary_mark_tbl, from_space, obj))
+#endif
+
 static void gc_start_generational();
 static void minor_gc();
 static void major_gc();
@@ -54,6 +70,7 @@ static void gc_term_generational();
 
 static void *copy_object(Cell obj);
 static void copy_and_update(Cell *objp);
+static void copy_cdr_chain(Cell cell);
 static aq_bool is_nersary_obj(Cell *objp);
 
 //nersary space.
@@ -65,12 +82,24 @@ static char *nersary_top = NULL;
 static char *tenured_space = NULL;
 static char *tenured_top = NULL;
 
-//remembered set.
-#define REMEMBERED_SET_SIZE 100
-static Cell *remembered_set = NULL;
-static int remembered_set_top = 0;
-static void add_remembered_set(Cell obj);
-static void clean_remembered_set();
+//card table: a byte per CARD_SIZE bytes of tenured space, dirtied when
+//an object whose header is in the card is written. minor GC scans the
+//objects of dirty cards as roots, and keeps a card dirty while one of
+//its objects points into the nersary. card_first holds the offset of
+//the first object header in each card.
+#define CARD_SHIFT (7)
+#define CARD_SIZE (1 << CARD_SHIFT)
+#define CARD_CLEAN (0)
+#define CARD_DIRTY (1)
+#define NO_OBJECT (0xFF)
+#define CARD_INDEX(p) ((size_t)((char *)(p)-tenured_space) >> CARD_SHIFT)
+#define CARD_START(index) (tenured_space + ((size_t)(index) << CARD_SHIFT))
+#define DIRTY_CARD(obj) (card_table[CARD_INDEX(OBJ_HEADER(obj))] = CARD_DIRTY)
+static unsigned char *card_table = NULL;
+static unsigned char *card_first = NULL;
+static int card_num = 0;
+static void record_object_start(char *header);
+static void scan_dirty_cards(char *end);
 static void gc_write_barrier_generational(Cell obj, Cell *cellp, Cell newcell);
 
 //size of each heap.
@@ -81,19 +110,28 @@ static int tenured_size = 0;
 static int tenured_heap_size = 0;
 static int tenured_tbl_size = 0;
 
-#define IS_ALLOCATABLE_NERSARY(size) (nersary_top + sizeof(generational_gc_header) + (size) < from_space + nersary_heap_size)
+#define IS_ALLOCATABLE_NERSARY(size) (nersary_top + sizeof(generational_gc_header) + (size) < from_space + nersary_limit)
 #define GET_OBJECT_SIZE(obj) (((generational_gc_header *)(obj)-1)->obj_size)
 
 #define FORWARDING(obj) (((generational_gc_header *)(obj)-1)->forwarding)
 
 #define IS_COPIED(obj) (FORWARDING(obj) != (obj))
-#define IS_ALLOCATABLE_TENURED() (tenured_top + nersary_heap_size < tenured_space + tenured_heap_size)
+#define IN_TO_SPACE(obj) (to_space <= (char *)(obj) && (char *)(obj) < to_space + nersary_heap_size)
+#define IS_ALLOCATABLE_TENURED() (tenured_top + nersary_limit < tenured_space + tenured_heap_size)
+
+//adaptive policies.
+static int nersary_limit = 0;
+static int tenuring_threshold = MAX_TENURING_THRESHOLD;
+static size_t age_table[MAX_TENURING_THRESHOLD + 1];
+static void adapt_nersary(size_t used_size, size_t survived_size, clock_t pause);
+static void adapt_tenuring();
 
-#define MARK_STACK_SIZE 1000
-static int mark_stack_top;
-static Cell mark_stack[MARK_STACK_SIZE];
+static gc_mark_stack mark_stack;
 
 static void mark_object(Cell *objp);
+#if defined(AQ_GC_THREADS)
+static aq_bool try_mark_object(Cell *objp);
+#endif
 static void move_object(Cell obj);
 static void update_forwarding(Cell *objp);
 static void calc_new_address();
@@ -109,19 +147,28 @@ void gc_init_generational(aq_gc_info *gc_info)
   int rest_size = get_heap_size();
   int byte_count = BIT_WIDTH / size_int;
 
-  //remembered set.
-  int remembered_set_size = sizeof(Cell) * REMEMBERED_SET_SIZE;
-  remembered_set = (Cell *)aq_heap;
-  rest_size -= remembered_set_size;
+  //card table: the cards cover at most the rest of the heap.
+  card_num = rest_size / CARD_SIZE + 1;
+  int card_table_size = ((card_num * 2 + sizeof(Cell) - 1) / sizeof(Cell)) * sizeof(Cell);
+  card_table = (unsigned char *)aq_heap;
+  card_first = card_table + card_num;
+  memset(card_table, CARD_CLEAN, card_num);
+  memset(card_first, NO_OBJECT, card_num);
+  rest_size -= card_table_size;
 
   //nersary space.
   nersary_size = rest_size / NERSARY_SIZE_RATIO;
   nersary_tbl_size = (nersary_size / 2) / byte_count;
   nersary_tbl_size = (((nersary_tbl_size + size_int - 1) / size_int) * size_int);
   nersary_heap_size = (nersary_size - nersary_tbl_size) / 2;
-  from_space = aq_heap + remembered_set_size;
+  //an allocation rounded up must not reach into the next space.
+  nersary_heap_size = nersary_heap_size / sizeof(Cell) * sizeof(Cell);
+  from_space = aq_heap + card_table_size;
   to_space = from_space + nersary_heap_size;
   nersary_top = from_space;
+  nersary_limit = nersary_heap_size / 2;
+  nersary_limit = (nersary_limit < MIN_NERSARY_SIZE) ? nersary_heap_size : nersary_limit;
+  tenuring_threshold = MAX_TENURING_THRESHOLD;
 
   nersary_mark_tbl = (int *)(to_space + nersary_heap_size);
   rest_size -= nersary_size;
@@ -138,6 +185,9 @@ void gc_init_generational(aq_gc_info *gc_info)
   memset(nersary_mark_tbl, 0, nersary_tbl_size);
   memset(tenured_mark_tbl, 0, tenured_tbl_size);
 
+  //mark stack.
+  mark_stack_init(&mark_stack);
+
   gc_info->gc_malloc = gc_malloc_generational;
   gc_info->gc_start = gc_start_generational;
   gc_info->gc_term = gc_term_generational;
@@ -152,7 +202,16 @@ void *gc_malloc_generational(size_t size)
   if (g_GC_stress || !IS_ALLOCATABLE_NERSARY(size))
   {
     gc_start();
-    if (!IS_ALLOCATABLE_NERSARY(size))
+    if (!IS_ALLOCATABLE_NERSARY(size) && nersary_limit < nersary_heap_size)
+    {
+      //an object larger than the nersary in use.
+      nersary_limit = nersary_heap_size;
+      if (!IS_ALLOCATABLE_TENURED())
+      {
+        major_gc();
+      }
+    }
+    if (!IS_ALLOCATABLE_NERSARY(size) || !IS_ALLOCATABLE_TENURED())
     {
       heap_exhausted_error();
     }
@@ -184,6 +243,11 @@ void gc_start_generational()
 /**** for Minor GC ****/
 void minor_gc()
 {
+  clock_t start = clock();
+  size_t used_size = nersary_top - from_space;
+  char *tenured_start = tenured_top;
+  memset(age_table, 0, sizeof(age_table));
+
   nersary_top = to_space;
   char *prev_nersary_top = nersary_top;
   char *prev_tenured_top = tenured_top;
@@ -191,13 +255,8 @@ void minor_gc()
   //copy all objects that are reachable from roots.
   trace_roots(copy_and_update);
 
-  //scan remembered set.
-  int rem_index;
-  for (rem_index = 0; rem_index < remembered_set_top; rem_index++)
-  {
-    Cell cell = remembered_set[rem_index];
-    trace_object(cell, copy_and_update);
-  }
+  //scan the objects of dirty cards, but not the objects promoted by this collection.
+  scan_dirty_cards(prev_tenured_top);
 
   while (prev_nersary_top < nersary_top || prev_tenured_top < tenured_top)
   {
@@ -219,9 +278,9 @@ void minor_gc()
       Cell obj = (Cell)((generational_gc_header *)scan + 1);
       int obj_size = GET_OBJECT_SIZE(obj);
       trace_object(obj, copy_and_update);
-      if (trace_object_bool(obj, is_nersary_obj) && !IS_REMEMBERED(obj))
+      if (trace_object_bool(obj, is_nersary_obj))
       {
-        add_remembered_set(obj);
+        DIRTY_CARD(obj);
       }
       scan += obj_size;
     }
@@ -232,50 +291,93 @@ void minor_gc()
   void *tmp = from_space;
   from_space = to_space;
   to_space = tmp;
+
+  adapt_tenuring();
+  adapt_nersary(used_size, (nersary_top - from_space) + (tenured_top - tenured_start), clock() - start);
 }
 
-void clean_remembered_set()
+void adapt_nersary(size_t used_size, size_t survived_size, clock_t pause)
 {
-  int rem_index;
-  int remembered_set_top_new = 0;
-  for (rem_index = 0; rem_index < remembered_set_top; rem_index++)
+  // forced collections say nothing about the survival rate.
+  if (g_GC_stress || used_size == 0)
   {
-    Cell cell = remembered_set[rem_index];
-    if (trace_object_bool(cell, is_nersary_obj))
-    {
-      remembered_set[remembered_set_top_new++] = cell;
-      SET_REMEMBERED(cell);
-    }
-    else
+    return;
+  }
+  int limit = nersary_limit;
+  if (pause > MINOR_GC_PAUSE_TARGET)
+  {
+    limit -= limit / 4;
+  }
+  else if (survived_size * 100 < used_size * LOW_SURVIVAL_RATE)
+  {
+    limit += limit / 4;
+  }
+  limit = (limit < MIN_NERSARY_SIZE) ? MIN_NERSARY_SIZE : limit;
+  limit = (limit > nersary_heap_size) ? nersary_heap_size : limit;
+  //the survivors must stay in the nersary in use.
+  if (limit > nersary_top - from_space)
+  {
+    nersary_limit = limit / sizeof(Cell) * sizeof(Cell);
+  }
+}
+
+void adapt_tenuring()
+{
+  size_t desired_size = (size_t)nersary_limit * TARGET_SURVIVOR_RATIO / 100;
+  size_t total = 0;
+  int age;
+  for (age = 1; age < MAX_TENURING_THRESHOLD; age++)
+  {
+    total += age_table[age];
+    if (total > desired_size)
     {
-      CLEAR_REMEMBERED(cell);
+      break;
     }
   }
+  tenuring_threshold = age;
+}
 
-  remembered_set_top = remembered_set_top_new;
+void record_object_start(char *header)
+{
+  size_t index = CARD_INDEX(header);
+  if (card_first[index] == NO_OBJECT)
+  {
+    card_first[index] = (unsigned char)(header - CARD_START(index));
+  }
 }
 
-inline void add_remembered_set(Cell obj)
+void scan_dirty_cards(char *end)
 {
-  if (remembered_set_top >= REMEMBERED_SET_SIZE)
+  size_t index;
+  size_t last = (end > tenured_space) ? CARD_INDEX(end - 1) : 0;
+  for (index = 0; end > tenured_space && index <= last; index++)
   {
-    clean_remembered_set();
-    if (remembered_set_top >= REMEMBERED_SET_SIZE)
+    if (card_table[index] == CARD_CLEAN || card_first[index] == NO_OBJECT)
+    {
+      continue;
+    }
+    card_table[index] = CARD_CLEAN;
+    char *card_end = CARD_START(index + 1);
+    char *scan = CARD_START(index) + card_first[index];
+    while (scan < card_end && scan < end)
     {
-      AQ_FPRINTF(stderr, "remembered set full\n");
-      exit(-1);
+      Cell obj = (Cell)((generational_gc_header *)scan + 1);
+      trace_object(obj, copy_and_update);
+      if (trace_object_bool(obj, is_nersary_obj))
+      {
+        card_table[index] = CARD_DIRTY;
+      }
+      scan += GET_OBJECT_SIZE(obj);
     }
   }
-
-  remembered_set[remembered_set_top++] = obj;
-  SET_REMEMBERED(obj);
 }
 
 void gc_write_barrier_generational(Cell obj, Cell *cellp, Cell newcell)
 {
-  if (IS_TENURED(obj) && IS_NERSARY(newcell) && !IS_REMEMBERED(obj))
+  // an address check instead of reading the header of obj.
+  if ((size_t)((char *)obj - tenured_space) < (size_t)(tenured_top - tenured_space))
   {
-    add_remembered_set(obj);
+    DIRTY_CARD(obj);
   }
   *cellp = newcell;
 }
@@ -286,9 +388,31 @@ void copy_and_update(Cell *objp)
   {
     *objp = FORWARDING(*objp);
   }
-  else
+  else if (!IN_TO_SPACE(*objp))
   {
     *objp = copy_object(*objp);
+    if (g_GC_depth_first)
+    {
+      copy_cdr_chain(*objp);
+    }
+  }
+}
+
+// depth-first copy order (-GC_DEPTH_FIRST): the nersary pairs of the CDR
+// chain of a copied pair are copied right behind it, so the copies can
+// point into to space. a promoted pair gets its card dirtied by the scan
+// of the promoted objects.
+void copy_cdr_chain(Cell cell)
+{
+  while (TYPE(cell) == T_PAIR && HEAP_CELL_P(CDR(cell)))
+  {
+    Cell cdr = CDR(cell);
+    if (IS_COPIED(cdr) || IS_TENURED(cdr) || IN_TO_SPACE(cdr))
+    {
+      break;
+    }
+    CDR(cell) = copy_object(cdr);
+    cell = CDR(cell);
   }
 }
 
@@ -316,6 +440,7 @@ void *copy_object(Cell obj)
   {
     //Promotion.
     new_header = (generational_gc_header *)tenured_top;
+    record_object_start(tenured_top);
     tenured_top += size;
     SET_TENURED(obj);
   }
@@ -323,6 +448,7 @@ void *copy_object(Cell obj)
   {
     new_header = (generational_gc_header *)nersary_top;
     nersary_top += size;
+    age_table[AGE(obj)] += size;
   }
   generational_gc_header *old_header = ((generational_gc_header *)obj) - 1;
   memcpy(new_header, old_header, size);
@@ -341,29 +467,29 @@ void mark_object(Cell *objp)
   if (obj && !IS_MARKED(obj))
   {
     SET_MARK(obj);
-    if (mark_stack_top >= MARK_STACK_SIZE)
-    {
-      AQ_FPRINTF(stderr, "[GC] mark stack overflow\n");
-      exit(-1);
-    }
-    mark_stack[mark_stack_top++] = obj;
+    MARK_STACK_PUSH(&mark_stack, obj);
   }
 }
 
+#if defined(AQ_GC_THREADS)
+aq_bool try_mark_object(Cell *objp)
+{
+  Cell obj = *objp;
+  return TEST_AND_SET_MARK(obj) ? TRUE : FALSE;
+}
+#endif
+
 void move_object(Cell obj)
 {
   long size = GET_OBJECT_SIZE(obj);
   generational_gc_header *new_header = (generational_gc_header *)FORWARDING(obj) - 1;
   generational_gc_header *old_header = (generational_gc_header *)obj - 1;
 
-  memcpy(new_header, old_header, size);
+  memmove(new_header, old_header, size);
   Cell new_cell = (Cell)(((generational_gc_header *)new_header) + 1);
 
   FORWARDING(new_cell) = new_cell;
-  if (IS_REMEMBERED(new_cell))
-  {
-    add_remembered_set(new_cell);
-  }
+  record_object_start((char *)new_header);
 }
 
 void update_forwarding(Cell *cellp)
@@ -410,16 +536,8 @@ void update_pointer()
       trace_object(cell, update_forwarding);
       if (trace_object_bool(cell, is_nersary_obj))
       {
-        if (remembered_set_top >= REMEMBERED_SET_SIZE)
-        {
-          AQ_FPRINTF(stderr, "remembered set full\n");
-          exit(-1);
-        }
-        SET_REMEMBERED(cell);
-      }
-      else
-      {
-        CLEAR_REMEMBERED(cell);
+        //the card of the new address.
+        DIRTY_CARD(FORWARDING(cell));
       }
     }
     scanned += obj_size;
@@ -441,7 +559,8 @@ void slide()
   Cell cell = NULL;
   int obj_size = 0;
 
-  //scan tenured space.
+  //scan tenured space, recording the new object starts.
+  memset(card_first, NO_OBJECT, card_num);
   char *tenured_new_top = tenured_space;
   while (scanned < tenured_top)
   {
@@ -457,20 +576,28 @@ void slide()
   tenured_top = tenured_new_top;
 
   //clear mark bit in young objects.
-  memset(nersary_mark_tbl, 0, sizeof(int) * nersary_tbl_size);
-  memset(tenured_mark_tbl, 0, sizeof(int) * tenured_tbl_size);
+  memset(nersary_mark_tbl, 0, nersary_tbl_size);
+  memset(tenured_mark_tbl, 0, tenured_tbl_size);
 }
 
 //Start Garbage Collection.
 void mark()
 {
+#if defined(AQ_GC_THREADS)
+  if (g_GC_threads > 1)
+  {
+    parallel_mark(try_mark_object);
+    return;
+  }
+#endif
+
   //mark root objects.
   trace_roots(mark_object);
 
   Cell obj = NULL;
-  while (mark_stack_top > 0)
+  while (!MARK_STACK_EMPTY_P(&mark_stack))
   {
-    obj = mark_stack[--mark_stack_top];
+    obj = MARK_STACK_POP(&mark_stack);
     trace_object(obj, mark_object);
   }
 }
@@ -485,8 +612,8 @@ void compact()
 void major_gc()
 {
   //initialization.
-  mark_stack_top = 0;
-  remembered_set_top = 0;
+  mark_stack.top = 0;
+  memset(card_table, CARD_CLEAN, card_num);
 
   //mark phase.
   mark();
@@ -495,4 +622,10 @@ void major_gc()
   compact();
 }
 
-void gc_term_generational() {}
+void gc_term_generational()
+{
+  mark_stack_term(&mark_stack);
+#if defined(AQ_GC_THREADS)
+  parallel_mark_term();
+#endif
+}
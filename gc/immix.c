@@ -0,0 +1,566 @@
+#include "base.h"
+#include <string.h>
+
+// a mark-region collector in the style of Immix. the heap is a list of
+// blocks of lines. the allocator bumps through the holes, runs of free
+// lines, of the recyclable blocks and then through free blocks, and the
+// mark marks the lines a live object covers. the sweep only counts the
+// marked lines of each block. a collection evacuates the live objects of
+// fragmented blocks into free blocks while it marks, as long as free
+// blocks are left; the others are marked in place.
+struct _immix_gc_header
+{
+  int obj_size;
+};
+typedef struct _immix_gc_header immix_gc_header;
+
+#define MEMORY_ALIGNMENT (MARK_GRANULE)
+#define GET_OBJECT_SIZE(obj) (((immix_gc_header *)(obj)-1)->obj_size)
+
+#define LINE_SIZE (128)
+#define LINE_NUM (32)
+#define BLOCK_SIZE (LINE_SIZE * LINE_NUM)
+
+#define BLOCK_FREE (0)        // no live line; in free_blocks.
+#define BLOCK_RECYCLABLE (1)  // has holes the allocator has not used.
+#define BLOCK_FULL (2)        // no hole.
+#define BLOCK_IN_USE (3)      // taken by the allocator.
+
+// blocks are aligned to BLOCK_SIZE, and their first lines keep this
+// header: the marks of the objects and of the lines, and the holes and
+// live lines the last sweep found.
+struct _immix_block
+{
+  struct _immix_block *next;
+  struct _immix_block *next_free;
+  int state;
+  int holes;
+  int live_lines;
+  aq_bool evacuate;
+  mark_bitmap mark_bits;
+  mark_word mark_words[BLOCK_SIZE / MARK_GRANULE / MARK_WORD_BITS];
+  char line_marks[LINE_NUM];
+};
+typedef struct _immix_block immix_block;
+
+#define HEADER_LINES ((int)((sizeof(immix_block) + LINE_SIZE - 1) / LINE_SIZE))
+#define BLOCK_DATA_SIZE ((LINE_NUM - HEADER_LINES) * LINE_SIZE)
+#define BLOCK_OF(p) ((immix_block *)((size_t)(p) & ~(size_t)(BLOCK_SIZE - 1)))
+#define LINE_OF(block, p) ((int)(((char *)(p) - (char *)(block)) / LINE_SIZE))
+#define LINE_ADDRESS(block, line) ((char *)(block) + (line)*LINE_SIZE)
+
+// objects of LARGE_OBJECT_SIZE bytes or more are allocated one by one
+// out of the blocks, and are freed by the sweep when unmarked.
+#define LARGE_OBJECT_SIZE (BLOCK_SIZE / 4)
+struct _large_object
+{
+  struct _large_object *next;
+  size_t marked;
+};
+typedef struct _large_object large_object;
+#define IS_LARGE(obj) (GET_OBJECT_SIZE(obj) >= LARGE_OBJECT_SIZE)
+#define LARGE_OBJECT_OF(obj) ((large_object *)((immix_gc_header *)(obj)-1) - 1)
+
+// a block with at least this many holes is evacuated. the allocator
+// leaves RESERVE_BLOCKS free blocks for the evacuation, and only takes
+// them when a collection has not made room for an allocation.
+#define EVACUATE_HOLES (2)
+#define RESERVE_BLOCKS (block_num / 32 + 1)
+
+// an evacuated object keeps its new address in its body, and a negative size.
+#define IS_FORWARDED(obj) (GET_OBJECT_SIZE(obj) < 0)
+
+// the segments mapped as the heap grows, in addition to aq_heap.
+struct _immix_segment
+{
+  struct _immix_segment *next;
+};
+typedef struct _immix_segment immix_segment;
+
+static immix_segment *segments = NULL;
+static immix_block *blocks = NULL;
+static immix_block *last_block = NULL;
+static immix_block *free_blocks = NULL;
+static large_object *large_objects = NULL;
+static size_t block_num = 0;
+static size_t free_num = 0;
+static aq_bool use_reserve = FALSE;
+static size_t large_size = 0;
+
+// the heap may hold blocks and large objects up to capacity bytes.
+static size_t capacity = 0;
+
+// the allocator bumps from cursor to limit, a hole of alloc_block, and
+// medium objects, larger than a line, from overflow_cursor in a free block.
+// recycle_scan is the next block to look for holes in.
+static char *cursor = NULL;
+static char *limit = NULL;
+static immix_block *alloc_block = NULL;
+static immix_block *recycle_scan = NULL;
+static char *overflow_cursor = NULL;
+static char *overflow_limit = NULL;
+static char *evacuate_cursor = NULL;
+static char *evacuate_limit = NULL;
+
+// the live bytes found by the mark, and the allocation that started the collection.
+static size_t live_size = 0;
+static size_t pending_size = 0;
+
+static gc_mark_stack mark_stack;
+
+static void gc_start_immix();
+static inline void *gc_malloc_immix(size_t size);
+static void gc_term_immix();
+
+static void add_blocks(char *area, size_t area_size);
+static aq_bool grow_blocks();
+static immix_block *take_free_block();
+static aq_bool next_hole();
+static char *bump(char **cursorp, char **limitp, size_t size);
+static char *allocate_large(size_t size);
+static char *allocate(size_t size);
+static Cell evacuate(Cell obj);
+static void mark_object(Cell *objp);
+static void select_evacuation();
+static void sweep();
+
+void add_blocks(char *area, size_t area_size)
+{
+  char *p = (char *)(((size_t)area + BLOCK_SIZE - 1) & ~(size_t)(BLOCK_SIZE - 1));
+  for (; p + BLOCK_SIZE <= area + area_size; p += BLOCK_SIZE)
+  {
+    immix_block *block = (immix_block *)p;
+    memset(block, 0, sizeof(immix_block));
+    block->state = BLOCK_FREE;
+    block->mark_bits.words = block->mark_words;
+    block->mark_bits.start = p;
+    block->mark_bits.word_num = sizeof(block->mark_words) / sizeof(mark_word);
+    block->next_free = free_blocks;
+    free_blocks = block;
+    free_num++;
+    if (last_block)
+    {
+      last_block->next = block;
+    }
+    else
+    {
+      blocks = block;
+    }
+    last_block = block;
+    block_num++;
+  }
+}
+
+// maps the blocks that the capacity leaves room for.
+aq_bool grow_blocks()
+{
+  size_t used = block_num * BLOCK_SIZE + large_size;
+  size_t num = (capacity > used) ? (capacity - used) / BLOCK_SIZE : 0;
+  if (num == 0)
+  {
+    return FALSE;
+  }
+  size_t size = sizeof(immix_segment) + (num + 1) * BLOCK_SIZE;
+  immix_segment *seg = (immix_segment *)gc_alloc_segment(size);
+  if (!seg)
+  {
+    return FALSE;
+  }
+  seg->next = segments;
+  segments = seg;
+  add_blocks((char *)(seg + 1), size - sizeof(immix_segment));
+  return TRUE;
+}
+
+immix_block *take_free_block()
+{
+  if (free_num <= RESERVE_BLOCKS)
+  {
+    grow_blocks();
+  }
+  if (!free_blocks || (free_num <= RESERVE_BLOCKS && !use_reserve))
+  {
+    return NULL;
+  }
+  immix_block *block = free_blocks;
+  free_blocks = block->next_free;
+  free_num--;
+  block->state = BLOCK_IN_USE;
+  return block;
+}
+
+// moves cursor to the next hole of alloc_block, or of the next recyclable
+// block, or to a free block.
+aq_bool next_hole()
+{
+  for (;;)
+  {
+    if (alloc_block)
+    {
+      int line = limit ? LINE_OF(alloc_block, limit) : HEADER_LINES;
+      while (line < LINE_NUM && alloc_block->line_marks[line])
+      {
+        line++;
+      }
+      if (line < LINE_NUM)
+      {
+        int end = line;
+        while (end < LINE_NUM && !alloc_block->line_marks[end])
+        {
+          end++;
+        }
+        cursor = LINE_ADDRESS(alloc_block, line);
+        limit = LINE_ADDRESS(alloc_block, end);
+        return TRUE;
+      }
+    }
+
+    while (recycle_scan && recycle_scan->state != BLOCK_RECYCLABLE)
+    {
+      recycle_scan = recycle_scan->next;
+    }
+    if (recycle_scan)
+    {
+      alloc_block = recycle_scan;
+      alloc_block->state = BLOCK_IN_USE;
+      recycle_scan = recycle_scan->next;
+    }
+    else if ((alloc_block = take_free_block()) == NULL)
+    {
+      return FALSE;
+    }
+    cursor = limit = NULL;
+  }
+}
+
+char *bump(char **cursorp, char **limitp, size_t size)
+{
+  char *ret = *cursorp;
+  if (!ret || ret + size > *limitp)
+  {
+    return NULL;
+  }
+  *cursorp += size;
+  return ret;
+}
+
+char *allocate_large(size_t size)
+{
+  if (block_num * BLOCK_SIZE + large_size + size > capacity)
+  {
+    return NULL;
+  }
+  large_object *obj = (large_object *)gc_alloc_segment(sizeof(large_object) + size);
+  if (!obj)
+  {
+    return NULL;
+  }
+  obj->next = large_objects;
+  obj->marked = FALSE;
+  large_objects = obj;
+  large_size += size;
+  return (char *)(obj + 1);
+}
+
+char *allocate(size_t size)
+{
+  char *ret = NULL;
+  if (size >= LARGE_OBJECT_SIZE)
+  {
+    return allocate_large(size);
+  }
+  if ((ret = bump(&cursor, &limit, size)) != NULL)
+  {
+    return ret;
+  }
+  if (size > LINE_SIZE)
+  {
+    if ((ret = bump(&overflow_cursor, &overflow_limit, size)) == NULL)
+    {
+      immix_block *block = take_free_block();
+      if (!block)
+      {
+        return NULL;
+      }
+      overflow_cursor = LINE_ADDRESS(block, HEADER_LINES);
+      overflow_limit = LINE_ADDRESS(block, LINE_NUM);
+      ret = bump(&overflow_cursor, &overflow_limit, size);
+    }
+    return ret;
+  }
+  while (next_hole())
+  {
+    if ((ret = bump(&cursor, &limit, size)) != NULL)
+    {
+      return ret;
+    }
+  }
+  return NULL;
+}
+
+//Initialization.
+void gc_init_immix(aq_gc_info *gc_info)
+{
+  mark_stack_init(&mark_stack);
+
+  segments = NULL;
+  blocks = last_block = free_blocks = NULL;
+  large_objects = NULL;
+  block_num = free_num = large_size = 0;
+  capacity = get_heap_size();
+  add_blocks(aq_heap, get_heap_size());
+  cursor = limit = overflow_cursor = overflow_limit = NULL;
+  alloc_block = recycle_scan = NULL;
+
+  gc_info->gc_malloc = gc_malloc_immix;
+  gc_info->gc_start = gc_start_immix;
+  gc_info->gc_write_barrier = NULL;
+  gc_info->gc_init_ptr = NULL;
+  gc_info->gc_memcpy = NULL;
+  gc_info->gc_term = gc_term_immix;
+}
+
+//Allocation.
+void *gc_malloc_immix(size_t size)
+{
+  int allocate_size = (sizeof(immix_gc_header) + size + MEMORY_ALIGNMENT - 1) / MEMORY_ALIGNMENT * MEMORY_ALIGNMENT;
+  if (g_GC_stress)
+  {
+    gc_start();
+  }
+
+  char *p = allocate(allocate_size);
+  if (!p)
+  {
+    pending_size = allocate_size;
+    gc_start();
+    pending_size = 0;
+    p = allocate(allocate_size);
+  }
+  if (!p)
+  {
+    use_reserve = TRUE;
+    p = allocate(allocate_size);
+  }
+  if (!p)
+  {
+    // grows the heap by the allocation if the policy has not made room for it.
+    size_t max = (g_heap_max > (size_t)get_heap_size()) ? g_heap_max : (size_t)get_heap_size();
+    if (capacity + allocate_size + BLOCK_SIZE <= max)
+    {
+      capacity += allocate_size + BLOCK_SIZE;
+      p = allocate(allocate_size);
+    }
+  }
+  use_reserve = FALSE;
+  if (!p)
+  {
+    heap_exhausted_error();
+  }
+
+  immix_gc_header *new_header = (immix_gc_header *)p;
+  new_header->obj_size = allocate_size;
+  return (Cell)(new_header + 1);
+}
+
+// copies obj into a free block; returns NULL if no free block is left.
+Cell evacuate(Cell obj)
+{
+  int size = GET_OBJECT_SIZE(obj);
+  immix_gc_header *header = (immix_gc_header *)obj - 1;
+  char *p = bump(&evacuate_cursor, &evacuate_limit, size);
+  if (!p)
+  {
+    immix_block *block = free_blocks;
+    if (!block)
+    {
+      return NULL;
+    }
+    free_blocks = block->next_free;
+    free_num--;
+    block->state = BLOCK_IN_USE;
+    evacuate_cursor = LINE_ADDRESS(block, HEADER_LINES);
+    evacuate_limit = LINE_ADDRESS(block, LINE_NUM);
+    p = bump(&evacuate_cursor, &evacuate_limit, size);
+  }
+  memcpy(p, header, size);
+  Cell new_obj = (Cell)((immix_gc_header *)p + 1);
+  header->obj_size = -1;
+  memcpy(obj, &new_obj, sizeof(Cell));
+  return new_obj;
+}
+
+void mark_object(Cell *objp)
+{
+  Cell obj = *objp;
+  if (!obj)
+  {
+    return;
+  }
+  if (IS_FORWARDED(obj))
+  {
+    memcpy(objp, obj, sizeof(Cell));
+    return;
+  }
+  if (IS_LARGE(obj))
+  {
+    large_object *large = LARGE_OBJECT_OF(obj);
+    if (!large->marked)
+    {
+      large->marked = TRUE;
+      live_size += GET_OBJECT_SIZE(obj);
+      MARK_STACK_PUSH(&mark_stack, obj);
+    }
+    return;
+  }
+
+  immix_gc_header *header = (immix_gc_header *)obj - 1;
+  immix_block *block = BLOCK_OF(header);
+  if (MARK_BITMAP_TEST(&block->mark_bits, header))
+  {
+    return;
+  }
+  if (block->evacuate)
+  {
+    Cell new_obj = evacuate(obj);
+    if (new_obj)
+    {
+      obj = *objp = new_obj;
+      header = (immix_gc_header *)obj - 1;
+      block = BLOCK_OF(header);
+    }
+  }
+
+  int size = header->obj_size;
+  int line = LINE_OF(block, header);
+  int last = LINE_OF(block, (char *)header + size - 1);
+  MARK_BITMAP_SET(&block->mark_bits, header);
+  for (; line <= last; line++)
+  {
+    block->line_marks[line] = 1;
+  }
+  live_size += size;
+  MARK_STACK_PUSH(&mark_stack, obj);
+}
+
+// picks the fragmented blocks whose live lines fit in the free blocks.
+void select_evacuation()
+{
+  size_t room = free_num * BLOCK_DATA_SIZE;
+  immix_block *block;
+  for (block = blocks; block; block = block->next)
+  {
+    size_t live = (size_t)block->live_lines * LINE_SIZE;
+    block->evacuate = (block->state != BLOCK_FREE && block->holes >= EVACUATE_HOLES && live <= room);
+    if (block->evacuate)
+    {
+      room -= live;
+    }
+  }
+}
+
+void sweep()
+{
+  immix_block *block;
+  immix_block **free_tail = &free_blocks;
+  free_num = 0;
+  for (block = blocks; block; block = block->next)
+  {
+    int line;
+    block->live_lines = 0;
+    block->holes = 0;
+    block->evacuate = FALSE;
+    for (line = HEADER_LINES; line < LINE_NUM; line++)
+    {
+      if (block->line_marks[line])
+      {
+        block->live_lines++;
+      }
+      else if (line == HEADER_LINES || block->line_marks[line - 1])
+      {
+        block->holes++;
+      }
+    }
+    if (block->live_lines == 0)
+    {
+      block->state = BLOCK_FREE;
+      *free_tail = block;
+      free_tail = &block->next_free;
+      free_num++;
+    }
+    else
+    {
+      block->state = block->holes ? BLOCK_RECYCLABLE : BLOCK_FULL;
+    }
+  }
+  *free_tail = NULL;
+
+  large_object **objp = &large_objects;
+  while (*objp)
+  {
+    large_object *obj = *objp;
+    if (obj->marked)
+    {
+      obj->marked = FALSE;
+      objp = &obj->next;
+    }
+    else
+    {
+      *objp = obj->next;
+      large_size -= ((immix_gc_header *)(obj + 1))->obj_size;
+      gc_free_segment((char *)obj);
+    }
+  }
+}
+
+//Start Garbage Collection.
+void gc_start_immix()
+{
+  immix_block *block;
+  mark_stack.top = 0;
+  live_size = 0;
+
+  select_evacuation();
+  for (block = blocks; block; block = block->next)
+  {
+    mark_bitmap_clear(&block->mark_bits);
+    memset(block->line_marks, 0, sizeof(block->line_marks));
+  }
+  evacuate_cursor = evacuate_limit = NULL;
+
+  //mark phase.
+  trace_roots(mark_object);
+  while (!MARK_STACK_EMPTY_P(&mark_stack))
+  {
+    trace_object(MARK_STACK_POP(&mark_stack), mark_object);
+  }
+
+  //sweep phase.
+  sweep();
+  cursor = limit = overflow_cursor = overflow_limit = NULL;
+  alloc_block = NULL;
+  recycle_scan = blocks;
+
+  //grows the heap by the policy.
+  size_t target = gc_heap_target(live_size + pending_size, capacity);
+  capacity = (target > capacity) ? target : capacity;
+}
+
+//term.
+void gc_term_immix()
+{
+  while (large_objects)
+  {
+    large_object *obj = large_objects;
+    large_objects = obj->next;
+    gc_free_segment((char *)obj);
+  }
+  while (segments)
+  {
+    immix_segment *seg = segments;
+    segments = seg->next;
+    gc_free_segment((char *)seg);
+  }
+  blocks = last_block = free_blocks = NULL;
+  mark_stack_term(&mark_stack);
+}
@@ -5,7 +5,6 @@ struct _markcompact_gc_header
 {
   int obj_size;
   Cell forwarding;
-  aq_bool mark_bit;
 };
 typedef struct _markcompact_gc_header markcompact_gc_header;
 
@@ -19,19 +18,36 @@ static int heap_size = 0;
 #define GET_OBJECT_SIZE(obj) (((markcompact_gc_header *)(obj)-1)->obj_size)
 
 #define FORWARDING(obj) (((markcompact_gc_header *)(obj)-1)->forwarding)
-#define IS_MARKED(obj) (((markcompact_gc_header *)(obj)-1)->mark_bit)
-#define SET_MARK(obj) (((markcompact_gc_header *)(obj)-1)->mark_bit = TRUE)
-#define CLEAR_MARK(obj) (((markcompact_gc_header *)(obj)-1)->mark_bit = FALSE)
+
+// the marks are kept in a side bitmap at the end of the heap, with a bit
+// for the header of each live object. the compaction phases visit only
+// the marked objects by scanning the bitmap.
+static mark_bitmap mark_bits;
+#define IS_MARKED(obj) MARK_BITMAP_TEST(&mark_bits, (markcompact_gc_header *)(obj)-1)
+#define SET_MARK(obj) MARK_BITMAP_SET(&mark_bits, (markcompact_gc_header *)(obj)-1)
+#define NEXT_MARKED(p) mark_bitmap_next(&mark_bits, (p), top)
 
 static char *heap = NULL;
 static char *top = NULL;
 static char *new_top = NULL;
 
-#define MARK_STACK_SIZE 500
-static int mark_stack_top = 0;
-static Cell *mark_stack = NULL;
+// the heap starts as aq_heap. when the policy resizes it, the live
+// objects are compacted into a new segment of new_area_size bytes
+// instead of sliding in place.
+static size_t area_size = 0;
+static char *new_heap = NULL;
+static size_t new_area_size = 0;
+
+// the live bytes found by the mark, and the allocation that started the collection.
+static size_t live_size = 0;
+static size_t pending_size = 0;
+
+static gc_mark_stack mark_stack;
 
 static void mark_object(Cell *objp);
+#if defined(AQ_GC_THREADS)
+static aq_bool try_mark_object(Cell *objp);
+#endif
 static void move_object(Cell obj);
 static void update(Cell *objp);
 static void calc_new_address();
@@ -46,21 +62,31 @@ void mark_object(Cell *objp)
   if (obj && !IS_MARKED(obj))
   {
     SET_MARK(obj);
-    if (mark_stack_top >= MARK_STACK_SIZE)
-    {
-      printf("[GC] mark stack overflow.\n");
-      exit(-1);
-    }
-    mark_stack[mark_stack_top++] = obj;
+    live_size += GET_OBJECT_SIZE(obj);
+    MARK_STACK_PUSH(&mark_stack, obj);
+  }
+}
+
+#if defined(AQ_GC_THREADS)
+aq_bool try_mark_object(Cell *objp)
+{
+  Cell obj = *objp;
+  if (!MARK_BITMAP_TEST_AND_SET(&mark_bits, (markcompact_gc_header *)obj - 1))
+  {
+    return FALSE;
   }
+  ATOMIC_FETCH_ADD(&live_size, GET_OBJECT_SIZE(obj));
+  return TRUE;
 }
+#endif
 
 void move_object(Cell obj)
 {
   long size = GET_OBJECT_SIZE(obj);
   markcompact_gc_header *new_header = ((markcompact_gc_header *)(FORWARDING(obj))) - 1;
   markcompact_gc_header *old_header = ((markcompact_gc_header *)obj) - 1;
-  memcpy(new_header, old_header, size);
+  // the object may overlap its new place.
+  memmove(new_header, old_header, size);
   Cell new_cell = (Cell)(((markcompact_gc_header *)new_header) + 1);
 
   FORWARDING(new_cell) = new_cell;
@@ -70,12 +96,12 @@ void move_object(Cell obj)
 void gc_init_markcompact(aq_gc_info *gc_info)
 {
   //mark stack.
-  int mark_stack_size = sizeof(Cell) * MARK_STACK_SIZE;
-  mark_stack = (Cell *)aq_heap;
-  heap_size = get_heap_size() - mark_stack_size;
+  mark_stack_init(&mark_stack);
 
-  //heap.
-  heap = aq_heap + mark_stack_size;
+  //heap and mark bitmap.
+  heap = aq_heap;
+  area_size = get_heap_size();
+  heap_size = mark_bitmap_init(&mark_bits, heap, area_size);
   top = heap;
 
   gc_info->gc_malloc = gc_malloc_markcompact;
@@ -91,7 +117,9 @@ void *gc_malloc_markcompact(size_t size)
 {
   if (g_GC_stress || !IS_ALLOCATABLE(size))
   {
+    pending_size = sizeof(markcompact_gc_header) + size;
     gc_start();
+    pending_size = 0;
     if (!IS_ALLOCATABLE(size))
     {
       heap_exhausted_error();
@@ -102,7 +130,6 @@ void *gc_malloc_markcompact(size_t size)
   int allocate_size = (sizeof(markcompact_gc_header) + size + 3) / 4 * 4;
   top += allocate_size;
   FORWARDING(ret) = ret;
-  CLEAR_MARK(ret);
   new_header->obj_size = allocate_size;
   return ret;
 }
@@ -117,70 +144,73 @@ void update(Cell *cellp)
 
 void calc_new_address()
 {
-  char *scanned = heap;
-  new_top = heap;
+  char *scanned = NULL;
   Cell cell = NULL;
-  int obj_size = 0;
-  while (scanned < top)
+  new_top = new_heap;
+  for (scanned = NEXT_MARKED(heap); scanned < top; scanned = NEXT_MARKED(scanned + GET_OBJECT_SIZE(cell)))
   {
     cell = (Cell)((markcompact_gc_header *)scanned + 1);
-    obj_size = GET_OBJECT_SIZE(cell);
-    if (IS_MARKED(cell))
-    {
-      FORWARDING(cell) = (Cell)((markcompact_gc_header *)new_top + 1);
-      new_top += obj_size;
-    }
-    scanned += obj_size;
+    FORWARDING(cell) = (Cell)((markcompact_gc_header *)new_top + 1);
+    new_top += GET_OBJECT_SIZE(cell);
   }
 }
 
 void update_pointer()
 {
-  char *scanned = heap;
+  char *scanned = NULL;
   Cell cell = NULL;
-  int obj_size = 0;
   trace_roots(update);
-  while (scanned < top)
+  for (scanned = NEXT_MARKED(heap); scanned < top; scanned = NEXT_MARKED(scanned + GET_OBJECT_SIZE(cell)))
   {
     cell = (Cell)((markcompact_gc_header *)scanned + 1);
-    obj_size = GET_OBJECT_SIZE(cell);
-    if (IS_MARKED(cell))
-    {
-      trace_object(cell, update);
-    }
-    scanned += obj_size;
+    trace_object(cell, update);
   }
 }
 
 void slide()
 {
-  char *scanned = heap;
+  char *scanned = NULL;
   Cell cell = NULL;
   int obj_size = 0;
-  while (scanned < top)
+  for (scanned = NEXT_MARKED(heap); scanned < top; scanned = NEXT_MARKED(scanned + obj_size))
   {
     cell = (Cell)((markcompact_gc_header *)scanned + 1);
     obj_size = GET_OBJECT_SIZE(cell);
-    if (IS_MARKED(cell))
-    {
-      CLEAR_MARK(cell);
-      move_object(cell);
-    }
-    scanned += obj_size;
+    move_object(cell);
   }
   top = new_top;
+  if (new_heap == heap)
+  {
+    mark_bitmap_clear(&mark_bits);
+    return;
+  }
+  if (heap != aq_heap)
+  {
+    gc_free_segment(heap);
+  }
+  heap = new_heap;
+  area_size = new_area_size;
+  heap_size = mark_bitmap_init(&mark_bits, heap, area_size);
 }
 
 //Start Garbage Collection.
 void mark()
 {
+#if defined(AQ_GC_THREADS)
+  if (g_GC_threads > 1)
+  {
+    parallel_mark(try_mark_object);
+    return;
+  }
+#endif
+
   //mark root objects.
   trace_roots(mark_object);
 
   Cell obj = NULL;
-  while (mark_stack_top > 0)
+  while (!MARK_STACK_EMPTY_P(&mark_stack))
   {
-    obj = mark_stack[--mark_stack_top];
+    obj = MARK_STACK_POP(&mark_stack);
     trace_object(obj, mark_object);
   }
 }
@@ -195,14 +225,34 @@ void compact()
 void gc_start_markcompact()
 {
   //initialization.
-  mark_stack_top = 0;
+  mark_stack.top = 0;
+  live_size = 0;
 
   //mark phase.
   mark();
 
+  //resizes the heap by the policy if the live objects fit.
+  new_heap = heap;
+  new_area_size = gc_heap_target(live_size + pending_size, area_size);
+  if (new_area_size != area_size && new_area_size - mark_bitmap_size(new_area_size) - sizeof(mark_word) * 2 > live_size + pending_size)
+  {
+    new_heap = gc_alloc_segment(new_area_size);
+    new_heap = new_heap ? new_heap : heap;
+  }
+
   //compaction phase.
   compact();
 }
 
 //term.
-void gc_term_markcompact() {}
+void gc_term_markcompact()
+{
+  if (heap != aq_heap)
+  {
+    gc_free_segment(heap);
+  }
+  mark_stack_term(&mark_stack);
+#if defined(AQ_GC_THREADS)
+  parallel_mark_term();
+#endif
+}
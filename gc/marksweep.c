@@ -1,23 +1,49 @@
 #include "base.h"
+#include <string.h>
 
 struct _marksweep_gc_header
 {
   int obj_size;
-  aq_bool mark_bit;
 };
 typedef struct _marksweep_gc_header marksweep_gc_header;
 
-//mark table: a bit per WORD
-#define BIT_WIDTH (32)
-#define MEMORY_ALIGNMENT (4)
+#define MEMORY_ALIGNMENT (MARK_GRANULE)
+
+// segregated fits: free chunks up to SIZE_CLASS_MAX bytes are kept in a
+// list per size, so that cells and short strings are allocated from the
+// head of a list; larger chunks are kept in freelist.
+#define SIZE_CLASS_MAX (256)
+#define SIZE_CLASS_NUM (SIZE_CLASS_MAX / MEMORY_ALIGNMENT + 1)
+#define SIZE_CLASS(size) ((size) / MEMORY_ALIGNMENT)
 
 free_chunk *get_free_chunk(size_t size);
 static free_chunk *freelist;
-static char *heap;
+static free_chunk *size_class_lists[SIZE_CLASS_NUM];
+
+// the heap is a list of segments: aq_heap, and the segments mapped as
+// the heap grows. each segment keeps its marks in a side bitmap at its
+// end, with a bit for the header of each live object.
+struct _marksweep_segment
+{
+  struct _marksweep_segment *next;
+  char *heap;
+  size_t heap_size;
+  mark_bitmap mark_bits;
+};
+typedef struct _marksweep_segment marksweep_segment;
+
+#define SEGMENT_HEADER_SIZE ((sizeof(marksweep_segment) + sizeof(Cell) - 1) / sizeof(Cell) * sizeof(Cell))
+#define MIN_SEGMENT_SIZE (4 * 1024)
+#define IN_SEGMENT_P(seg, p) ((seg)->heap <= (char *)(p) && (char *)(p) < (seg)->heap + (seg)->heap_size)
 
-#define IS_MARKED(obj) (((marksweep_gc_header *)(obj)-1)->mark_bit)
-#define SET_MARK(obj) (((marksweep_gc_header *)(obj)-1)->mark_bit = TRUE)
-#define CLEAR_MARK(obj) (((marksweep_gc_header *)(obj)-1)->mark_bit = FALSE)
+static marksweep_segment first_segment;
+static marksweep_segment *segments = NULL;
+static marksweep_segment *last_segment = NULL;
+static size_t heap_size;
+
+// the live bytes found by the last mark, and the allocation that started the collection.
+static size_t live_size = 0;
+static size_t pending_size = 0;
 
 static void gc_start_marksweep();
 static inline void *gc_malloc_marksweep(size_t size);
@@ -25,49 +51,167 @@ static void gc_term_marksweep();
 
 #define GET_OBJECT_SIZE(obj) (((marksweep_gc_header *)(obj)-1)->obj_size)
 
-#define MARK_STACK_SIZE 500
-static int mark_stack_top;
-static Cell *mark_stack = NULL;
+static gc_mark_stack mark_stack;
+
+// lazy sweep (-GC_LAZY_SWEEP): the collection only marks, and the heap is
+// swept from sweep_scan in sweep_segment as the allocator needs free
+// chunks. sweep_scan is NULL when the heap has been swept.
+static char *sweep_scan = NULL;
+static marksweep_segment *sweep_segment = NULL;
+
+// the heap size the policy set at the last collection, when it shrinks
+// the heap. the sweep unmaps the empty segments it finds while the heap
+// is larger, before the allocator can take their chunks, so that a lazy
+// sweep shrinks the heap as well.
+static size_t shrink_target = 0;
+
+// incremental mark (-GC_INCREMENTAL): a collection starts by marking the
+// roots once allocated_size reaches mark_trigger, and then each
+// allocation traces INCREMENTAL_MARK_RATE times its size from the mark
+// stack. objects are allocated black, and the write barrier shades the
+// objects stored while marking (Dijkstra). pushes onto the stack have no
+// barrier, so the pause that ends the mark scans the roots again.
+#define INCREMENTAL_MARK_RATE (4)
+static aq_bool marking = FALSE;
+static size_t allocated_size = 0;
+static size_t mark_trigger = 0;
 
 static void mark_object(Cell *objp);
+#if defined(AQ_GC_THREADS)
+static aq_bool try_mark_object(Cell *objp);
+#endif
 static void mark();
+static void start_incremental_mark();
+static aq_bool mark_step(size_t budget);
+static void gc_write_barrier_incremental(Cell cell, Cell *cellp, Cell newcell);
+static void gc_init_ptr_incremental(Cell *cellp, Cell newcell);
 static void sweep();
+static void sweep_start();
+static void put_free_chunk(char *p, size_t size);
+static aq_bool sweep_step(size_t size);
+static aq_bool add_segment(size_t size);
+static void unmap_segment(marksweep_segment *seg);
 int get_obj_size(size_t size);
 
+static inline marksweep_segment *find_segment(void *p)
+{
+  marksweep_segment *seg;
+  for (seg = segments; !IN_SEGMENT_P(seg, p); seg = seg->next)
+    ;
+  return seg;
+}
+
+static inline marksweep_segment *segment_of(void *p)
+{
+  if (!IN_SEGMENT_P(last_segment, p))
+  {
+    last_segment = find_segment(p);
+  }
+  return last_segment;
+}
+
 void mark_object(Cell *objp)
 {
   Cell obj = *objp;
-  if (obj && !IS_MARKED(obj))
+  if (!obj)
   {
-    SET_MARK(obj);
-    if (mark_stack_top >= MARK_STACK_SIZE)
-    {
-      printf("[GC] mark stack overflow.\n");
-      exit(-1);
-    }
-    mark_stack[mark_stack_top++] = obj;
+    return;
+  }
+  marksweep_gc_header *header = (marksweep_gc_header *)obj - 1;
+  mark_bitmap *mark_bits = &segment_of(header)->mark_bits;
+  if (!MARK_BITMAP_TEST(mark_bits, header))
+  {
+    MARK_BITMAP_SET(mark_bits, header);
+    live_size += header->obj_size;
+    MARK_STACK_PUSH(&mark_stack, obj);
   }
 }
 
+#if defined(AQ_GC_THREADS)
+// the marking threads look the segment up without sharing last_segment.
+aq_bool try_mark_object(Cell *objp)
+{
+  Cell obj = *objp;
+  marksweep_gc_header *header = (marksweep_gc_header *)obj - 1;
+  if (!MARK_BITMAP_TEST_AND_SET(&find_segment(header)->mark_bits, header))
+  {
+    return FALSE;
+  }
+  ATOMIC_FETCH_ADD(&live_size, header->obj_size);
+  return TRUE;
+}
+#endif
+
+// maps a segment of size bytes at the end of the heap.
+aq_bool add_segment(size_t size)
+{
+  char *block = gc_alloc_segment(size);
+  if (!block)
+  {
+    return FALSE;
+  }
+  marksweep_segment *seg = (marksweep_segment *)block;
+  seg->heap = block + SEGMENT_HEADER_SIZE;
+  seg->heap_size = mark_bitmap_init(&seg->mark_bits, seg->heap, size - SEGMENT_HEADER_SIZE);
+  seg->next = NULL;
+
+  marksweep_segment *tail = segments;
+  while (tail->next)
+  {
+    tail = tail->next;
+  }
+  tail->next = seg;
+  heap_size += seg->heap_size;
+  shrink_target = 0;
+
+  // a sweep in progress will reach the new segment.
+  if (!sweep_scan)
+  {
+    put_free_chunk(seg->heap, seg->heap_size);
+  }
+  return TRUE;
+}
+
+void unmap_segment(marksweep_segment *seg)
+{
+  marksweep_segment *prev = segments;
+  while (prev->next != seg)
+  {
+    prev = prev->next;
+  }
+  prev->next = seg->next;
+  heap_size -= seg->heap_size;
+  last_segment = segments;
+  gc_free_segment((char *)seg);
+}
+
 //Initialization.
 void gc_init_marksweep(aq_gc_info *gc_info)
 {
   //mark stack.
-  int mark_stack_size = sizeof(Cell) * MARK_STACK_SIZE;
-  mark_stack = (Cell *)aq_heap;
+  mark_stack_init(&mark_stack);
 
-  //heap.
-  heap = aq_heap + mark_stack_size;
+  //heap and mark bitmap.
+  segments = last_segment = &first_segment;
+  first_segment.next = NULL;
+  first_segment.heap = aq_heap;
+  first_segment.heap_size = mark_bitmap_init(&first_segment.mark_bits, aq_heap, get_heap_size());
+  heap_size = first_segment.heap_size;
 
   //freelist.
-  freelist = (free_chunk *)heap;
-  freelist->chunk_size = get_heap_size() - mark_stack_size;
+  freelist = (free_chunk *)aq_heap;
+  freelist->chunk_size = heap_size;
   freelist->next = NULL;
+  memset(size_class_lists, 0, sizeof(size_class_lists));
+
+  marking = FALSE;
+  allocated_size = 0;
+  mark_trigger = heap_size / 2;
 
   gc_info->gc_malloc = gc_malloc_marksweep;
   gc_info->gc_start = gc_start_marksweep;
-  gc_info->gc_write_barrier = NULL;
-  gc_info->gc_init_ptr = NULL;
+  gc_info->gc_write_barrier = g_GC_incremental ? gc_write_barrier_incremental : NULL;
+  gc_info->gc_init_ptr = g_GC_incremental ? gc_init_ptr_incremental : NULL;
   gc_info->gc_memcpy = NULL;
   gc_info->gc_term = gc_term_marksweep;
 }
@@ -78,18 +222,49 @@ void *gc_malloc_marksweep(size_t size)
   int allocate_size = (get_obj_size(size) + MEMORY_ALIGNMENT - 1) / MEMORY_ALIGNMENT * MEMORY_ALIGNMENT;
   if (g_GC_stress)
   {
-    if (freelist && freelist->chunk_size < get_heap_size() - sizeof(Cell) * MARK_STACK_SIZE)
+    if (freelist && (size_t)freelist->chunk_size < heap_size)
+    {
+      gc_start();
+    }
+  }
+  if (g_GC_incremental)
+  {
+    allocated_size += allocate_size;
+    if (marking && !mark_step(allocate_size * INCREMENTAL_MARK_RATE))
     {
       gc_start();
     }
+    else if (!marking && allocated_size >= mark_trigger)
+    {
+      start_incremental_mark();
+    }
   }
   free_chunk *chunk = NULL;
 
   chunk = get_free_chunk(allocate_size);
+  while (!chunk && sweep_scan && sweep_step(allocate_size))
+  {
+    chunk = get_free_chunk(allocate_size);
+  }
   if (!chunk)
   {
+    pending_size = allocate_size;
     gc_start();
+    pending_size = 0;
     chunk = get_free_chunk(allocate_size);
+    while (!chunk && sweep_scan && sweep_step(allocate_size))
+    {
+      chunk = get_free_chunk(allocate_size);
+    }
+    // the chunk is too fragmented or the heap too small for the policy
+    // to have grown it; maps a segment for the object within HEAP_MAX.
+    size_t segment_size = allocate_size + SEGMENT_HEADER_SIZE + mark_bitmap_size(allocate_size) + sizeof(mark_word);
+    segment_size = (segment_size < MIN_SEGMENT_SIZE) ? MIN_SEGMENT_SIZE : segment_size;
+    if (!chunk && heap_size + segment_size <= g_heap_max && add_segment(segment_size))
+    {
+      sweep();
+      chunk = get_free_chunk(allocate_size);
+    }
     if (!chunk)
     {
       heap_exhausted_error();
@@ -103,29 +278,161 @@ void *gc_malloc_marksweep(size_t size)
   marksweep_gc_header *new_header = (marksweep_gc_header *)chunk;
   Cell ret = (Cell)(new_header + 1);
   new_header->obj_size = allocate_size;
-  new_header->mark_bit = FALSE;
 
+  // allocated black during an incremental mark.
+  if (marking)
+  {
+    MARK_BITMAP_SET(&segment_of(new_header)->mark_bits, new_header);
+    live_size += allocate_size;
+  }
   return ret;
 }
 
+// shades newcell during an incremental mark, so that no black object points to a white one.
+void gc_write_barrier_incremental(Cell cell, Cell *cellp, Cell newcell)
+{
+  (void)cell;
+  if (marking && HEAP_CELL_P(newcell))
+  {
+    mark_object(&newcell);
+  }
+  *cellp = newcell;
+}
+
+void gc_init_ptr_incremental(Cell *cellp, Cell newcell)
+{
+  if (marking && HEAP_CELL_P(newcell))
+  {
+    mark_object(&newcell);
+  }
+  *cellp = newcell;
+}
+
+void start_incremental_mark()
+{
+  sweep();
+  mark_stack.top = 0;
+  live_size = 0;
+  for (marksweep_segment *seg = segments; seg; seg = seg->next)
+  {
+    mark_bitmap_clear(&seg->mark_bits);
+  }
+  trace_roots(mark_object);
+  marking = TRUE;
+}
+
+// traces about budget bytes of objects; returns FALSE when the mark stack is empty.
+aq_bool mark_step(size_t budget)
+{
+  size_t traced = 0;
+  while (!MARK_STACK_EMPTY_P(&mark_stack) && traced < budget)
+  {
+    Cell obj = MARK_STACK_POP(&mark_stack);
+    trace_object(obj, mark_object);
+    traced += GET_OBJECT_SIZE(obj);
+  }
+  return !MARK_STACK_EMPTY_P(&mark_stack);
+}
+
 void mark()
 {
-  mark_stack_top = 0;
+  if (marking)
+  {
+    // finishes the incremental mark from the roots as they are now.
+    marking = FALSE;
+  }
+  else
+  {
+    mark_stack.top = 0;
+    live_size = 0;
+    for (marksweep_segment *seg = segments; seg; seg = seg->next)
+    {
+      mark_bitmap_clear(&seg->mark_bits);
+    }
+
+#if defined(AQ_GC_THREADS)
+    if (g_GC_threads > 1)
+    {
+      parallel_mark(try_mark_object);
+      return;
+    }
+#endif
+  }
 
   //mark root objects.
   trace_roots(mark_object);
 
   Cell obj = NULL;
-  while (mark_stack_top > 0)
+  while (!MARK_STACK_EMPTY_P(&mark_stack))
   {
-    obj = mark_stack[--mark_stack_top];
+    obj = MARK_STACK_POP(&mark_stack);
     trace_object(obj, mark_object);
   }
 }
 
+static void put_free_chunk(char *p, size_t size)
+{
+  free_chunk *chunk = (free_chunk *)p;
+  chunk->chunk_size = size;
+  if (size <= SIZE_CLASS_MAX)
+  {
+    chunk->next = size_class_lists[SIZE_CLASS(size)];
+    size_class_lists[SIZE_CLASS(size)] = chunk;
+  }
+  else
+  {
+    chunk->next = freelist;
+    freelist = chunk;
+  }
+}
+
+// takes size bytes from the front of chunk, which has been unlinked,
+// and gives back the rest unless it is too small to be a chunk.
+static free_chunk *split_chunk(free_chunk *chunk, size_t size)
+{
+  if ((size_t)chunk->chunk_size >= size + sizeof(free_chunk))
+  {
+    put_free_chunk((char *)chunk + size, chunk->chunk_size - size);
+    chunk->chunk_size = size;
+  }
+  return chunk;
+}
+
 free_chunk *get_free_chunk(size_t size)
 {
-  return aq_get_free_chunk(&freelist, size);
+  free_chunk *chunk = NULL;
+  if (size <= SIZE_CLASS_MAX && size_class_lists[SIZE_CLASS(size)])
+  {
+    // exact fit.
+    chunk = size_class_lists[SIZE_CLASS(size)];
+    size_class_lists[SIZE_CLASS(size)] = chunk->next;
+    return chunk;
+  }
+
+  // every chunk in freelist is larger than a size class.
+  free_chunk **chunkp = &freelist;
+  while (*chunkp && (size_t)(*chunkp)->chunk_size < size)
+  {
+    chunkp = &(*chunkp)->next;
+  }
+  if (*chunkp)
+  {
+    chunk = *chunkp;
+    *chunkp = chunk->next;
+    return split_chunk(chunk, size);
+  }
+
+  // a chunk of a larger size class.
+  for (size_t s = size + MEMORY_ALIGNMENT; s <= SIZE_CLASS_MAX; s += MEMORY_ALIGNMENT)
+  {
+    if (size_class_lists[SIZE_CLASS(s)])
+    {
+      chunk = size_class_lists[SIZE_CLASS(s)];
+      size_class_lists[SIZE_CLASS(s)] = chunk->next;
+      return split_chunk(chunk, size);
+    }
+  }
+  return NULL;
 }
 
 int get_obj_size(size_t size)
@@ -133,52 +440,101 @@ int get_obj_size(size_t size)
   return sizeof(marksweep_gc_header) + size;
 }
 
-void sweep()
+static void sweep_start()
 {
-  char *scan = heap;
-  char *scan_end = aq_heap + get_heap_size();
-  free_chunk *chunk_top = NULL;
+  freelist = NULL;
+  memset(size_class_lists, 0, sizeof(size_class_lists));
+  sweep_segment = segments;
+  sweep_scan = segments->heap;
+}
 
-  while (scan < scan_end)
+// sweeps until a free chunk of at least size bytes is made; returns
+// FALSE if the end of the heap has been reached without one. the dead
+// objects between two marked ones are freed in a chunk without being
+// visited.
+aq_bool sweep_step(size_t size)
+{
+  while (sweep_segment)
   {
-    Cell obj = (Cell)((marksweep_gc_header *)scan + 1);
-    size_t obj_size = GET_OBJECT_SIZE(obj);
-
-    if (!IS_MARKED(obj))
+    char *scan_end = sweep_segment->heap + sweep_segment->heap_size;
+    if (shrink_target && sweep_segment != segments && sweep_scan == sweep_segment->heap &&
+        heap_size - sweep_segment->heap_size >= shrink_target &&
+        mark_bitmap_next(&sweep_segment->mark_bits, sweep_scan, scan_end) == scan_end)
     {
-      if (chunk_top == NULL)
-      {
-        chunk_top = (free_chunk *)scan;
-        chunk_top->next = NULL;
-        chunk_top->chunk_size = obj_size;
-        freelist = chunk_top;
-      }
-      else if ((char *)chunk_top + chunk_top->chunk_size == scan)
+      marksweep_segment *seg = sweep_segment;
+      sweep_segment = seg->next;
+      sweep_scan = sweep_segment ? sweep_segment->heap : NULL;
+      unmap_segment(seg);
+      continue;
+    }
+    while (sweep_scan < scan_end)
+    {
+      char *live = mark_bitmap_next(&sweep_segment->mark_bits, sweep_scan, scan_end);
+      size_t free_size = live - sweep_scan;
+      if (free_size > 0)
       {
-        chunk_top->chunk_size += obj_size;
+        put_free_chunk(sweep_scan, free_size);
       }
-      else
+      sweep_scan = (live < scan_end) ? live + GET_OBJECT_SIZE((marksweep_gc_header *)live + 1) : scan_end;
+      if (free_size > 0 && free_size >= size)
       {
-        chunk_top->next = (free_chunk *)scan;
-        chunk_top = chunk_top->next;
-        chunk_top->chunk_size = obj_size;
-        chunk_top->next = NULL;
+        return TRUE;
       }
     }
-    else
-    {
-      CLEAR_MARK(obj);
-    }
-    scan += obj_size;
+    sweep_segment = sweep_segment->next;
+    sweep_scan = sweep_segment ? sweep_segment->heap : NULL;
+  }
+  return FALSE;
+}
+
+// finishes the sweep in progress.
+void sweep()
+{
+  while (sweep_scan)
+  {
+    sweep_step(0);
   }
 }
 
 //Start Garbage Collection.
 void gc_start_marksweep()
 {
-  mark();
+  // the marks of the objects left to sweep are still needed.
   sweep();
+  mark();
+
+  // resizes the heap by the policy: a new segment is swept as free.
+  size_t target = gc_heap_target(live_size + pending_size, heap_size);
+  if (target >= heap_size + MIN_SEGMENT_SIZE)
+  {
+    add_segment(target - heap_size);
+  }
+  shrink_target = (target < heap_size) ? target : 0;
+  sweep_start();
+  if (!g_GC_lazy_sweep)
+  {
+    sweep();
+  }
+
+  // the next incremental mark starts when half of the free space is used.
+  allocated_size = 0;
+  mark_trigger = (heap_size - live_size) / 2;
 }
 
 //term.
-void gc_term_marksweep() {}
+void gc_term_marksweep()
+{
+  sweep_scan = NULL;
+  sweep_segment = NULL;
+  shrink_target = 0;
+  while (segments->next)
+  {
+    marksweep_segment *seg = segments->next;
+    segments->next = seg->next;
+    gc_free_segment((char *)seg);
+  }
+  mark_stack_term(&mark_stack);
+#if defined(AQ_GC_THREADS)
+  parallel_mark_term();
+#endif
+}
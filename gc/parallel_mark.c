@@ -0,0 +1,333 @@
+#include "base.h"
+
+#if defined(AQ_GC_THREADS)
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+
+#define DEQUE_INIT_SIZE (512)
+#define STEAL_MAX (256)
+#define IDLE_SPIN (64)
+
+//mark deque: its owner pushes and pops at the bottom, thieves take from the top.
+struct _mark_deque
+{
+  pthread_mutex_t lock;
+  Cell *cells;
+  int top;
+  int bottom;
+  int size;
+};
+typedef struct _mark_deque mark_deque;
+
+static mark_deque deques[MAX_GC_THREADS];
+static pthread_t workers[MAX_GC_THREADS];
+static int worker_num = 0;
+static __thread mark_deque *my_deque = NULL;
+static aq_bool (*mark_fn)(Cell *objp) = NULL;
+
+//the collecting thread is worker 0; the others wait in the pool for the next collection.
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_start = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pool_done = PTHREAD_COND_INITIALIZER;
+static int pool_epoch = 0;
+static int pool_running = 0;
+static aq_bool pool_closing = FALSE;
+static int idle_num = 0;
+
+//an idle worker spins for a while, then sleeps on pool_work until a push or the end of the mark.
+//idle_waiting is the number of sleepers nobody has woken yet, changed under pool_lock.
+static pthread_cond_t pool_work = PTHREAD_COND_INITIALIZER;
+static int idle_waiting = 0;
+
+static void deque_push(mark_deque *deque, Cell obj);
+static aq_bool deque_pop(mark_deque *deque, Cell *objp);
+static aq_bool steal(int index);
+static aq_bool work_left();
+static aq_bool wait_work();
+static void mark_visit(Cell *objp);
+static void mark_worker(int index);
+static void *worker_main(void *arg);
+static void pool_start_workers(int num);
+
+void deque_push(mark_deque *deque, Cell obj)
+{
+  pthread_mutex_lock(&deque->lock);
+  if (deque->bottom >= deque->size)
+  {
+    if (deque->top > 0)
+    {
+      memmove(deque->cells, deque->cells + deque->top, (deque->bottom - deque->top) * sizeof(Cell));
+      deque->bottom -= deque->top;
+      deque->top = 0;
+    }
+    else
+    {
+      int size = deque->size ? deque->size * 2 : DEQUE_INIT_SIZE;
+      Cell *cells = (Cell *)AQ_REALLOC(deque->cells, size * sizeof(Cell));
+      if (!cells)
+      {
+        heap_exhausted_error();
+      }
+      deque->cells = cells;
+      deque->size = size;
+    }
+  }
+  deque->cells[deque->bottom++] = obj;
+  pthread_mutex_unlock(&deque->lock);
+
+  if (__atomic_load_n(&idle_waiting, __ATOMIC_SEQ_CST) > 0)
+  {
+    pthread_mutex_lock(&pool_lock);
+    if (idle_waiting > 0)
+    {
+      __atomic_sub_fetch(&idle_waiting, 1, __ATOMIC_SEQ_CST);
+      pthread_cond_signal(&pool_work);
+    }
+    pthread_mutex_unlock(&pool_lock);
+  }
+}
+
+aq_bool deque_pop(mark_deque *deque, Cell *objp)
+{
+  aq_bool ret = FALSE;
+  pthread_mutex_lock(&deque->lock);
+  if (deque->bottom > deque->top)
+  {
+    *objp = deque->cells[--deque->bottom];
+    ret = TRUE;
+  }
+  if (deque->bottom == deque->top)
+  {
+    deque->bottom = deque->top = 0;
+  }
+  pthread_mutex_unlock(&deque->lock);
+  return ret;
+}
+
+// moves half of the oldest entries of another worker's deque to the deque of index.
+aq_bool steal(int index)
+{
+  Cell stolen[STEAL_MAX];
+  int i;
+  for (i = 1; i < worker_num; i++)
+  {
+    mark_deque *victim = &deques[(index + i) % worker_num];
+    int num = 0;
+    pthread_mutex_lock(&victim->lock);
+    if (victim->bottom > victim->top)
+    {
+      num = (victim->bottom - victim->top + 1) / 2;
+      num = num < STEAL_MAX ? num : STEAL_MAX;
+      memcpy(stolen, victim->cells + victim->top, num * sizeof(Cell));
+      victim->top += num;
+    }
+    pthread_mutex_unlock(&victim->lock);
+
+    if (num > 0)
+    {
+      int j;
+      for (j = 0; j < num; j++)
+      {
+        deque_push(my_deque, stolen[j]);
+      }
+      return TRUE;
+    }
+  }
+  return FALSE;
+}
+
+aq_bool work_left()
+{
+  int i;
+  aq_bool ret = FALSE;
+  for (i = 0; i < worker_num && !ret; i++)
+  {
+    pthread_mutex_lock(&deques[i].lock);
+    ret = deques[i].bottom > deques[i].top;
+    pthread_mutex_unlock(&deques[i].lock);
+  }
+  return ret;
+}
+
+// waits as an idle worker. returns TRUE when work shows up, FALSE when every worker is idle.
+// a sleeper counts itself in idle_waiting before it looks at the deques, so a push either is
+// seen by it or sees it.
+aq_bool wait_work()
+{
+  int spin;
+  aq_bool ret = FALSE;
+  for (spin = 0; spin < IDLE_SPIN; spin++)
+  {
+    if (__atomic_load_n(&idle_num, __ATOMIC_SEQ_CST) == worker_num)
+    {
+      break;
+    }
+    if (work_left())
+    {
+      return TRUE;
+    }
+    sched_yield();
+  }
+
+  pthread_mutex_lock(&pool_lock);
+  for (;;)
+  {
+    if (__atomic_load_n(&idle_num, __ATOMIC_SEQ_CST) == worker_num)
+    {
+      __atomic_store_n(&idle_waiting, 0, __ATOMIC_SEQ_CST);
+      pthread_cond_broadcast(&pool_work);
+      break;
+    }
+    __atomic_add_fetch(&idle_waiting, 1, __ATOMIC_SEQ_CST);
+    if (work_left())
+    {
+      __atomic_sub_fetch(&idle_waiting, 1, __ATOMIC_SEQ_CST);
+      ret = TRUE;
+      break;
+    }
+    //the waker has taken this sleeper off idle_waiting.
+    pthread_cond_wait(&pool_work, &pool_lock);
+  }
+  pthread_mutex_unlock(&pool_lock);
+  return ret;
+}
+
+void mark_visit(Cell *objp)
+{
+  if (*objp && mark_fn(objp))
+  {
+    deque_push(my_deque, *objp);
+  }
+}
+
+// marks from the roots of its part, then from its deque and stolen work until every worker is idle.
+// a worker only goes idle with an empty deque, and only busy workers push, so when all of
+// them are idle no marking work is left.
+void mark_worker(int index)
+{
+  Cell obj;
+  my_deque = &deques[index];
+  trace_roots_part(index, worker_num, mark_visit);
+  for (;;)
+  {
+    while (deque_pop(my_deque, &obj))
+    {
+      trace_object(obj, mark_visit);
+    }
+    if (steal(index))
+    {
+      continue;
+    }
+
+    __atomic_add_fetch(&idle_num, 1, __ATOMIC_SEQ_CST);
+    if (!wait_work())
+    {
+      return;
+    }
+    __atomic_sub_fetch(&idle_num, 1, __ATOMIC_SEQ_CST);
+  }
+}
+
+void *worker_main(void *arg)
+{
+  int index = (int)(size_t)arg;
+  int epoch = 0;
+  pthread_mutex_lock(&pool_lock);
+  for (;;)
+  {
+    while (epoch == pool_epoch && !pool_closing)
+    {
+      pthread_cond_wait(&pool_start, &pool_lock);
+    }
+    if (pool_closing)
+    {
+      break;
+    }
+    epoch = pool_epoch;
+    pthread_mutex_unlock(&pool_lock);
+
+    mark_worker(index);
+
+    pthread_mutex_lock(&pool_lock);
+    if (--pool_running == 0)
+    {
+      pthread_cond_signal(&pool_done);
+    }
+  }
+  pthread_mutex_unlock(&pool_lock);
+  return NULL;
+}
+
+void pool_start_workers(int num)
+{
+  int i;
+  parallel_mark_term();
+  for (i = 0; i < num; i++)
+  {
+    pthread_mutex_init(&deques[i].lock, NULL);
+  }
+  worker_num = 1;
+  for (i = 1; i < num; i++)
+  {
+    if (pthread_create(&workers[i], NULL, worker_main, (void *)(size_t)i) != 0)
+    {
+      break;
+    }
+    worker_num++;
+  }
+}
+
+void parallel_mark(aq_bool (*mark)(Cell *objp))
+{
+  int num = g_GC_threads < MAX_GC_THREADS ? g_GC_threads : MAX_GC_THREADS;
+  if (worker_num != num)
+  {
+    pool_start_workers(num);
+  }
+
+  mark_fn = mark;
+  idle_num = 0;
+  idle_waiting = 0;
+  pthread_mutex_lock(&pool_lock);
+  pool_running = worker_num - 1;
+  pool_epoch++;
+  pthread_cond_broadcast(&pool_start);
+  pthread_mutex_unlock(&pool_lock);
+
+  mark_worker(0);
+
+  pthread_mutex_lock(&pool_lock);
+  while (pool_running > 0)
+  {
+    pthread_cond_wait(&pool_done, &pool_lock);
+  }
+  pthread_mutex_unlock(&pool_lock);
+}
+
+int gc_worker_index()
+{
+  return (int)(my_deque - deques);
+}
+
+void parallel_mark_term()
+{
+  int i;
+  pthread_mutex_lock(&pool_lock);
+  pool_closing = TRUE;
+  pthread_cond_broadcast(&pool_start);
+  pthread_mutex_unlock(&pool_lock);
+  for (i = 1; i < worker_num; i++)
+  {
+    pthread_join(workers[i], NULL);
+  }
+  for (i = 0; i < worker_num; i++)
+  {
+    pthread_mutex_destroy(&deques[i].lock);
+    AQ_FREE(deques[i].cells);
+    memset(&deques[i], 0, sizeof(mark_deque));
+  }
+  worker_num = 0;
+  pool_closing = FALSE;
+}
+#endif
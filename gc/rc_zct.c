@@ -1,6 +1,15 @@
 #include "base.h"
 #include <string.h>
 
+// Deutsch-Bobrow's deferred reference counting. the counts only hold the
+// references from the heap: pushes, pops and stores into the stack and
+// the global variables are not counted, so the stack is left to the
+// default operations. an object whose count is zero is put in the zero
+// count table (ZCT) instead of being reclaimed. once ZCT_BATCH objects
+// have joined the ZCT since the last reconciliation, or the heap runs
+// out, the roots are counted for a while, the objects of the ZCT that
+// are still at zero are reclaimed, and the counts of the roots are taken
+// back.
 struct _rc_zct_header
 {
   int obj_size;
@@ -9,26 +18,26 @@ struct _rc_zct_header
 };
 typedef struct _rc_zct_header rc_zct_header;
 
-static void gc_start_reference_coun();
-static inline void *gc_malloc_reference_coun(size_t size);
-static void gc_write_barrier_reference_coun(Cell obj, Cell *cellp, Cell newcell);
-static void gc_write_barrier_root_reference_coun(Cell *cellp, Cell newcell);
-static void gc_init_ptr_reference_coun(Cell *cellp, Cell newcell);
-static void gc_memcpy_reference_coun(char *dst, char *src, size_t size);
+static void gc_start_rc_zct();
+static inline void *gc_malloc_rc_zct(size_t size);
+static void gc_write_barrier_rc_zct(Cell obj, Cell *cellp, Cell newcell);
+static void gc_init_ptr_rc_zct(Cell *cellp, Cell newcell);
+static void gc_memcpy_rc_zct(char *dst, char *src, size_t size);
 static void reclaim_obj(Cell obj);
 static void increment_count(Cell *objp);
 static void decrement_count(Cell *objp);
-static void gc_term_reference_coun();
+static void add_zct(Cell obj);
+static void gc_term_rc_zct();
 
 static char *heap = NULL;
 static free_chunk *freelist = NULL;
-static int zct_index = 0;
-static void add_zct(Cell c);
-#define ZCT_SIZE (10)
-static Cell ZCT[ZCT_SIZE];
 
-static void push_reference_coun(Cell c);
-static Cell pop_reference_coun();
+#define ZCT_BATCH (4096)
+static gc_mark_stack zct;
+
+// the objects only the roots refer to go back to the ZCT at each
+// reconciliation; zct_base of them were left by the last one.
+static int zct_base = 0;
 
 #define GET_OBJECT_SIZE(obj) (((rc_zct_header *)(obj)-1)->obj_size)
 
@@ -44,39 +53,34 @@ void gc_init_rc_zct(aq_gc_info *gc_info)
   freelist = (free_chunk *)heap;
   freelist->chunk_size = get_heap_size();
   freelist->next = NULL;
-
-  gc_info->gc_malloc = gc_malloc_reference_coun;
-  gc_info->gc_start = gc_start_reference_coun;
-  gc_info->gc_write_barrier = gc_write_barrier_reference_coun;
-  gc_info->gc_write_barrier_root = gc_write_barrier_root_reference_coun;
-  gc_info->gc_init_ptr = gc_init_ptr_reference_coun;
-  gc_info->gc_memcpy = gc_memcpy_reference_coun;
-  gc_info->gc_term = gc_term_reference_coun;
-  gc_info->gc_push_arg = push_reference_coun;
-  gc_info->gc_pop_arg = pop_reference_coun;
-
-  zct_index = 0;
-}
-
-void push_reference_coun(Cell c)
-{
-  push_arg_default(c);
-}
-
-Cell pop_reference_coun()
-{
-  return pop_arg_default();
+  mark_stack_init(&zct);
+  zct_base = 0;
+
+  gc_info->gc_malloc = gc_malloc_rc_zct;
+  gc_info->gc_start = gc_start_rc_zct;
+  gc_info->gc_write_barrier = gc_write_barrier_rc_zct;
+  gc_info->gc_init_ptr = gc_init_ptr_rc_zct;
+  gc_info->gc_memcpy = gc_memcpy_rc_zct;
+  gc_info->gc_term = gc_term_rc_zct;
 }
 
 //Allocation.
-void *gc_malloc_reference_coun(size_t size)
+void *gc_malloc_rc_zct(size_t size)
 {
-  size += sizeof(rc_zct_header);
   int allocate_size = (sizeof(rc_zct_header) + size + 3) / 4 * 4;
+  if (g_GC_stress || zct.top - zct_base >= ZCT_BATCH)
+  {
+    gc_start();
+  }
   free_chunk *chunk = aq_get_free_chunk(&freelist, allocate_size);
   if (!chunk)
   {
-    gc_start_reference_coun();
+    gc_start();
+    chunk = aq_get_free_chunk(&freelist, allocate_size);
+  }
+  if (!chunk)
+  {
+    heap_exhausted_error();
   }
   else if (chunk->chunk_size > allocate_size)
   {
@@ -89,9 +93,13 @@ void *gc_malloc_reference_coun(size_t size)
   REF_CNT(ret) = 0;
   IN_ZCT(ret) = FALSE;
 
+  //nothing in the heap refers to a new object yet.
+  add_zct(ret);
   return ret;
 }
 
+//the children whose counts drop to zero join the ZCT, so that the
+//reconciliation reclaims them in the same pass without recursion.
 void reclaim_obj(Cell obj)
 {
   REF_CNT(obj) = -1;
@@ -102,27 +110,30 @@ void reclaim_obj(Cell obj)
   put_chunk_to_freelist(&freelist, obj_top, obj_size);
 }
 
-//Start Garbage Collection.
-void gc_start_reference_coun()
+//Start Garbage Collection: reconciles the ZCT with the roots.
+void gc_start_rc_zct()
 {
+  int index;
   trace_roots(increment_count);
-  int index = zct_index - 1;
-  while (index >= 0)
+  for (index = 0; index < zct.top; index++)
   {
-    if (REF_CNT(ZCT[index]) == 0)
+    Cell obj = zct.cells[index];
+    IN_ZCT(obj) = FALSE;
+    if (REF_CNT(obj) == 0)
     {
-      reclaim_obj(ZCT[index]);
-      ZCT[index] = ZCT[zct_index--];
-      index--;
+      reclaim_obj(obj);
     }
   }
+  zct.top = 0;
+  //the objects only the roots refer to go back to the ZCT.
   trace_roots(decrement_count);
+  zct_base = zct.top;
 }
 
 //For compatibility to trace_object(), this function receives a pointer to Cell.
 void increment_count(Cell *objp)
 {
-  if (!CELL_P(*objp))
+  if (!HEAP_CELL_P(*objp))
   {
     return;
   }
@@ -138,17 +149,13 @@ void add_zct(Cell obj)
   if (!IN_ZCT(obj))
   {
     IN_ZCT(obj) = TRUE;
-    ZCT[zct_index++] = obj;
-    if (zct_index >= ZCT_SIZE)
-    {
-      gc_start_reference_coun();
-    }
+    MARK_STACK_PUSH(&zct, obj);
   }
 }
 
 void decrement_count(Cell *objp)
 {
-  if (!CELL_P(*objp))
+  if (!HEAP_CELL_P(*objp))
   {
     return;
   }
@@ -164,31 +171,29 @@ void decrement_count(Cell *objp)
 }
 
 //Write Barrier.
-void gc_write_barrier_reference_coun(Cell obj, Cell *cellp, Cell newcell)
+void gc_write_barrier_rc_zct(Cell obj, Cell *cellp, Cell newcell)
 {
   increment_count(&newcell);
   decrement_count(cellp);
   *cellp = newcell;
 }
 
-void gc_write_barrier_root_reference_coun(Cell *cellp, Cell newcell)
-{
-  *cellp = newcell;
-}
-
 //Init Pointer.
-void gc_init_ptr_reference_coun(Cell *cellp, Cell newcell)
+void gc_init_ptr_rc_zct(Cell *cellp, Cell newcell)
 {
   increment_count(&newcell);
   *cellp = newcell;
 }
 
 //memcpy.
-void gc_memcpy_reference_coun(char *dst, char *src, size_t size)
+void gc_memcpy_rc_zct(char *dst, char *src, size_t size)
 {
   memcpy(dst, src, size);
   trace_object((Cell)dst, increment_count);
 }
 
 //term.
-void gc_term_reference_coun() {}
+void gc_term_rc_zct()
+{
+  mark_stack_term(&zct);
+}
@@ -105,7 +105,7 @@ void gc_start_reference_count()
 //For compatibility to trace_object(), this function receives a pointer to Cell.
 void increment_count(Cell *objp)
 {
-  if (!CELL_P(*objp))
+  if (!HEAP_CELL_P(*objp))
   {
     return;
   }
@@ -118,7 +118,7 @@ void increment_count(Cell *objp)
 
 void decrement_count(Cell *objp)
 {
-  if (!CELL_P(*objp))
+  if (!HEAP_CELL_P(*objp))
   {
     return;
   }
@@ -0,0 +1,371 @@
+#include "base.h"
+#include <string.h>
+#if defined(AQ_GC_THREADS)
+#include <pthread.h>
+#endif
+
+// Yuasa's snapshot-at-the-beginning collector. a collection marks the
+// roots in a pause, then a marker thread traces the heap while the
+// interpreter runs. the write barrier logs the pointer a store
+// overwrites, so that every object reachable at the snapshot is marked,
+// and objects allocated during the mark are allocated marked (black).
+// once the mark is done, the allocator sweeps the heap lazily.
+struct _snapshot_gc_header
+{
+  int obj_size;
+};
+typedef struct _snapshot_gc_header snapshot_gc_header;
+
+#define MEMORY_ALIGNMENT (MARK_GRANULE)
+#define GET_OBJECT_SIZE(obj) (((snapshot_gc_header *)(obj)-1)->obj_size)
+
+// a mark starts when less than this percentage of the heap is free.
+#define MARK_START_FREE_RATIO (50)
+
+#define PHASE_IDLE (0)     // the heap has been swept.
+#define PHASE_MARKING (1)  // the marker is tracing the heap.
+#define PHASE_MARKED (2)   // the mark is done; the sweep has not started.
+#define PHASE_SWEEPING (3) // the allocator sweeps from sweep_scan.
+static int phase = PHASE_IDLE;
+#define PHASE() ATOMIC_LOAD(&phase)
+
+static mark_bitmap mark_bits;
+static size_t heap_size = 0;
+static free_chunk *freelist = NULL;
+static size_t free_size = 0;
+static char *sweep_scan = NULL;
+
+// mark_stack is used by the marker during the mark; satb_log keeps the
+// pointers the barrier logged, guarded by lock.
+static gc_mark_stack mark_stack;
+static gc_mark_stack satb_log;
+
+#if defined(AQ_GC_THREADS)
+static pthread_t marker;
+static aq_bool marker_running = FALSE;
+static aq_bool marker_closing = FALSE;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t mark_start = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t mark_end = PTHREAD_COND_INITIALIZER;
+#define LOCK() pthread_mutex_lock(&lock)
+#define UNLOCK() pthread_mutex_unlock(&lock)
+#else
+#define LOCK()
+#define UNLOCK()
+#endif
+
+static void gc_start_snapshot();
+static inline void *gc_malloc_snapshot(size_t size);
+static void gc_write_barrier_snapshot(Cell cell, Cell *cellp, Cell newcell);
+static void gc_term_snapshot();
+
+static aq_bool try_mark(Cell obj);
+static void mark_object(Cell *objp);
+static void mark_heap();
+static void start_mark();
+static void wait_mark();
+static void start_sweep();
+static aq_bool sweep_step(size_t size);
+static free_chunk *get_chunk(size_t size);
+
+aq_bool try_mark(Cell obj)
+{
+  snapshot_gc_header *header = (snapshot_gc_header *)obj - 1;
+#if defined(AQ_GC_THREADS)
+  return MARK_BITMAP_TEST_AND_SET(&mark_bits, header);
+#else
+  if (MARK_BITMAP_TEST(&mark_bits, header))
+  {
+    return FALSE;
+  }
+  MARK_BITMAP_SET(&mark_bits, header);
+  return TRUE;
+#endif
+}
+
+void mark_object(Cell *objp)
+{
+  Cell obj = *objp;
+  if (obj && try_mark(obj))
+  {
+    MARK_STACK_PUSH(&mark_stack, obj);
+  }
+}
+
+// traces the heap from mark_stack and the logged pointers. the mark is
+// done when both are empty, which is checked under the lock the barrier
+// logs with.
+void mark_heap()
+{
+  for (;;)
+  {
+    while (!MARK_STACK_EMPTY_P(&mark_stack))
+    {
+      trace_object(MARK_STACK_POP(&mark_stack), mark_object);
+    }
+
+    LOCK();
+    if (MARK_STACK_EMPTY_P(&satb_log))
+    {
+      ATOMIC_STORE(&phase, PHASE_MARKED);
+#if defined(AQ_GC_THREADS)
+      pthread_cond_broadcast(&mark_end);
+#endif
+      UNLOCK();
+      return;
+    }
+    while (!MARK_STACK_EMPTY_P(&satb_log))
+    {
+      Cell obj = MARK_STACK_POP(&satb_log);
+      mark_object(&obj);
+    }
+    UNLOCK();
+  }
+}
+
+#if defined(AQ_GC_THREADS)
+static void *marker_main(void *arg)
+{
+  (void)arg;
+  LOCK();
+  for (;;)
+  {
+    while (PHASE() != PHASE_MARKING && !marker_closing)
+    {
+      pthread_cond_wait(&mark_start, &lock);
+    }
+    if (marker_closing)
+    {
+      break;
+    }
+    UNLOCK();
+    mark_heap();
+    LOCK();
+  }
+  UNLOCK();
+  return NULL;
+}
+#endif
+
+// the pause of a collection: takes the snapshot of the roots, and hands
+// the rest of the mark to the marker.
+void start_mark()
+{
+  mark_bitmap_clear(&mark_bits);
+  mark_stack.top = 0;
+  satb_log.top = 0;
+  trace_roots(mark_object);
+
+#if defined(AQ_GC_THREADS)
+  if (marker_running)
+  {
+    LOCK();
+    ATOMIC_STORE(&phase, PHASE_MARKING);
+    pthread_cond_signal(&mark_start);
+    UNLOCK();
+    return;
+  }
+#endif
+  ATOMIC_STORE(&phase, PHASE_MARKING);
+  mark_heap();
+}
+
+void wait_mark()
+{
+  LOCK();
+#if defined(AQ_GC_THREADS)
+  while (PHASE() == PHASE_MARKING)
+  {
+    pthread_cond_wait(&mark_end, &lock);
+  }
+#endif
+  UNLOCK();
+}
+
+// the free chunks left are unmarked, so the sweep finds them again.
+void start_sweep()
+{
+  freelist = NULL;
+  free_size = 0;
+  sweep_scan = aq_heap;
+  ATOMIC_STORE(&phase, PHASE_SWEEPING);
+}
+
+// sweeps until a free chunk of at least size bytes is made; returns
+// FALSE if the end of the heap has been reached without one.
+aq_bool sweep_step(size_t size)
+{
+  char *scan_end = aq_heap + heap_size;
+  while (sweep_scan < scan_end)
+  {
+    char *live = mark_bitmap_next(&mark_bits, sweep_scan, scan_end);
+    size_t chunk_size = live - sweep_scan;
+    if (chunk_size > 0)
+    {
+      free_chunk *chunk = (free_chunk *)sweep_scan;
+      chunk->chunk_size = chunk_size;
+      chunk->next = freelist;
+      freelist = chunk;
+      free_size += chunk_size;
+    }
+    sweep_scan = (live < scan_end) ? live + GET_OBJECT_SIZE((snapshot_gc_header *)live + 1) : scan_end;
+    if (chunk_size > 0 && chunk_size >= size)
+    {
+      return TRUE;
+    }
+  }
+  ATOMIC_STORE(&phase, PHASE_IDLE);
+  return FALSE;
+}
+
+free_chunk *get_chunk(size_t size)
+{
+  free_chunk *chunk = aq_get_free_chunk(&freelist, size);
+  while (!chunk && PHASE() == PHASE_SWEEPING && sweep_step(size))
+  {
+    chunk = aq_get_free_chunk(&freelist, size);
+  }
+  return chunk;
+}
+
+//Initialization.
+void gc_init_snapshot(aq_gc_info *gc_info)
+{
+  mark_stack_init(&mark_stack);
+  mark_stack_init(&satb_log);
+
+  heap_size = mark_bitmap_init(&mark_bits, aq_heap, get_heap_size());
+  mark_bitmap_clear(&mark_bits);
+  freelist = (free_chunk *)aq_heap;
+  freelist->chunk_size = heap_size;
+  freelist->next = NULL;
+  free_size = heap_size;
+  ATOMIC_STORE(&phase, PHASE_IDLE);
+
+#if defined(AQ_GC_THREADS)
+  marker_closing = FALSE;
+  marker_running = (pthread_create(&marker, NULL, marker_main, NULL) == 0);
+#endif
+
+  gc_info->gc_malloc = gc_malloc_snapshot;
+  gc_info->gc_start = gc_start_snapshot;
+  gc_info->gc_write_barrier = gc_write_barrier_snapshot;
+  gc_info->gc_init_ptr = NULL;
+  gc_info->gc_memcpy = NULL;
+  gc_info->gc_term = gc_term_snapshot;
+}
+
+//Allocation.
+void *gc_malloc_snapshot(size_t size)
+{
+  int allocate_size = (sizeof(snapshot_gc_header) + size + MEMORY_ALIGNMENT - 1) / MEMORY_ALIGNMENT * MEMORY_ALIGNMENT;
+  if (g_GC_stress)
+  {
+    gc_start();
+  }
+
+  if (PHASE() == PHASE_MARKED)
+  {
+    start_sweep();
+  }
+  if (PHASE() == PHASE_IDLE && free_size < heap_size * MARK_START_FREE_RATIO / 100)
+  {
+    start_mark();
+  }
+
+  free_chunk *chunk = get_chunk(allocate_size);
+  if (!chunk)
+  {
+    // the allocation waits for the mark in progress, then for a full collection.
+    wait_mark();
+    if (PHASE() == PHASE_MARKED)
+    {
+      start_sweep();
+      chunk = get_chunk(allocate_size);
+    }
+    if (!chunk)
+    {
+      gc_start();
+      chunk = get_chunk(allocate_size);
+    }
+    if (!chunk)
+    {
+      heap_exhausted_error();
+    }
+  }
+  if (chunk->chunk_size > allocate_size)
+  {
+    allocate_size = chunk->chunk_size;
+  }
+  free_size -= allocate_size;
+
+  snapshot_gc_header *new_header = (snapshot_gc_header *)chunk;
+  new_header->obj_size = allocate_size;
+  Cell ret = (Cell)(new_header + 1);
+
+  // allocated black while the marks are in use.
+  int current = PHASE();
+  if (current == PHASE_MARKING || current == PHASE_MARKED)
+  {
+    try_mark(ret);
+  }
+  return ret;
+}
+
+//Write Barrier: Yuasa's deletion barrier.
+void gc_write_barrier_snapshot(Cell cell, Cell *cellp, Cell newcell)
+{
+  (void)cell;
+  Cell old = *cellp;
+  if (PHASE() == PHASE_MARKING && HEAP_CELL_P(old))
+  {
+    LOCK();
+    if (PHASE() == PHASE_MARKING)
+    {
+      MARK_STACK_PUSH(&satb_log, old);
+    }
+    UNLOCK();
+  }
+  *cellp = newcell;
+}
+
+//Start Garbage Collection: a full collection, which finishes the one in
+//progress and then marks and sweeps the heap in a pause.
+void gc_start_snapshot()
+{
+  wait_mark();
+  if (PHASE() == PHASE_MARKED)
+  {
+    start_sweep();
+  }
+  while (PHASE() == PHASE_SWEEPING)
+  {
+    sweep_step(heap_size + 1);
+  }
+
+  start_mark();
+  wait_mark();
+  start_sweep();
+  while (PHASE() == PHASE_SWEEPING)
+  {
+    sweep_step(heap_size + 1);
+  }
+}
+
+//term.
+void gc_term_snapshot()
+{
+#if defined(AQ_GC_THREADS)
+  if (marker_running)
+  {
+    LOCK();
+    marker_closing = TRUE;
+    pthread_cond_signal(&mark_start);
+    UNLOCK();
+    pthread_join(marker, NULL);
+    marker_running = FALSE;
+  }
+#endif
+  mark_stack_term(&mark_stack);
+  mark_stack_term(&satb_log);
+}
@@ -0,0 +1,935 @@
+// Baseline JIT: the bytecode of a lambda called more often than
+// g_JIT_threshold is translated into x86-64 code with a template per
+// instruction. Values stay on the VM stack, so the collectors see the same
+// roots as with the interpreter. Allocation, calls and the slow paths of
+// the templates go back into the runtime; instructions without a template
+// are run by the VM one at a time.
+#include <string.h>
+#include <stddef.h>
+#include <stdarg.h>
+
+#include "aquario.h"
+#include "gc/base.h"
+
+#if defined(AQ_JIT)
+#include <sys/mman.h>
+
+#define JIT_REGION_SIZE (4 * 1024 * 1024)
+#define JIT_TABLE_SIZE (1024)
+
+// x86-64 registers and condition codes used by the templates.
+#define REG_RAX (0)
+#define REG_RDX (2)
+#define CC_E (0x4)
+#define CC_NE (0x5)
+#define CC_L (0xC)
+#define CC_GE (0xD)
+#define CC_LE (0xE)
+#define CC_G (0xF)
+#define CC_NONE (-1)
+
+// native code of a lambda, keyed by its address in the bytecode.
+struct _jit_entry
+{
+  char *buf;
+  int addr;
+  int end;
+  int count;
+  aq_bool failed;
+  aq_jit_code code;
+  struct _jit_entry *next;
+};
+typedef struct _jit_entry jit_entry;
+
+static jit_entry *jit_table[JIT_TABLE_SIZE];
+static unsigned char *jit_region = NULL;
+static size_t jit_region_top = 0;
+
+// slow path of a template: runs [pc, end) with the VM and goes on at next_label.
+struct _jit_stub
+{
+  int label;
+  int pc;
+  int end;
+  int next_label;
+};
+typedef struct _jit_stub jit_stub;
+
+struct _jit_state
+{
+  char *buf;
+  int start; // the lambda's bytecode is [start, end).
+  int end;
+  aq_bool plain_stack;
+
+  unsigned char *code;
+  int size;
+  int capacity;
+
+  // labels 0 to end - start are the instructions, the rest are internal.
+  int *labels;
+  int label_num;
+  int label_capacity;
+
+  // pairs of the position of a rel32 and its label.
+  int *fixups;
+  int fixup_num;
+  int fixup_capacity;
+
+  jit_stub *stubs;
+  int stub_num;
+  int stub_capacity;
+
+  int entry_label;
+  int exit_label;
+  int error_label;
+};
+typedef struct _jit_state jit_state;
+
+static void *grow(void *array, int *capacity, int num, size_t elem_size)
+{
+  if (num < *capacity)
+  {
+    return array;
+  }
+  while (num >= *capacity)
+  {
+    *capacity = (*capacity == 0) ? 64 : *capacity * 2;
+  }
+  return realloc(array, *capacity * elem_size);
+}
+
+static void emit(jit_state *st, int num, ...)
+{
+  va_list args;
+  va_start(args, num);
+  st->code = grow(st->code, &st->capacity, st->size + num, sizeof(unsigned char));
+  for (int i = 0; i < num; i++)
+  {
+    st->code[st->size++] = (unsigned char)va_arg(args, int);
+  }
+  va_end(args);
+}
+
+static void emit32(jit_state *st, int val)
+{
+  emit(st, 4, val & 0xFF, (val >> 8) & 0xFF, (val >> 16) & 0xFF, (val >> 24) & 0xFF);
+}
+
+static void emit64(jit_state *st, long val)
+{
+  emit32(st, (int)val);
+  emit32(st, (int)(val >> 32));
+}
+
+static int new_label(jit_state *st)
+{
+  st->labels = grow(st->labels, &st->label_capacity, st->label_num + 1, sizeof(int));
+  st->labels[st->label_num] = -1;
+  return st->label_num++;
+}
+
+static int inst_label(jit_state *st, int pc)
+{
+  return pc - st->start;
+}
+
+static void bind_label(jit_state *st, int label)
+{
+  st->labels[label] = st->size;
+}
+
+// jmp, or jcc with a condition code, to a label.
+static void emit_jump(jit_state *st, int cc, int label)
+{
+  if (cc == CC_NONE)
+  {
+    emit(st, 1, 0xE9);
+  }
+  else
+  {
+    emit(st, 2, 0x0F, 0x80 + cc);
+  }
+  st->fixups = grow(st->fixups, &st->fixup_capacity, st->fixup_num + 2, sizeof(int));
+  st->fixups[st->fixup_num++] = st->size;
+  st->fixups[st->fixup_num++] = label;
+  emit32(st, 0);
+}
+
+// mov reg, imm64
+static void emit_mov_imm(jit_state *st, int reg, long val)
+{
+  emit(st, 2, (reg >= 8) ? 0x49 : 0x48, 0xB8 + (reg & 7));
+  emit64(st, val);
+}
+
+static void emit_call(jit_state *st, void *func)
+{
+  emit_mov_imm(st, REG_RAX, (long)func);
+  emit(st, 2, 0xFF, 0xD0); // call rax
+}
+
+// calls func(buf, pc), or func(buf, pc, end) for jit_run().
+static void emit_call_runtime(jit_state *st, void *func, int pc, int end)
+{
+  emit_mov_imm(st, 7, (long)st->buf); // rdi
+  emit(st, 1, 0xBE);                  // mov esi, pc
+  emit32(st, pc);
+  if (end >= 0)
+  {
+    emit(st, 1, 0xBA); // mov edx, end
+    emit32(st, end);
+  }
+  emit_call(st, func);
+}
+
+// leaves with the error when the runtime returns a negative value.
+static void emit_check_error(jit_state *st)
+{
+  emit(st, 2, 0x85, 0xC0); // test eax, eax
+  emit_jump(st, 0x8, st->error_label);
+}
+
+// a slow path which replays [pc, end) with the VM; the templates jump to
+// it before they have changed anything.
+static int new_stub(jit_state *st, int pc, int end)
+{
+  st->stubs = grow(st->stubs, &st->stub_capacity, st->stub_num + 1, sizeof(jit_stub));
+  jit_stub *stub = &st->stubs[st->stub_num++];
+  stub->label = new_label(st);
+  stub->pc = pc;
+  stub->end = end;
+  stub->next_label = inst_label(st, end);
+  return stub->label;
+}
+
+// rcx = stack_top
+static void emit_load_top_index(jit_state *st)
+{
+  emit(st, 4, 0x49, 0x63, 0x0C, 0x24); // movsxd rcx, dword [r12]
+}
+
+// rax = STACK_TOP, and rdx = STACK_TOP_NEXT if both is TRUE.
+static void emit_peek(jit_state *st, aq_bool both)
+{
+  emit_load_top_index(st);
+  emit(st, 5, 0x48, 0x8B, 0x44, 0xCB, 0xF8); // mov rax, [rbx + rcx * 8 - 8]
+  if (both)
+  {
+    emit(st, 5, 0x48, 0x8B, 0x54, 0xCB, 0xF0); // mov rdx, [rbx + rcx * 8 - 16]
+  }
+}
+
+static void emit_push_rax(jit_state *st)
+{
+  if (st->plain_stack)
+  {
+    emit_load_top_index(st);
+    emit(st, 4, 0x48, 0x89, 0x04, 0xCB); // mov [rbx + rcx * 8], rax
+    emit(st, 4, 0x41, 0xFF, 0x04, 0x24); // inc dword [r12]
+  }
+  else
+  {
+    emit(st, 3, 0x48, 0x89, 0xC7); // mov rdi, rax
+    emit_call(st, push_arg);
+  }
+}
+
+static void emit_pop_rax(jit_state *st)
+{
+  if (st->plain_stack)
+  {
+    emit(st, 4, 0x41, 0xFF, 0x0C, 0x24); // dec dword [r12]
+    emit_load_top_index(st);
+    emit(st, 4, 0x48, 0x8B, 0x04, 0xCB); // mov rax, [rbx + rcx * 8]
+  }
+  else
+  {
+    emit_call(st, pop_arg);
+  }
+}
+
+// pops num values and pushes rax.
+static void emit_replace_rax(jit_state *st, int num)
+{
+  if (st->plain_stack)
+  {
+    if (num > 1)
+    {
+      emit(st, 5, 0x41, 0x83, 0x2C, 0x24, num - 1); // sub dword [r12], num - 1
+    }
+    emit_load_top_index(st);
+    emit(st, 5, 0x48, 0x89, 0x44, 0xCB, 0xF8); // mov [rbx + rcx * 8 - 8], rax
+  }
+  else
+  {
+    emit(st, 3, 0x49, 0x89, 0xC6); // mov r14, rax
+    for (int i = 0; i < num; i++)
+    {
+      emit_call(st, pop_arg);
+    }
+    emit(st, 3, 0x4C, 0x89, 0xF0); // mov rax, r14
+    emit_push_rax(st);
+  }
+}
+
+// replaces STACK_TOP with rax through the root write barrier.
+static void emit_set_top_rax(jit_state *st)
+{
+  emit_load_top_index(st);
+  if (st->plain_stack)
+  {
+    emit(st, 5, 0x48, 0x89, 0x44, 0xCB, 0xF8); // mov [rbx + rcx * 8 - 8], rax
+  }
+  else
+  {
+    emit(st, 5, 0x48, 0x8D, 0x7C, 0xCB, 0xF8); // lea rdi, [rbx + rcx * 8 - 8]
+    emit(st, 3, 0x48, 0x89, 0xC6);             // mov rsi, rax
+    emit_call(st, gc_write_barrier_root);
+  }
+}
+
+// reg = the local at offset, the same slot as OP_LOAD reads.
+static void emit_load_local(jit_state *st, int reg, int offset)
+{
+  emit(st, 3, 0x49, 0x8B, (reg == REG_RAX) ? 0x85 : 0x95); // mov reg, [r13 + disp32]
+  emit32(st, -offset * (int)sizeof(Cell));
+}
+
+static void emit_check_int(jit_state *st, int reg, int stub)
+{
+  if (reg == REG_RAX)
+  {
+    emit(st, 2, 0xA8, 0x01); // test al, 1
+  }
+  else
+  {
+    emit(st, 3, 0xF6, 0xC2, 0x01); // test dl, 1
+  }
+  emit_jump(st, CC_E, stub);
+}
+
+static void emit_check_pair(jit_state *st, int stub)
+{
+  emit(st, 3, 0x48, 0x85, 0xC0); // test rax, rax
+  emit_jump(st, CC_E, stub);
+  emit(st, 2, 0xA8, 0x03); // test al, 3
+  emit_jump(st, CC_NE, stub);
+  emit(st, 3, 0x83, 0x38, T_PAIR); // cmp dword [rax], T_PAIR
+  emit_jump(st, CC_NE, stub);
+}
+
+// rax = CAR(rax) or CDR(rax)
+static void emit_load_field(jit_state *st, size_t offset)
+{
+  emit(st, 4, 0x48, 0x8B, 0x40, (int)offset); // mov rax, [rax + offset]
+}
+
+// INT_VALUE() of eax and edx.
+// reg = the integer of a register operand which is not a temporary.
+static void emit_load_int_operand(jit_state *st, int reg, int operand, int stub)
+{
+  if (IMMEDIATE_OPERAND_P(operand))
+  {
+    emit(st, 1, (reg == REG_RAX) ? 0xB8 : 0xBA); // mov reg, imm32
+    emit32(st, operand >> 1);
+    return;
+  }
+  emit_load_local(st, reg, -(operand >> 1) - 4);
+  emit_check_int(st, reg, stub);
+  emit(st, 2, 0xD1, (reg == REG_RAX) ? 0xF8 : 0xFA); // sar reg, 1
+}
+
+static void emit_untag(jit_state *st, aq_bool both)
+{
+  emit(st, 2, 0xD1, 0xF8); // sar eax, 1
+  if (both)
+  {
+    emit(st, 2, 0xD1, 0xFA); // sar edx, 1
+  }
+}
+
+// rax = make_integer(eax)
+static void emit_tag(jit_state *st)
+{
+  emit(st, 3, 0x48, 0x63, 0xC0);             // movsxd rax, eax
+  emit(st, 5, 0x48, 0x8D, 0x44, 0x00, 0x01); // lea rax, [rax + rax + 1]
+}
+
+// rax = AQ_TRUE or AQ_FALSE by the flags.
+static void emit_bool(jit_state *st, int cc)
+{
+  emit(st, 3, 0x0F, 0x90 + cc, 0xC1); // setcc cl
+  emit(st, 3, 0x0F, 0xB6, 0xC9);      // movzx ecx, cl
+  emit(st, 2, 0x01, 0xC9);            // add ecx, ecx
+  emit(st, 2, 0x89, 0xC8);            // mov eax, ecx
+}
+
+static int comparison_cc(aq_opcode op)
+{
+  switch (op)
+  {
+  case OP_EQUAL:
+  case OP_JNEQUAL:
+  case OP_JNEQUAL_LL:
+  case OP_JNEQUAL_LI:
+  case OP_JNEQUAL_R:
+    return CC_E;
+  case OP_LT:
+  case OP_JNLT:
+  case OP_JNLT_LL:
+  case OP_JNLT_LI:
+  case OP_JNLT_R:
+    return CC_L;
+  case OP_LTE:
+  case OP_JNLTE:
+  case OP_JNLTE_LL:
+  case OP_JNLTE_LI:
+  case OP_JNLTE_R:
+    return CC_LE;
+  case OP_GT:
+  case OP_JNGT:
+  case OP_JNGT_LL:
+  case OP_JNGT_LI:
+  case OP_JNGT_R:
+    return CC_G;
+  default:
+    return CC_GE;
+  }
+}
+
+static aq_bool translate_inst(jit_state *st, int pc, int *next)
+{
+  aq_opcode op = (unsigned char)st->buf[pc];
+  char *buf = st->buf;
+  *next = pc + get_inst_size(buf, pc);
+  switch (op)
+  {
+  case OP_NOP:
+    break;
+  case OP_PUSH:
+  {
+    // (+ a b) and (* a b) push their number of arguments for OP_ADD and OP_MUL.
+    aq_opcode arith = (unsigned char)buf[*next];
+    if (get_operand(buf, pc + 1) == 2 && (arith == OP_ADD || arith == OP_MUL) &&
+        st->labels[inst_label(st, *next)] != -2)
+    {
+      int stub = new_stub(st, pc, *next + 1);
+      emit_peek(st, TRUE);
+      emit_check_int(st, REG_RAX, stub);
+      emit_check_int(st, REG_RDX, stub);
+      emit_untag(st, TRUE);
+      if (arith == OP_ADD)
+      {
+        emit(st, 2, 0x01, 0xD0); // add eax, edx
+      }
+      else
+      {
+        emit(st, 3, 0x0F, 0xAF, 0xC2); // imul eax, edx
+      }
+      emit_tag(st);
+      emit_replace_rax(st, 2);
+      *next += 1;
+      break;
+    }
+    emit_mov_imm(st, REG_RAX, (long)make_integer(get_operand(buf, pc + 1)));
+    emit_push_rax(st);
+    break;
+  }
+  case OP_PUSH_NIL:
+    emit_mov_imm(st, REG_RAX, AQ_NIL);
+    emit_push_rax(st);
+    break;
+  case OP_PUSH_TRUE:
+    emit_mov_imm(st, REG_RAX, AQ_TRUE);
+    emit_push_rax(st);
+    break;
+  case OP_PUSH_FALSE:
+    emit_mov_imm(st, REG_RAX, AQ_FALSE);
+    emit_push_rax(st);
+    break;
+  case OP_ARGC:
+    emit_mov_imm(st, REG_RAX, (long)make_integer(get_operand(buf, pc + 1)));
+    emit_push_rax(st);
+    break;
+  case OP_POP:
+    emit_pop_rax(st);
+    break;
+  case OP_LOAD:
+    emit_load_local(st, REG_RAX, get_operand(buf, pc + 1));
+    emit_push_rax(st);
+    break;
+  case OP_REFG:
+  {
+    int stub = new_stub(st, pc, *next);
+    emit_mov_imm(st, REG_RAX, (long)&env[get_operand(buf, pc + 1)]);
+    emit(st, 3, 0x48, 0x8B, 0x00);                // mov rax, [rax]
+    emit(st, 4, 0x48, 0x83, 0xF8, (int)AQ_UNDEF); // cmp rax, AQ_UNDEF
+    emit_jump(st, CC_E, stub);
+    emit_push_rax(st);
+    break;
+  }
+  case OP_ADD1:
+  case OP_ADD2:
+  case OP_SUB1:
+  case OP_SUB2:
+  {
+    int stub = new_stub(st, pc, *next);
+    int num = (op == OP_ADD1) ? 1 : (op == OP_ADD2) ? 2 : (op == OP_SUB1) ? -1 : -2;
+    emit_peek(st, FALSE);
+    emit_check_int(st, REG_RAX, stub);
+    emit_untag(st, FALSE);
+    emit(st, 1, 0x05); // add eax, num
+    emit32(st, num);
+    emit_tag(st);
+    emit_replace_rax(st, 1);
+    break;
+  }
+  case OP_EQUAL:
+  case OP_LT:
+  case OP_LTE:
+  case OP_GT:
+  case OP_GTE:
+  {
+    int stub = new_stub(st, pc, *next);
+    emit_peek(st, TRUE);
+    emit_check_int(st, REG_RAX, stub);
+    emit_check_int(st, REG_RDX, stub);
+    emit_untag(st, TRUE);
+    emit(st, 2, 0x39, 0xC2); // cmp edx, eax
+    emit_bool(st, comparison_cc(op));
+    emit_replace_rax(st, 2);
+    break;
+  }
+  case OP_EQ:
+    emit_peek(st, TRUE);
+    emit(st, 3, 0x48, 0x39, 0xD0); // cmp rax, rdx
+    emit_bool(st, CC_E);
+    emit_replace_rax(st, 2);
+    break;
+  case OP_CAR:
+  case OP_CDR:
+  {
+    int stub = new_stub(st, pc, *next);
+    emit_peek(st, FALSE);
+    emit_check_pair(st, stub);
+    emit_load_field(st, (op == OP_CAR) ? offsetof(struct cell, _object._cons._car) : offsetof(struct cell, _object._cons._cdr));
+    emit_set_top_rax(st);
+    break;
+  }
+  case OP_CADR:
+  case OP_CDDR:
+  {
+    int stub = new_stub(st, pc, *next);
+    emit_peek(st, FALSE);
+    emit_check_pair(st, stub);
+    emit_load_field(st, offsetof(struct cell, _object._cons._cdr));
+    emit_check_pair(st, stub);
+    emit_load_field(st, (op == OP_CADR) ? offsetof(struct cell, _object._cons._car) : offsetof(struct cell, _object._cons._cdr));
+    emit_set_top_rax(st);
+    break;
+  }
+  case OP_LOAD_CAR:
+  case OP_LOAD_CDR:
+  {
+    int stub = new_stub(st, pc, *next);
+    emit_load_local(st, REG_RAX, get_operand(buf, pc + 1));
+    emit_check_pair(st, stub);
+    emit_load_field(st, (op == OP_LOAD_CAR) ? offsetof(struct cell, _object._cons._car) : offsetof(struct cell, _object._cons._cdr));
+    emit_push_rax(st);
+    break;
+  }
+  case OP_JMP:
+    emit_jump(st, CC_NONE, inst_label(st, get_operand(buf, pc + 1)));
+    break;
+  case OP_JNEQ:
+    emit_pop_rax(st);
+    emit(st, 4, 0x48, 0x83, 0xF8, (int)AQ_TRUE); // cmp rax, AQ_TRUE
+    emit_jump(st, CC_NE, inst_label(st, get_operand(buf, pc + 1)));
+    break;
+  case OP_JNEQUAL:
+  case OP_JNLT:
+  case OP_JNLTE:
+  case OP_JNGT:
+  case OP_JNGTE:
+  {
+    int stub = new_stub(st, pc, *next);
+    emit_peek(st, TRUE);
+    emit_check_int(st, REG_RAX, stub);
+    emit_check_int(st, REG_RDX, stub);
+    emit_untag(st, TRUE);
+    if (st->plain_stack)
+    {
+      emit(st, 5, 0x41, 0x83, 0x2C, 0x24, 2); // sub dword [r12], 2
+      emit(st, 2, 0x39, 0xC2);                // cmp edx, eax
+      emit_jump(st, comparison_cc(op) ^ 1, inst_label(st, get_operand(buf, pc + 1)));
+    }
+    else
+    {
+      emit(st, 2, 0x39, 0xC2); // cmp edx, eax
+      emit_bool(st, comparison_cc(op));
+      emit(st, 3, 0x41, 0x89, 0xC6); // mov r14d, eax
+      emit_call(st, pop_arg);
+      emit_call(st, pop_arg);
+      emit(st, 3, 0x45, 0x85, 0xF6); // test r14d, r14d
+      emit_jump(st, CC_E, inst_label(st, get_operand(buf, pc + 1)));
+    }
+    break;
+  }
+  case OP_JNEQUAL_LL:
+  case OP_JNLT_LL:
+  case OP_JNLTE_LL:
+  case OP_JNGT_LL:
+  case OP_JNGTE_LL:
+  case OP_JNEQUAL_LI:
+  case OP_JNLT_LI:
+  case OP_JNLTE_LI:
+  case OP_JNGT_LI:
+  case OP_JNGTE_LI:
+  {
+    int stub = new_stub(st, pc, *next);
+    emit_load_local(st, REG_RAX, get_operand(buf, pc + 1));
+    emit_check_int(st, REG_RAX, stub);
+    emit_untag(st, FALSE);
+    if (op >= OP_JNEQUAL_LI)
+    {
+      emit(st, 1, 0x3D); // cmp eax, imm32
+      emit32(st, get_operand(buf, pc + 1 + sizeof(Cell)));
+    }
+    else
+    {
+      emit_load_local(st, REG_RDX, get_operand(buf, pc + 1 + sizeof(Cell)));
+      emit_check_int(st, REG_RDX, stub);
+      emit(st, 2, 0xD1, 0xFA); // sar edx, 1
+      emit(st, 2, 0x39, 0xD0); // cmp eax, edx
+    }
+    emit_jump(st, comparison_cc(op) ^ 1, inst_label(st, get_operand(buf, pc + 1 + sizeof(Cell) * 2)));
+    break;
+  }
+  case OP_JNEQUAL_R:
+  case OP_JNLT_R:
+  case OP_JNLTE_R:
+  case OP_JNGT_R:
+  case OP_JNGTE_R:
+  {
+    // no operand is a temporary here, see mark_jump_targets().
+    int stub = new_stub(st, pc, *next);
+    emit_load_int_operand(st, REG_RAX, get_operand(buf, pc + 1), stub);
+    emit_load_int_operand(st, REG_RDX, get_operand(buf, pc + 1 + sizeof(Cell)), stub);
+    emit(st, 2, 0x39, 0xD0); // cmp eax, edx
+    emit_jump(st, comparison_cc(op) ^ 1, inst_label(st, get_operand(buf, pc + 1 + sizeof(Cell) * 2)));
+    break;
+  }
+  case OP_JNEQ_R:
+    emit_load_local(st, REG_RAX, -(get_operand(buf, pc + 1) >> 1) - 4);
+    emit(st, 4, 0x48, 0x83, 0xF8, (int)AQ_TRUE); // cmp rax, AQ_TRUE
+    emit_jump(st, CC_NE, inst_label(st, get_operand(buf, pc + 1 + sizeof(Cell))));
+    break;
+  case OP_FUNC:
+  case OP_FUNCG:
+  case OP_FUNCS:
+    emit_call_runtime(st, jit_call, pc, -1);
+    emit_check_error(st);
+    break;
+  case OP_TFUNCG:
+  case OP_TFUNCS:
+    emit_call_runtime(st, jit_tail_call, pc, -1);
+    emit_check_error(st);
+    // a call of itself loops here instead of going through jit_enter().
+    emit(st, 1, 0x3D); // cmp eax, start
+    emit32(st, st->start);
+    emit_jump(st, CC_E, st->entry_label);
+    emit_jump(st, CC_NONE, st->exit_label);
+    break;
+  case OP_RET:
+    emit_call(st, jit_ret);
+    emit_jump(st, CC_NONE, st->exit_label);
+    break;
+  case OP_FUND:
+  case OP_FUNDD:
+    // the VM makes the lambda; its body is left to be compiled by itself.
+    *next = get_operand(buf, pc + 1);
+    emit_call_runtime(st, jit_run, pc, pc + 1);
+    emit_check_error(st);
+    break;
+  case OP_HALT:
+    return FALSE;
+  default:
+    emit_call_runtime(st, jit_run, pc, *next);
+    emit_check_error(st);
+    break;
+  }
+  return TRUE;
+}
+
+// marks the instructions which are jumped to with -2 in labels.
+static aq_bool mark_jump_targets(jit_state *st)
+{
+  char *buf = st->buf;
+  for (int pc = st->start; pc < st->end; pc += get_inst_size(buf, pc))
+  {
+    int target = -1;
+    switch ((unsigned char)buf[pc])
+    {
+    case OP_JNEQ:
+    case OP_JMP:
+    case OP_JNEQUAL:
+    case OP_JNLT:
+    case OP_JNLTE:
+    case OP_JNGT:
+    case OP_JNGTE:
+      target = get_operand(buf, pc + 1);
+      break;
+    case OP_JNEQUAL_LL:
+    case OP_JNLT_LL:
+    case OP_JNLTE_LL:
+    case OP_JNGT_LL:
+    case OP_JNGTE_LL:
+    case OP_JNEQUAL_LI:
+    case OP_JNLT_LI:
+    case OP_JNLTE_LI:
+    case OP_JNGT_LI:
+    case OP_JNGTE_LI:
+      target = get_operand(buf, pc + 1 + sizeof(Cell) * 2);
+      break;
+    case OP_FUND:
+    case OP_FUNDD:
+      target = get_operand(buf, pc + 1);
+      break;
+    case OP_JNEQUAL_R:
+    case OP_JNLT_R:
+    case OP_JNLTE_R:
+    case OP_JNGT_R:
+    case OP_JNGTE_R:
+      // popping temporaries is left to the VM: the lambda is not compiled.
+      if (TEMPORARY_REGISTER_P(get_operand(buf, pc + 1)) ||
+          TEMPORARY_REGISTER_P(get_operand(buf, pc + 1 + sizeof(Cell))))
+      {
+        return FALSE;
+      }
+      target = get_operand(buf, pc + 1 + sizeof(Cell) * 2);
+      break;
+    case OP_JNEQ_R:
+      if (TEMPORARY_REGISTER_P(get_operand(buf, pc + 1)))
+      {
+        return FALSE;
+      }
+      target = get_operand(buf, pc + 1 + sizeof(Cell));
+      break;
+    default:
+      continue;
+    }
+    if (target < st->start || target > st->end)
+    {
+      return FALSE;
+    }
+    st->labels[inst_label(st, target)] = -2;
+  }
+  return TRUE;
+}
+
+static aq_bool translate(jit_state *st)
+{
+  int len = st->end - st->start;
+  st->labels = grow(st->labels, &st->label_capacity, len + 1, sizeof(int));
+  for (int i = 0; i <= len; i++)
+  {
+    st->labels[i] = -1;
+  }
+  st->label_num = len + 1;
+  if (!mark_jump_targets(st))
+  {
+    return FALSE;
+  }
+  st->entry_label = new_label(st);
+  st->exit_label = new_label(st);
+  st->error_label = new_label(st);
+
+  // prologue: 5 pushes keep rsp aligned to 16 bytes for calls.
+  emit(st, 1, 0x55);       // push rbp
+  emit(st, 1, 0x53);       // push rbx
+  emit(st, 2, 0x41, 0x54); // push r12
+  emit(st, 2, 0x41, 0x55); // push r13
+  emit(st, 2, 0x41, 0x56); // push r14
+  emit_mov_imm(st, 3, (long)stack);       // rbx
+  emit_mov_imm(st, 12, (long)&stack_top); // r12
+  if (st->plain_stack)
+  {
+    // the templates don't check for overflows: the VM runs the function
+    // when the stack may not have room for everything it pushes.
+    emit_load_top_index(st);
+    emit(st, 2, 0x81, 0xF9); // cmp ecx, imm32
+    emit32(st, STACKSIZE - len - 8);
+    int room = new_label(st);
+    emit_jump(st, CC_L, room);
+    emit(st, 1, 0xB8); // mov eax, start
+    emit32(st, st->start);
+    emit_jump(st, CC_NONE, st->exit_label);
+    bind_label(st, room);
+  }
+  bind_label(st, st->entry_label);
+  emit_call(st, get_frame_base);
+  emit(st, 3, 0x49, 0x89, 0xC5); // mov r13, rax
+
+  int pc = st->start;
+  while (pc < st->end)
+  {
+    int next;
+    bind_label(st, inst_label(st, pc));
+    if (!translate_inst(st, pc, &next))
+    {
+      return FALSE;
+    }
+    pc = next;
+  }
+
+  // falling off the end goes on with the VM, as execute() does.
+  bind_label(st, inst_label(st, st->end));
+  emit(st, 1, 0xB8); // mov eax, end
+  emit32(st, st->end);
+  emit_jump(st, CC_NONE, st->exit_label);
+
+  for (int i = 0; i < st->stub_num; i++)
+  {
+    jit_stub *stub = &st->stubs[i];
+    bind_label(st, stub->label);
+    emit_call_runtime(st, jit_run, stub->pc, stub->end);
+    emit_check_error(st);
+    emit_jump(st, CC_NONE, stub->next_label);
+  }
+
+  bind_label(st, st->error_label);
+  emit(st, 1, 0xB8); // mov eax, -1
+  emit32(st, -1);
+  bind_label(st, st->exit_label);
+  emit(st, 2, 0x41, 0x5E); // pop r14
+  emit(st, 2, 0x41, 0x5D); // pop r13
+  emit(st, 2, 0x41, 0x5C); // pop r12
+  emit(st, 1, 0x5B);       // pop rbx
+  emit(st, 1, 0x5D);       // pop rbp
+  emit(st, 1, 0xC3);       // ret
+
+  for (int i = 0; i < st->fixup_num; i += 2)
+  {
+    int pos = st->fixups[i];
+    int target = st->labels[st->fixups[i + 1]];
+    if (target < 0)
+    {
+      // a jump into the middle of an instruction.
+      return FALSE;
+    }
+    int rel = target - (pos + 4);
+    memcpy(&st->code[pos], &rel, sizeof(int));
+  }
+  return TRUE;
+}
+
+// copies the code into the executable region.
+static aq_jit_code install(unsigned char *code, int size)
+{
+  if (!jit_region)
+  {
+    void *region = mmap(NULL, JIT_REGION_SIZE, PROT_READ | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (region == MAP_FAILED)
+    {
+      return NULL;
+    }
+    jit_region = region;
+  }
+  size_t top = (jit_region_top + 15) & ~(size_t)15;
+  if (top + size > JIT_REGION_SIZE ||
+      mprotect(jit_region, JIT_REGION_SIZE, PROT_READ | PROT_WRITE) != 0)
+  {
+    return NULL;
+  }
+  memcpy(&jit_region[top], code, size);
+  mprotect(jit_region, JIT_REGION_SIZE, PROT_READ | PROT_EXEC);
+  jit_region_top = top + size;
+  return (aq_jit_code)&jit_region[top];
+}
+
+// compiles the lambda whose body starts at addr.
+static aq_jit_code jit_compile(char *buf, int addr, int end)
+{
+  jit_state st;
+  memset(&st, 0, sizeof(jit_state));
+  st.buf = buf;
+  st.start = addr;
+  st.end = end;
+  st.plain_stack = gc_plain_stack_p();
+
+  aq_jit_code code = translate(&st) ? install(st.code, st.size) : NULL;
+  free(st.code);
+  free(st.labels);
+  free(st.fixups);
+  free(st.stubs);
+  return code;
+}
+
+aq_jit_code jit_lookup(char *buf, int addr)
+{
+  jit_entry **head = &jit_table[(unsigned int)addr % JIT_TABLE_SIZE];
+  jit_entry *entry = *head;
+  while (entry && (entry->addr != addr || entry->buf != buf))
+  {
+    entry = entry->next;
+  }
+  if (entry == NULL)
+  {
+    entry = (jit_entry *)malloc(sizeof(jit_entry));
+    entry->buf = buf;
+    entry->addr = addr;
+    // the body follows OP_FUND, whose first operand is the end of the body.
+    entry->end = get_operand(buf, addr - sizeof(Cell) * 2);
+    entry->count = 0;
+    entry->failed = FALSE;
+    entry->code = NULL;
+    entry->next = *head;
+    *head = entry;
+  }
+  if (entry->code || entry->failed)
+  {
+    return entry->code;
+  }
+  if (++entry->count > g_JIT_threshold)
+  {
+    entry->code = jit_compile(buf, addr, entry->end);
+    entry->failed = (entry->code == NULL);
+  }
+  return entry->code;
+}
+
+// forgets the code of the lambdas from the bytecode at from on, which is
+// about to be overwritten. their code is left unused in the region.
+void jit_invalidate(int from)
+{
+  for (int i = 0; i < JIT_TABLE_SIZE; i++)
+  {
+    jit_entry **entryp = &jit_table[i];
+    while (*entryp)
+    {
+      jit_entry *entry = *entryp;
+      if (entry->end > from)
+      {
+        *entryp = entry->next;
+        free(entry);
+      }
+      else
+      {
+        entryp = &entry->next;
+      }
+    }
+  }
+}
+
+void jit_term()
+{
+  jit_invalidate(-1);
+  if (jit_region)
+  {
+    munmap(jit_region, JIT_REGION_SIZE);
+    jit_region = NULL;
+    jit_region_top = 0;
+  }
+}
+#endif
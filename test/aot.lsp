@@ -0,0 +1,6 @@
+(define fib (lambda (n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2))))))
+(define iota (lambda (n acc) (if (= n 0) acc (iota (- n 1) (cons n acc)))))
+(define sum (lambda (l) (if (eq? l '()) 0 (+ (car l) (sum (cdr l))))))
+(print (fib 25) (iota 5 '()) (sum (iota 100 '())))
+(car 1)
+(print 1)
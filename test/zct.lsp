@@ -0,0 +1,4 @@
+(define iota (lambda (n acc) (if (= n 0) acc (iota (- n 1) (cons n acc)))))
+(define len (lambda (l acc) (if (eq? l '()) acc (len (cdr l) (+ acc 1)))))
+(define hold (lambda (n a b c d e) (if (= n 0) (len (iota 20000 '()) 0) (+ (car a) (car b) (car c) (car d) (car e) (hold (- n 1) (cons 1 1) (cons 1 1) (cons 1 1) (cons 1 1) (cons 1 1))))))
+(print (hold 1000 (cons 0 0) (cons 0 0) (cons 0 0) (cons 0 0) (cons 0 0)))